@@ -0,0 +1,13 @@
+#!/bin/env sh
+
+case "$OSTYPE" in
+  msys*)    f=bench_encode.exe ;;
+  *)        f=bench_encode.out ;;
+esac
+case "$OSTYPE" in
+  msys*)    std=c99 ;;
+  *)        std=gnu99 ;;
+esac
+
+clang --std=$std src/bench_encode.c -Wall -Wextra -pedantic -O2 -g -Wno-unused-function -o $f || exit 1
+./$f "$@"
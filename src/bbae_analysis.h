@@ -0,0 +1,1027 @@
+#ifndef BBAE_ANALYSIS
+#define BBAE_ANALYSIS
+
+#include "compiler_common.h"
+
+// control flow analyses used by optimization passes and backends
+// results are cached on the blocks themselves, and need to be recalculated whenever the CFG changes
+
+// writes the successors of the given block into `out` and returns how many there are (0, 1, or 2)
+// an if statement with the same target on both sides still reports it twice
+static size_t block_get_successors(Function * func, Block * block, Block ** out)
+{
+    Statement * exit = array_last(block->statements, Statement *);
+    if (strcmp(exit->statement_name, "goto") == 0)
+    {
+        out[0] = find_block(func, exit->args[0].text);
+        assert(out[0]);
+        return 1;
+    }
+    if (strcmp(exit->statement_name, "if") == 0)
+    {
+        size_t separator_pos = find_separator_index(exit->args);
+        assert(separator_pos != (size_t)-1);
+        out[0] = find_block(func, exit->args[1].text);
+        out[1] = find_block(func, exit->args[separator_pos + 1].text);
+        assert(out[0] && out[1]);
+        return 2;
+    }
+    return 0;
+}
+
+// returns the blocks reachable from the entry block in reverse postorder, so that every block comes after all of its
+// predecessors except the ones that reach it through a back edge
+// leaves each block's index within func->blocks in its temp field
+static Block ** func_reverse_postorder(Function * func)
+{
+    size_t block_count = array_len(func->blocks, Block *);
+    for (size_t b = 0; b < block_count; b++)
+        func->blocks[b]->temp = b;
+    Block ** order = (Block **)zero_alloc(0);
+    if (block_count == 0)
+        return order;
+    
+    uint8_t * seen = (uint8_t *)zero_alloc(block_count);
+    size_t * next_succ = (size_t *)zero_alloc(sizeof(size_t) * block_count);
+    size_t * stack = (size_t *)zero_alloc(0);
+    array_push(stack, size_t, 0);
+    seen[0] = 1;
+    while (array_len(stack, size_t) > 0)
+    {
+        size_t b = array_last(stack, size_t);
+        Block * succ[2];
+        size_t succ_count = block_get_successors(func, func->blocks[b], succ);
+        if (next_succ[b] < succ_count)
+        {
+            Block * next = succ[next_succ[b]++];
+            if (!seen[next->temp])
+            {
+                seen[next->temp] = 1;
+                array_push(stack, size_t, next->temp);
+            }
+        }
+        else
+        {
+            array_push(order, Block *, func->blocks[b]);
+            array_erase(stack, size_t, array_len(stack, size_t) - 1);
+        }
+    }
+    
+    for (size_t i = 0; i < array_len(order, Block *) / 2; i++)
+    {
+        Block * temp = order[i];
+        order[i] = order[array_len(order, Block *) - 1 - i];
+        order[array_len(order, Block *) - 1 - i] = temp;
+    }
+    return order;
+}
+
+// blocks that only exist to report errors or kill the program
+static uint8_t block_is_cold(Block * block)
+{
+    for (size_t i = 0; i < array_len(block->statements, Statement *); i++)
+    {
+        Statement * statement = block->statements[i];
+        if (strcmp(statement->statement_name, "exit") == 0 ||
+            strcmp(statement->statement_name, "breakpoint") == 0)
+            return 1;
+    }
+    return 0;
+}
+
+// finds natural loops, setting loop_depth and is_loop_header on every block of the function
+// unreachable blocks are given a loop depth of zero
+// leaves each block's index within func->blocks in its temp field
+static void func_analyze_loops(Function * func)
+{
+    size_t block_count = array_len(func->blocks, Block *);
+    for (size_t b = 0; b < block_count; b++)
+    {
+        func->blocks[b]->temp = b;
+        func->blocks[b]->loop_depth = 0;
+        func->blocks[b]->is_loop_header = 0;
+    }
+    if (block_count == 0)
+        return;
+    
+    // iterative DFS from the entry block to find back edges
+    // 1: on the DFS stack, 2: finished
+    uint8_t * state = (uint8_t *)zero_alloc(block_count);
+    size_t * next_succ = (size_t *)zero_alloc(sizeof(size_t) * block_count);
+    size_t * stack = (size_t *)zero_alloc(0);
+    Block ** back_edge_from = (Block **)zero_alloc(0);
+    Block ** back_edge_to = (Block **)zero_alloc(0);
+    
+    array_push(stack, size_t, 0);
+    state[0] = 1;
+    while (array_len(stack, size_t) > 0)
+    {
+        size_t b = array_last(stack, size_t);
+        Block * succ[2];
+        size_t succ_count = block_get_successors(func, func->blocks[b], succ);
+        if (next_succ[b] < succ_count)
+        {
+            Block * next = succ[next_succ[b]++];
+            if (state[next->temp] == 0)
+            {
+                state[next->temp] = 1;
+                array_push(stack, size_t, next->temp);
+            }
+            else if (state[next->temp] == 1)
+            {
+                array_push(back_edge_from, Block *, func->blocks[b]);
+                array_push(back_edge_to, Block *, next);
+            }
+        }
+        else
+        {
+            state[b] = 2;
+            array_erase(stack, size_t, array_len(stack, size_t) - 1);
+        }
+    }
+    
+    // collect each loop body by walking backwards from its latches until hitting the header
+    uint8_t * in_body = (uint8_t *)zero_alloc(block_count);
+    Block ** worklist = (Block **)zero_alloc(0);
+    for (size_t e = 0; e < array_len(back_edge_to, Block *); e++)
+    {
+        Block * header = back_edge_to[e];
+        if (header->is_loop_header)
+            continue;
+        header->is_loop_header = 1;
+        
+        memset(in_body, 0, block_count);
+        in_body[header->temp] = 1;
+        for (size_t e2 = e; e2 < array_len(back_edge_to, Block *); e2++)
+        {
+            if (back_edge_to[e2] == header)
+                array_push(worklist, Block *, back_edge_from[e2]);
+        }
+        
+        uint8_t irreducible = 0;
+        while (array_len(worklist, Block *) > 0)
+        {
+            Block * block = array_last(worklist, Block *);
+            array_erase(worklist, Block *, array_len(worklist, Block *) - 1);
+            if (in_body[block->temp] || state[block->temp] == 0)
+                continue;
+            // escaped through the entry block, so the header doesn't dominate the loop
+            if (block->temp == 0)
+                irreducible = 1;
+            in_body[block->temp] = 1;
+            for (size_t i = 0; i < array_len(block->edges_in, Statement *); i++)
+                array_push(worklist, Block *, block->edges_in[i]->block);
+        }
+        
+        if (irreducible)
+        {
+            // no sensible body; only count the header itself
+            header->loop_depth += 1;
+            continue;
+        }
+        for (size_t b = 0; b < block_count; b++)
+        {
+            if (in_body[b])
+                func->blocks[b]->loop_depth += 1;
+        }
+    }
+}
+
+// estimates how often each block runs relative to the entry block, storing it in the block's weight field
+// blocks with a recorded profile weight use it as-is; otherwise, loop bodies are assumed to run 8 times per
+// iteration of their parent loop, and error/exit blocks are assumed to never run
+static void func_estimate_block_weights(Function * func)
+{
+    func_analyze_loops(func);
+    for (size_t b = 0; b < array_len(func->blocks, Block *); b++)
+    {
+        Block * block = func->blocks[b];
+        if (block->profile_weight)
+            block->weight = block->profile_weight;
+        else if (block_is_cold(block))
+            block->weight = 0;
+        else
+        {
+            uint32_t depth = block->loop_depth;
+            if (depth > 6)
+                depth = 6;
+            block->weight = (uint64_t)1 << (depth * 3);
+        }
+    }
+}
+
+// finds the immediate dominator of every block, by index within func->blocks (Cooper, Harvey, and Kennedy's algorithm)
+// the entry block is its own immediate dominator, and unreachable blocks get (size_t)-1
+// leaves each block's index within func->blocks in its temp field
+static size_t * func_immediate_dominators(Function * func)
+{
+    size_t block_count = array_len(func->blocks, Block *);
+    Block ** order = func_reverse_postorder(func);
+    size_t * rpo_index = (size_t *)zero_alloc(sizeof(size_t) * block_count);
+    size_t * idom = (size_t *)zero_alloc(sizeof(size_t) * block_count);
+    for (size_t b = 0; b < block_count; b++)
+    {
+        rpo_index[b] = (size_t)-1;
+        idom[b] = (size_t)-1;
+    }
+    for (size_t i = 0; i < array_len(order, Block *); i++)
+        rpo_index[order[i]->temp] = i;
+    if (block_count == 0)
+        return idom;
+    idom[0] = 0;
+    
+    uint8_t changed = 1;
+    while (changed)
+    {
+        changed = 0;
+        for (size_t i = 1; i < array_len(order, Block *); i++)
+        {
+            Block * block = order[i];
+            size_t new_idom = (size_t)-1;
+            for (size_t e = 0; e < array_len(block->edges_in, Statement *); e++)
+            {
+                size_t pred = block->edges_in[e]->block->temp;
+                if (idom[pred] == (size_t)-1)
+                    continue;
+                if (new_idom == (size_t)-1)
+                {
+                    new_idom = pred;
+                    continue;
+                }
+                // walk both up the tree until they meet
+                size_t a = pred;
+                size_t b = new_idom;
+                while (a != b)
+                {
+                    while (rpo_index[a] > rpo_index[b])
+                        a = idom[a];
+                    while (rpo_index[b] > rpo_index[a])
+                        b = idom[b];
+                }
+                new_idom = a;
+            }
+            if (idom[block->temp] != new_idom)
+            {
+                idom[block->temp] = new_idom;
+                changed = 1;
+            }
+        }
+    }
+    return idom;
+}
+
+// unsigned integer range analysis
+// every integer block argument and statement output gets a range of values it can possibly hold, interpreted as
+// unsigned and inclusive on both ends. ranges are seeded by constants, masks, extensions, and the comparisons that
+// control `if` edges, then propagated through block arguments until nothing changes
+typedef struct _ValueRange {
+    Value * value;
+    uint64_t lo;
+    uint64_t hi;
+    uint32_t widen_count; // how many times a block argument's range has grown; used to force loops to converge
+} ValueRange;
+
+static uint64_t _range_mask(Type type)
+{
+    size_t bits = type_size(type) * 8;
+    return bits >= 64 ? ~(uint64_t)0 : ((uint64_t)1 << bits) - 1;
+}
+static ValueRange _range_full(Type type)
+{
+    ValueRange ret;
+    memset(&ret, 0, sizeof(ValueRange));
+    ret.hi = _range_mask(type);
+    return ret;
+}
+static ValueRange _range_make(uint64_t lo, uint64_t hi)
+{
+    ValueRange ret;
+    memset(&ret, 0, sizeof(ValueRange));
+    ret.lo = lo;
+    ret.hi = hi;
+    return ret;
+}
+// smallest all-ones mask covering n
+static uint64_t _range_smear(uint64_t n)
+{
+    n |= n >> 1;
+    n |= n >> 2;
+    n |= n >> 4;
+    n |= n >> 8;
+    n |= n >> 16;
+    n |= n >> 32;
+    return n;
+}
+
+// looks up the range of any value, whether or not it's tracked by the analysis
+// untracked values (function arguments, non-integers, values in unreachable blocks) get the full range of their type
+static ValueRange value_get_range(ValueRange * ranges, Value * value)
+{
+    if (!type_is_int(value->type))
+        return _range_make(0, ~(uint64_t)0);
+    if (value->variant == VALUE_CONST)
+    {
+        uint64_t n = value->constant & _range_mask(value->type);
+        return _range_make(n, n);
+    }
+    if (value->temp < array_len(ranges, ValueRange) && ranges[value->temp].value == value &&
+        ranges[value->temp].lo <= ranges[value->temp].hi)
+        return ranges[value->temp];
+    return _range_full(value->type);
+}
+
+static ValueRange _range_of_statement(ValueRange * ranges, Statement * statement)
+{
+    Type type = statement->output->type;
+    uint64_t mask = _range_mask(type);
+    uint64_t bits = type_size(type) * 8;
+    const char * name = statement->statement_name;
+    
+    if (strcmp(name, "mov") == 0)
+        return value_get_range(ranges, statement->args[0].value);
+    if (strncmp(name, "cmp_", 4) == 0 || strncmp(name, "icmp_", 5) == 0 || strncmp(name, "fcmp_", 5) == 0 ||
+        strcmp(name, "not") == 0 || strcmp(name, "bool") == 0 || strcmp(name, "fbool") == 0 || strcmp(name, "fnan") == 0)
+        return _range_make(0, 1);
+    if (strcmp(name, "zext") == 0)
+        return value_get_range(ranges, statement->args[1].value);
+    if (strcmp(name, "trim") == 0 || strcmp(name, "sext") == 0)
+    {
+        // trimming a value that already fits is lossless, and so is sign-extending a value without its top bit set
+        Value * arg = statement->args[1].value;
+        ValueRange a = value_get_range(ranges, arg);
+        uint64_t limit = strcmp(name, "trim") == 0 ? mask : (_range_mask(arg->type) >> 1);
+        if (a.hi <= limit)
+            return a;
+        return _range_full(type);
+    }
+    
+    if (array_len(statement->args, Operand) != 2 ||
+        statement->args[0].variant != OP_KIND_VALUE || statement->args[1].variant != OP_KIND_VALUE)
+        return _range_full(type);
+    ValueRange a = value_get_range(ranges, statement->args[0].value);
+    ValueRange b = value_get_range(ranges, statement->args[1].value);
+    
+    if (strcmp(name, "and") == 0)
+        return _range_make(0, a.hi < b.hi ? a.hi : b.hi);
+    if (strcmp(name, "or") == 0)
+        return _range_make(a.lo > b.lo ? a.lo : b.lo, _range_smear(a.hi | b.hi));
+    if (strcmp(name, "xor") == 0)
+        return _range_make(0, _range_smear(a.hi | b.hi));
+    if (strcmp(name, "add") == 0 && a.hi <= mask - b.hi)
+        return _range_make(a.lo + b.lo, a.hi + b.hi);
+    if (strcmp(name, "sub") == 0 && a.lo >= b.hi)
+        return _range_make(a.lo - b.hi, a.hi - b.lo);
+    if (strcmp(name, "mul") == 0 && (a.hi == 0 || b.hi <= mask / a.hi))
+        return _range_make(a.lo * b.lo, a.hi * b.hi);
+    if (strcmp(name, "div") == 0 || strcmp(name, "div_unsafe") == 0)
+    {
+        if (b.lo >= 1)
+            return _range_make(a.lo / b.hi, a.hi / b.lo);
+        // safe division by zero produces 1
+        if (strcmp(name, "div") == 0)
+            return _range_make(0, a.hi > 1 ? a.hi : 1);
+    }
+    if (strcmp(name, "rem") == 0 || strcmp(name, "rem_unsafe") == 0)
+    {
+        if (b.hi == 0)
+            return _range_make(0, 0);
+        return _range_make(0, a.hi < b.hi - 1 ? a.hi : b.hi - 1);
+    }
+    if (strcmp(name, "shl") == 0 && b.lo == b.hi && b.lo < bits && a.hi <= mask >> b.lo)
+        return _range_make(a.lo << b.lo, a.hi << b.lo);
+    if (strcmp(name, "shr") == 0 || strcmp(name, "shr_unsafe") == 0)
+    {
+        if (b.hi < bits)
+            return _range_make(a.lo >> b.hi, a.hi >> b.lo);
+        // safe right shifts by too much produce 0
+        if (strcmp(name, "shr") == 0)
+            return _range_make(0, a.hi);
+    }
+    // the signed operations behave like their unsigned counterparts when nothing has the sign bit set
+    if ((strcmp(name, "sar") == 0 || strcmp(name, "sar_unsafe") == 0) && a.hi <= mask >> 1 && b.hi < bits)
+        return _range_make(a.lo >> b.hi, a.hi >> b.lo);
+    if ((strcmp(name, "idiv") == 0 || strcmp(name, "idiv_unsafe") == 0) && a.hi <= mask >> 1 && b.hi <= mask >> 1 && b.lo >= 1)
+        return _range_make(a.lo / b.hi, a.hi / b.lo);
+    if ((strcmp(name, "irem") == 0 || strcmp(name, "irem_unsafe") == 0) && a.hi <= mask >> 1 && b.hi <= mask >> 1 && b.lo >= 1)
+        return _range_make(0, a.hi < b.hi - 1 ? a.hi : b.hi - 1);
+    
+    return _range_full(type);
+}
+
+// narrows `r`, the range of `value`, along one side of an `if` statement, based on what its condition says about it
+static ValueRange _range_refine_for_edge(ValueRange r, Statement * exit, uint8_t truth, Value * value)
+{
+    Value * cond = exit->args[0].value;
+    
+    uint64_t lo = 0;
+    uint64_t hi = ~(uint64_t)0;
+    if (cond == value)
+    {
+        if (truth)
+            lo = 1;
+        else
+            hi = 0;
+    }
+    else if (cond->variant == VALUE_SSA && array_len(cond->ssa->args, Operand) == 2 &&
+             strncmp(cond->ssa->statement_name, "cmp_", 4) == 0)
+    {
+        Statement * cmp = cond->ssa;
+        const char * pred = cmp->statement_name + 4;
+        Value * x = cmp->args[0].value;
+        Value * c = cmp->args[1].value;
+        // normalize to `x pred c`
+        if (x->variant == VALUE_CONST && c == value)
+        {
+            Value * temp = x;
+            x = c;
+            c = temp;
+            if (strcmp(pred, "l") == 0) pred = "g";
+            else if (strcmp(pred, "g") == 0) pred = "l";
+            else if (strcmp(pred, "le") == 0) pred = "ge";
+            else if (strcmp(pred, "ge") == 0) pred = "le";
+        }
+        if (x != value || c->variant != VALUE_CONST || !type_is_int(c->type))
+            return r;
+        if (!truth)
+        {
+            if (strcmp(pred, "l") == 0) pred = "ge";
+            else if (strcmp(pred, "ge") == 0) pred = "l";
+            else if (strcmp(pred, "g") == 0) pred = "le";
+            else if (strcmp(pred, "le") == 0) pred = "g";
+            else if (strcmp(pred, "eq") == 0) pred = "ne";
+            else if (strcmp(pred, "ne") == 0) pred = "eq";
+        }
+        uint64_t n = c->constant & _range_mask(c->type);
+        if (strcmp(pred, "l") == 0 && n > 0)
+            hi = n - 1;
+        else if (strcmp(pred, "le") == 0)
+            hi = n;
+        else if (strcmp(pred, "g") == 0 && n < _range_mask(c->type))
+            lo = n + 1;
+        else if (strcmp(pred, "ge") == 0)
+            lo = n;
+        else if (strcmp(pred, "eq") == 0)
+        {
+            lo = n;
+            hi = n;
+        }
+        else if (strcmp(pred, "ne") == 0)
+        {
+            if (n == r.lo && r.lo < r.hi)
+                lo = n + 1;
+            else if (n == r.hi && r.lo < r.hi)
+                hi = n - 1;
+        }
+    }
+    
+    // an empty intersection means the edge can't be taken; leave it alone
+    if (lo > r.hi || hi < r.lo)
+        return r;
+    if (lo > r.lo)
+        r.lo = lo;
+    if (hi < r.hi)
+        r.hi = hi;
+    return r;
+}
+
+// merges incoming ranges into a block's arguments, returning whether anything grew
+static uint8_t _range_flow_into(ValueRange * ranges, Function * func, Statement * exit, Operand * args, size_t count,
+                                const char * label, int truth)
+{
+    Block * target = find_block(func, label);
+    assert(target);
+    assert(array_len(target->args, Value *) == count);
+    uint8_t changed = 0;
+    for (size_t i = 0; i < count; i++)
+    {
+        Value * arg = target->args[i];
+        if (!type_is_int(arg->type))
+            continue;
+        ValueRange * dest = &ranges[arg->temp];
+        ValueRange r = value_get_range(ranges, args[i].value);
+        if (truth >= 0)
+            r = _range_refine_for_edge(r, exit, truth, args[i].value);
+        if (dest->lo <= dest->hi)
+        {
+            if (r.lo >= dest->lo && r.hi <= dest->hi)
+                continue;
+            // loops that keep growing a value's range would take forever to settle, so give up on them quickly,
+            // keeping only what the edge's condition says (e.g. the bound of a loop counter)
+            dest->widen_count += 1;
+            if (dest->widen_count > 4)
+            {
+                r = _range_full(arg->type);
+                if (truth >= 0)
+                    r = _range_refine_for_edge(r, exit, truth, args[i].value);
+            }
+            if (dest->lo < r.lo)
+                r.lo = dest->lo;
+            if (dest->hi > r.hi)
+                r.hi = dest->hi;
+        }
+        dest->lo = r.lo;
+        dest->hi = r.hi;
+        changed = 1;
+    }
+    return changed;
+}
+
+// computes ranges for every integer block argument and statement output in the function
+// leaves each tracked value's index into the returned array in its temp field; query it with value_get_range
+static ValueRange * func_analyze_ranges(Function * func)
+{
+    ValueRange * ranges = (ValueRange *)zero_alloc(0);
+    size_t block_count = array_len(func->blocks, Block *);
+    for (size_t b = 0; b < block_count; b++)
+    {
+        Block * block = func->blocks[b];
+        block->temp = b;
+        for (size_t i = 0; i < array_len(block->args, Value *); i++)
+        {
+            ValueRange r = _range_make(1, 0); // empty until an edge reaches it
+            r.value = block->args[i];
+            block->args[i]->temp = array_len(ranges, ValueRange);
+            array_push(ranges, ValueRange, r);
+        }
+        for (size_t i = 0; i < array_len(block->statements, Statement *); i++)
+        {
+            Value * output = block->statements[i]->output;
+            if (!output || output->variant != VALUE_SSA)
+                continue;
+            ValueRange r = _range_make(1, 0);
+            r.value = output;
+            output->temp = array_len(ranges, ValueRange);
+            array_push(ranges, ValueRange, r);
+        }
+    }
+    if (block_count == 0)
+        return ranges;
+    
+    // the entry block can be entered from outside, so its arguments can be anything
+    for (size_t i = 0; i < array_len(func->blocks[0]->args, Value *); i++)
+    {
+        Value * arg = func->blocks[0]->args[i];
+        ranges[arg->temp].lo = 0;
+        ranges[arg->temp].hi = type_is_int(arg->type) ? _range_mask(arg->type) : ~(uint64_t)0;
+    }
+    
+    uint8_t * queued = (uint8_t *)zero_alloc(block_count);
+    uint8_t * visited = (uint8_t *)zero_alloc(block_count);
+    Block ** worklist = (Block **)zero_alloc(0);
+    array_push(worklist, Block *, func->blocks[0]);
+    queued[0] = 1;
+    while (array_len(worklist, Block *) > 0)
+    {
+        Block * block = worklist[0];
+        array_erase(worklist, Block *, 0);
+        queued[block->temp] = 0;
+        visited[block->temp] = 1;
+        
+        for (size_t i = 0; i < array_len(block->statements, Statement *); i++)
+        {
+            Statement * statement = block->statements[i];
+            if (!statement->output || statement->output->variant != VALUE_SSA || !type_is_int(statement->output->type))
+                continue;
+            ValueRange r = _range_of_statement(ranges, statement);
+            ranges[statement->output->temp].lo = r.lo;
+            ranges[statement->output->temp].hi = r.hi;
+        }
+        
+        Statement * exit = array_last(block->statements, Statement *);
+        Block * succ[2];
+        uint8_t changed[2] = {0, 0};
+        size_t succ_count = block_get_successors(func, block, succ);
+        if (strcmp(exit->statement_name, "goto") == 0)
+            changed[0] = _range_flow_into(ranges, func, exit, exit->args + 1, array_len(exit->args, Operand) - 1,
+                                          exit->args[0].text, -1);
+        else if (strcmp(exit->statement_name, "if") == 0)
+        {
+            size_t separator_pos = find_separator_index(exit->args);
+            changed[0] = _range_flow_into(ranges, func, exit, exit->args + 2, separator_pos - 2, exit->args[1].text, 1);
+            changed[1] = _range_flow_into(ranges, func, exit, exit->args + separator_pos + 2,
+                                          array_len(exit->args, Operand) - separator_pos - 2,
+                                          exit->args[separator_pos + 1].text, 0);
+        }
+        for (size_t s = 0; s < succ_count; s++)
+        {
+            if ((changed[s] || !visited[succ[s]->temp]) && !queued[succ[s]->temp])
+            {
+                queued[succ[s]->temp] = 1;
+                array_push(worklist, Block *, succ[s]);
+            }
+        }
+    }
+    return ranges;
+}
+
+// liveness analysis
+// every argument and statement output gets a dense id, left in its temp field, and each block gets bitsets over those
+// ids of what's live on the way in and on the way out. SSA values are block-local, so only a block's own arguments
+// can be live on the way in, and only the values it passes along its edges can be live on the way out; the analysis
+// is about which of those actually get used by something, transitively, rather than just passed along forever
+// a statement with an unused output and no side effects doesn't keep its operands alive
+typedef struct _Liveness {
+    Value ** values; // by id
+    size_t word_count;
+    uint64_t ** live_in; // by block index within func->blocks
+    uint64_t ** live_out;
+} Liveness;
+
+static inline uint8_t bitset_get(uint64_t * set, size_t n)
+{
+    return (set[n / 64] >> (n % 64)) & 1;
+}
+static inline void bitset_set(uint64_t * set, size_t n)
+{
+    set[n / 64] |= (uint64_t)1 << (n % 64);
+}
+static inline void bitset_clear(uint64_t * set, size_t n)
+{
+    set[n / 64] &= ~((uint64_t)1 << (n % 64));
+}
+
+// values from other functions, constants, and stack slots aren't tracked
+static uint8_t _liveness_tracks(Liveness * liveness, Value * value)
+{
+    return value && value->variant != VALUE_CONST && value->variant != VALUE_STACKADDR &&
+        value->temp < array_len(liveness->values, Value *) && liveness->values[value->temp] == value;
+}
+
+static uint8_t liveness_value_is_live_in(Liveness * liveness, size_t block_index, Value * value)
+{
+    return _liveness_tracks(liveness, value) && bitset_get(liveness->live_in[block_index], value->temp);
+}
+
+// marks the values that the block's terminator passes to live arguments of its successors, or otherwise uses
+static void _liveness_mark_exit(Liveness * liveness, Function * func, Block * block, uint64_t * live, uint64_t * out)
+{
+    Statement * exit = array_last(block->statements, Statement *);
+    size_t arg_count = array_len(exit->args, Operand);
+    if (strcmp(exit->statement_name, "goto") != 0 && strcmp(exit->statement_name, "if") != 0)
+    {
+        for (size_t i = 0; i < arg_count; i++)
+        {
+            if (_liveness_tracks(liveness, exit->args[i].value))
+                bitset_set(live, exit->args[i].value->temp);
+        }
+        return;
+    }
+    
+    size_t separator_pos = strcmp(exit->statement_name, "if") == 0 ? find_separator_index(exit->args) : arg_count;
+    if (strcmp(exit->statement_name, "if") == 0 && _liveness_tracks(liveness, exit->args[0].value))
+        bitset_set(live, exit->args[0].value->temp);
+    for (size_t side = 0; side < 2; side++)
+    {
+        size_t label = side == 0 ? (strcmp(exit->statement_name, "if") == 0) : separator_pos + 1;
+        if (label >= arg_count)
+            continue;
+        Block * target = find_block(func, exit->args[label].text);
+        assert(target);
+        for (size_t i = 0; i < array_len(target->args, Value *); i++)
+        {
+            Value * value = exit->args[label + 1 + i].value;
+            if (!_liveness_tracks(liveness, value) || !bitset_get(liveness->live_in[target->temp], target->args[i]->temp))
+                continue;
+            bitset_set(live, value->temp);
+            bitset_set(out, value->temp);
+        }
+    }
+}
+
+// finds what's live into and out of every block, iterating to a fixed point. it's a backwards problem, so each round
+// walks the reverse postorder from the back, with unreachable blocks first
+// leaves each block's index within func->blocks in its temp field
+static Liveness func_analyze_liveness(Function * func)
+{
+    Liveness liveness;
+    memset(&liveness, 0, sizeof(Liveness));
+    liveness.values = (Value **)zero_alloc(0);
+    size_t block_count = array_len(func->blocks, Block *);
+    for (size_t b = 0; b < block_count; b++)
+    {
+        Block * block = func->blocks[b];
+        Value ** args = block == func->entry_block ? func->args : block->args;
+        for (size_t i = 0; i < array_len(args, Value *); i++)
+        {
+            args[i]->temp = array_len(liveness.values, Value *);
+            array_push(liveness.values, Value *, args[i]);
+        }
+        for (size_t i = 0; i < array_len(block->statements, Statement *); i++)
+        {
+            Value * output = block->statements[i]->output;
+            if (!output)
+                continue;
+            output->temp = array_len(liveness.values, Value *);
+            array_push(liveness.values, Value *, output);
+        }
+    }
+    liveness.word_count = (array_len(liveness.values, Value *) + 63) / 64;
+    liveness.live_in = (uint64_t **)zero_alloc(sizeof(uint64_t *) * block_count);
+    liveness.live_out = (uint64_t **)zero_alloc(sizeof(uint64_t *) * block_count);
+    for (size_t b = 0; b < block_count; b++)
+    {
+        liveness.live_in[b] = (uint64_t *)zero_alloc(sizeof(uint64_t) * liveness.word_count);
+        liveness.live_out[b] = (uint64_t *)zero_alloc(sizeof(uint64_t) * liveness.word_count);
+    }
+    
+    Block ** order = func_reverse_postorder(func);
+    uint8_t * ordered = (uint8_t *)zero_alloc(block_count);
+    for (size_t i = 0; i < array_len(order, Block *); i++)
+        ordered[order[i]->temp] = 1;
+    Block ** backwards = (Block **)zero_alloc(0);
+    for (size_t b = 0; b < block_count; b++)
+    {
+        if (!ordered[b])
+            array_push(backwards, Block *, func->blocks[b]);
+    }
+    for (size_t i = array_len(order, Block *); i > 0; i--)
+        array_push(backwards, Block *, order[i - 1]);
+    
+    uint64_t * live = (uint64_t *)zero_alloc(sizeof(uint64_t) * liveness.word_count);
+    uint8_t changed = 1;
+    while (changed)
+    {
+        changed = 0;
+        for (size_t n = 0; n < array_len(backwards, Block *); n++)
+        {
+            Block * block = backwards[n];
+            size_t b = block->temp;
+            memset(live, 0, sizeof(uint64_t) * liveness.word_count);
+            memset(liveness.live_out[b], 0, sizeof(uint64_t) * liveness.word_count);
+            _liveness_mark_exit(&liveness, func, block, live, liveness.live_out[b]);
+            
+            for (size_t i = array_len(block->statements, Statement *) - 1; i > 0; i--)
+            {
+                Statement * statement = block->statements[i - 1];
+                if (statement->output)
+                {
+                    if (!bitset_get(live, statement->output->temp) && !statement_has_side_effects(statement))
+                        continue;
+                    bitset_clear(live, statement->output->temp);
+                }
+                for (size_t j = 0; j < array_len(statement->args, Operand); j++)
+                {
+                    if (_liveness_tracks(&liveness, statement->args[j].value))
+                        bitset_set(live, statement->args[j].value->temp);
+                }
+            }
+            
+            Value ** args = block == func->entry_block ? func->args : block->args;
+            for (size_t i = 0; i < array_len(args, Value *); i++)
+            {
+                if (bitset_get(live, args[i]->temp) && !bitset_get(liveness.live_in[b], args[i]->temp))
+                {
+                    bitset_set(liveness.live_in[b], args[i]->temp);
+                    changed = 1;
+                }
+            }
+        }
+    }
+    return liveness;
+}
+
+// alias analysis
+// memory accesses are described by the base they're relative to and, if it's known, their offset from it. accesses
+// relative to different stack slots or globals never overlap, and neither do accesses relative to a stack slot whose
+// address never escapes and anything else
+enum MemBaseKind {
+    MEMBASE_UNKNOWN, // relative to some pointer value that we can't see through
+    MEMBASE_SLOT, // relative to a stack slot
+    MEMBASE_GLOBAL, // relative to a global (or other symbol)
+};
+
+typedef struct _MemLoc {
+    uint8_t kind;
+    Value * base; // the stack slot for MEMBASE_SLOT, the pointer value for MEMBASE_UNKNOWN
+    const char * symbol; // for MEMBASE_GLOBAL
+    uint8_t offset_known;
+    int64_t offset;
+    uint64_t size;
+} MemLoc;
+
+static uint8_t _memloc_const(Value * value, int64_t * out)
+{
+    // constants often get moved into registers before being used
+    if (value->variant == VALUE_SSA && strcmp(value->ssa->statement_name, "mov") == 0)
+        value = value->ssa->args[0].value;
+    if (value->variant != VALUE_CONST || !(type_is_int(value->type) || type_is_ptr(value->type)))
+        return 0;
+    size_t bits = type_size(value->type) * 8;
+    uint64_t n = value->constant;
+    if (bits < 64)
+    {
+        uint64_t sign = (uint64_t)1 << (bits - 1);
+        n &= (sign << 1) - 1;
+        n = (n ^ sign) - sign;
+    }
+    *out = (int64_t)n;
+    return 1;
+}
+
+// describes `size` bytes at the given address
+static MemLoc memloc_of_address(Value * address, uint64_t size)
+{
+    MemLoc ret;
+    memset(&ret, 0, sizeof(MemLoc));
+    ret.kind = MEMBASE_UNKNOWN;
+    ret.base = address;
+    ret.offset_known = 1;
+    ret.size = size;
+    
+    // walk back through address arithmetic, which can only ever happen within a block
+    while (1)
+    {
+        if (address->variant == VALUE_STACKADDR)
+        {
+            ret.kind = MEMBASE_SLOT;
+            ret.base = address;
+            return ret;
+        }
+        if (address->variant != VALUE_SSA)
+            break;
+        Statement * def = address->ssa;
+        int64_t n = 0;
+        if (strcmp(def->statement_name, "symbol_lookup") == 0 || strcmp(def->statement_name, "symbol_lookup_unsized") == 0)
+        {
+            ret.kind = MEMBASE_GLOBAL;
+            ret.base = 0;
+            ret.symbol = def->args[0].text;
+            return ret;
+        }
+        if (strcmp(def->statement_name, "mov") == 0 && def->args[0].value->variant != VALUE_CONST)
+            address = def->args[0].value;
+        else if ((strcmp(def->statement_name, "add") == 0 || strcmp(def->statement_name, "sub") == 0) &&
+                 _memloc_const(def->args[1].value, &n))
+        {
+            ret.offset += strcmp(def->statement_name, "add") == 0 ? n : -n;
+            address = def->args[0].value;
+        }
+        else if (strcmp(def->statement_name, "add") == 0 && _memloc_const(def->args[0].value, &n))
+        {
+            ret.offset += n;
+            address = def->args[1].value;
+        }
+        else if (strcmp(def->statement_name, "add") == 0)
+        {
+            // base plus some variable index; if exactly one side has a known base, it's somewhere relative to that
+            MemLoc left = memloc_of_address(def->args[0].value, size);
+            MemLoc right = memloc_of_address(def->args[1].value, size);
+            if ((left.kind == MEMBASE_UNKNOWN) == (right.kind == MEMBASE_UNKNOWN))
+                break;
+            ret = left.kind != MEMBASE_UNKNOWN ? left : right;
+            ret.offset_known = 0;
+            return ret;
+        }
+        else
+            break;
+        ret.base = address;
+    }
+    return ret;
+}
+
+// describes `size` bytes at `base + disp + index * scale`, where args holds the operands that instruction selection
+// folds into loads and stores: args[2] is the displacement, and args[3] and args[4] are the index and scale, if any
+// folding `base + slot` can leave the slot's address in the index, so that side gets checked too
+static MemLoc memloc_of_folded_address(Value * base, Operand * args, uint64_t size)
+{
+    size_t arg_count = array_len(args, Operand);
+    MemLoc ret = memloc_of_address(base, size);
+    if (arg_count > 2)
+        ret.offset += args[2].rawint;
+    if (arg_count > 3)
+    {
+        MemLoc index = memloc_of_address(args[3].value, size);
+        uint8_t scaled = arg_count > 4 && args[4].rawint != 1;
+        if (index.kind != MEMBASE_UNKNOWN)
+        {
+            // a scaled address, or one with two bases, isn't anywhere relative to either of them
+            if (scaled || ret.kind != MEMBASE_UNKNOWN)
+            {
+                memset(&ret, 0, sizeof(MemLoc));
+                ret.kind = MEMBASE_UNKNOWN;
+                ret.base = base;
+                ret.size = size;
+            }
+            else
+                ret = index;
+        }
+        ret.offset_known = 0;
+    }
+    return ret;
+}
+
+// the memory read by a load or written by a store, including the extra displacement and index operands that
+// instruction selection folds into them
+static MemLoc memloc_of_statement(Statement * statement)
+{
+    uint8_t is_load = strcmp(statement->statement_name, "load") == 0;
+    assert(is_load || strcmp(statement->statement_name, "store") == 0);
+    
+    Value * address = statement->args[is_load ? 1 : 0].value;
+    uint64_t size = type_size(is_load ? statement->output->type : statement->args[1].value->type);
+    return memloc_of_folded_address(address, statement->args, size);
+}
+
+// whether the address of the stack slot might end up anywhere other than the address operands of loads and stores
+static uint8_t stack_slot_escapes(Value * slot)
+{
+    assert(slot->variant == VALUE_STACKADDR);
+    Value ** worklist = (Value **)zero_alloc(0);
+    array_push(worklist, Value *, slot);
+    while (array_len(worklist, Value *) > 0)
+    {
+        Value * value = array_last(worklist, Value *);
+        array_erase(worklist, Value *, array_len(worklist, Value *) - 1);
+        for (size_t i = 0; i < array_len(value->edges_out, Statement *); i++)
+        {
+            Statement * statement = value->edges_out[i];
+            const char * name = statement->statement_name;
+            // as part of an address, the slot is fine as long as the access can be traced back to it; otherwise, an
+            // access that's really to the slot would look like one through an unknown pointer
+            uint8_t is_load = strcmp(name, "load") == 0;
+            if (is_load || strcmp(name, "store") == 0)
+            {
+                if (!is_load && statement->args[1].value == value)
+                    return 1;
+                MemLoc loc = memloc_of_statement(statement);
+                if (loc.kind != MEMBASE_SLOT || loc.base != slot)
+                    return 1;
+                continue;
+            }
+            // addresses computed from the slot have to be checked too
+            if (strcmp(name, "add") == 0 || strcmp(name, "sub") == 0 || strcmp(name, "mov") == 0)
+            {
+                array_push(worklist, Value *, statement->output);
+                continue;
+            }
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static uint8_t memlocs_may_alias(MemLoc a, MemLoc b)
+{
+    uint8_t same_base = a.kind == b.kind && (a.kind == MEMBASE_GLOBAL ? strcmp(a.symbol, b.symbol) == 0 : a.base == b.base);
+    if (same_base)
+    {
+        if (!a.offset_known || !b.offset_known)
+            return 1;
+        return a.offset < b.offset + (int64_t)b.size && b.offset < a.offset + (int64_t)a.size;
+    }
+    if (a.kind != MEMBASE_UNKNOWN && b.kind != MEMBASE_UNKNOWN)
+        return 0;
+    // an unknown pointer can only point into a stack slot if the slot's address got out
+    if (a.kind == MEMBASE_SLOT)
+        return stack_slot_escapes(a.base);
+    if (b.kind == MEMBASE_SLOT)
+        return stack_slot_escapes(b.base);
+    return 1;
+}
+
+// whether the two memory locations are exactly the same bytes
+static uint8_t memlocs_same(MemLoc a, MemLoc b)
+{
+    if (a.kind != b.kind || !a.offset_known || !b.offset_known || a.offset != b.offset || a.size != b.size)
+        return 0;
+    return a.kind == MEMBASE_GLOBAL ? strcmp(a.symbol, b.symbol) == 0 : a.base == b.base;
+}
+
+// whether running the function can write to memory that its caller can see
+// functions that only store to their own stack slots and don't call anything don't
+static uint8_t func_writes_memory(Function * func)
+{
+    for (size_t b = 0; b < array_len(func->blocks, Block *); b++)
+    {
+        Block * block = func->blocks[b];
+        for (size_t i = 0; i < array_len(block->statements, Statement *); i++)
+        {
+            Statement * statement = block->statements[i];
+            if (strcmp(statement->statement_name, "call") == 0 || strcmp(statement->statement_name, "call_eval") == 0)
+                return 1;
+            if (strcmp(statement->statement_name, "store") == 0 && memloc_of_statement(statement).kind != MEMBASE_SLOT)
+                return 1;
+        }
+    }
+    return 0;
+}
+
+// whether the call might write to the given memory location
+// calls can only write to stack slots whose addresses escaped, and can't write anything if the callee is known
+static uint8_t call_may_write(Program * program, Statement * call, MemLoc loc)
+{
+    if (loc.kind == MEMBASE_SLOT && !stack_slot_escapes(loc.base))
+        return 0;
+    Value * target = call->args[0].value;
+    if (program && target->variant == VALUE_SSA &&
+        (strcmp(target->ssa->statement_name, "symbol_lookup") == 0 ||
+         strcmp(target->ssa->statement_name, "symbol_lookup_unsized") == 0))
+    {
+        Function * callee = find_func(program, target->ssa->args[0].text);
+        if (callee && !func_writes_memory(callee))
+            return 0;
+    }
+    return 1;
+}
+
+#endif // BBAE_ANALYSIS
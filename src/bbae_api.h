@@ -33,11 +33,19 @@ static inline void do_optimization(Program * program)
     optimization_empty_block_removal(program);
     optimization_function_inlining(program);
     optimization_global_mem2reg(program);
+    optimization_function_specialization(program);
+    optimization_unused_value_removal(program);
+    optimization_empty_block_removal(program);
+    optimization_jump_threading(program);
     optimization_unused_value_removal(program);
     optimization_empty_block_removal(program);
     optimization_trivial_block_splicing(program);
     optimization_local_CSE(program);
+    optimization_load_elimination(program);
+    optimization_range_lowering(program);
+    optimization_conversion_folding(program);
     optimization_unused_value_removal(program);
+    optimization_block_layout(program);
     
 #ifndef COMPILER_DEBUG_QUIET
     puts("----- AFTER OPTIMIZATION -----");
@@ -53,7 +61,13 @@ static inline byte_buffer * do_lowering(Program * program, SymbolEntry ** symbol
     
     validate_links(program);
     verify_coherency(program);
+    do_instruction_selection(program);
+    do_scheduling(program);
+    do_late_instruction_selection(program);
     do_regalloc(program);
+#ifdef BBAE_VERIFY_REGALLOC
+    verify_regalloc(program);
+#endif
     
 #ifndef COMPILER_DEBUG_QUIET
     puts("-----   AFTER REGALLOC   -----");
@@ -67,6 +81,12 @@ static inline byte_buffer * do_lowering(Program * program, SymbolEntry ** symbol
     
     byte_buffer * code = compile_file(program, symbollist);
     
+#ifndef COMPILER_DEBUG_QUIET
+    print_peephole_stats();
+    print_shuffle_stats();
+    print_alloc_stats();
+#endif
+    
     SymbolEntry func_symbol;
     memset(&func_symbol, 0, sizeof(SymbolEntry));
     array_push(*symbollist, SymbolEntry, func_symbol);
@@ -0,0 +1,313 @@
+#ifndef BBAE_API_ELF
+#define BBAE_API_ELF
+
+// Ahead-of-time output: x86-64 ELF relocatable object files (.o), for linking with the system linker instead of
+// compiling at every process start with the JIT.
+// - functions go in .text, always as global symbols, since the IR has no way to mark them private
+// - statics (read-only) get laid out again in .rodata, and the code's references to them become relocations
+// - globals go in .bss, since they have no initializers; .data is there for linkers that expect it, but is empty
+// - symbols that the module uses but doesn't define become undefined symbols, referenced through R_X86_64_PLT32, so
+//   they can be functions or data in the same executable, or functions in shared libraries
+// Calls between functions in the same module are already resolved, so they don't need relocations.
+
+#include "bbae_api.h"
+
+#define _ELF_SHT_PROGBITS 1
+#define _ELF_SHT_SYMTAB 2
+#define _ELF_SHT_STRTAB 3
+#define _ELF_SHT_RELA 4
+#define _ELF_SHT_NOBITS 8
+
+#define _ELF_SHF_WRITE 1
+#define _ELF_SHF_ALLOC 2
+#define _ELF_SHF_EXECINSTR 4
+#define _ELF_SHF_INFO_LINK 0x40
+
+#define _ELF_STB_LOCAL 0
+#define _ELF_STB_GLOBAL 1
+#define _ELF_STT_NOTYPE 0
+#define _ELF_STT_OBJECT 1
+#define _ELF_STT_FUNC 2
+#define _ELF_STT_SECTION 3
+
+#define _ELF_R_X86_64_PC32 2
+#define _ELF_R_X86_64_PLT32 4
+
+// section indexes, in the order they're written
+enum {
+    _ELF_SEC_NULL,
+    _ELF_SEC_TEXT,
+    _ELF_SEC_RODATA,
+    _ELF_SEC_DATA,
+    _ELF_SEC_BSS,
+    _ELF_SEC_RELA_TEXT,
+    _ELF_SEC_SYMTAB,
+    _ELF_SEC_STRTAB,
+    _ELF_SEC_SHSTRTAB,
+    _ELF_SEC_NOTE_STACK,
+    _ELF_SEC_COUNT,
+};
+
+typedef struct _ElfSection {
+    const char * name;
+    uint32_t type;
+    uint64_t flags;
+    uint64_t align;
+    uint64_t entsize;
+    uint32_t link;
+    uint32_t info;
+    byte_buffer data;
+    uint64_t size; // only different from data.len for .bss
+    uint64_t offset; // in the file
+} ElfSection;
+
+static ElfSection _elf_section(const char * name, uint32_t type, uint64_t flags, uint64_t align, uint64_t entsize, uint32_t link, uint32_t info)
+{
+    ElfSection ret;
+    memset(&ret, 0, sizeof(ElfSection));
+    ret.name = name;
+    ret.type = type;
+    ret.flags = flags;
+    ret.align = align;
+    ret.entsize = entsize;
+    ret.link = link;
+    ret.info = info;
+    return ret;
+}
+
+static uint32_t _elf_add_string(byte_buffer * strtab, const char * str)
+{
+    uint32_t ret = strtab->len;
+    bytes_push(strtab, (const uint8_t *)str, strlen(str) + 1);
+    return ret;
+}
+
+static void _elf_push_symbol(byte_buffer * symtab, uint32_t name, uint8_t bind, uint8_t type, uint16_t section, uint64_t value, uint64_t size)
+{
+    bytes_push_int(symtab, name, 4);
+    bytes_push_int(symtab, (bind << 4) | type, 1);
+    bytes_push_int(symtab, 0, 1); // default visibility
+    bytes_push_int(symtab, section, 2);
+    bytes_push_int(symtab, value, 8);
+    bytes_push_int(symtab, size, 8);
+}
+
+static void _elf_push_rela(byte_buffer * rela, uint64_t loc, uint32_t symbol, uint32_t type, int64_t addend)
+{
+    bytes_push_int(rela, loc, 8);
+    bytes_push_int(rela, ((uint64_t)symbol << 32) | type, 8);
+    bytes_push_int(rela, (uint64_t)addend, 8);
+}
+
+static void _elf_pad_to(byte_buffer * out, uint64_t align)
+{
+    while (out->len % align)
+        byte_push(out, 0);
+}
+
+// lowers the program and returns the bytes of an ELF object file containing it
+static byte_buffer do_elf_lowering(Program * program)
+{
+    SymbolEntry * symbollist = 0;
+    byte_buffer * code = do_lowering(program, &symbollist);
+    assert(symbollist);
+    
+    ElfSection sections[_ELF_SEC_COUNT];
+    memset(sections, 0, sizeof(sections));
+    // code gets aligned relative to the start of the section (see code_align_policy), so the section has to be aligned at
+    // least as much
+    sections[_ELF_SEC_TEXT] = _elf_section(".text", _ELF_SHT_PROGBITS, _ELF_SHF_ALLOC | _ELF_SHF_EXECINSTR, 64, 0, 0, 0);
+    sections[_ELF_SEC_RODATA] = _elf_section(".rodata", _ELF_SHT_PROGBITS, _ELF_SHF_ALLOC, 16, 0, 0, 0);
+    sections[_ELF_SEC_DATA] = _elf_section(".data", _ELF_SHT_PROGBITS, _ELF_SHF_ALLOC | _ELF_SHF_WRITE, 8, 0, 0, 0);
+    sections[_ELF_SEC_BSS] = _elf_section(".bss", _ELF_SHT_NOBITS, _ELF_SHF_ALLOC | _ELF_SHF_WRITE, 16, 0, 0, 0);
+    sections[_ELF_SEC_RELA_TEXT] = _elf_section(".rela.text", _ELF_SHT_RELA, _ELF_SHF_INFO_LINK, 8, 24, _ELF_SEC_SYMTAB, _ELF_SEC_TEXT);
+    sections[_ELF_SEC_SYMTAB] = _elf_section(".symtab", _ELF_SHT_SYMTAB, 0, 8, 24, _ELF_SEC_STRTAB, 0);
+    sections[_ELF_SEC_STRTAB] = _elf_section(".strtab", _ELF_SHT_STRTAB, 0, 1, 0, 0, 0);
+    sections[_ELF_SEC_SHSTRTAB] = _elf_section(".shstrtab", _ELF_SHT_STRTAB, 0, 1, 0, 0, 0);
+    // without this, linkers assume that the code needs an executable stack
+    sections[_ELF_SEC_NOTE_STACK] = _elf_section(".note.GNU-stack", _ELF_SHT_PROGBITS, 0, 1, 0, 0, 0);
+    
+    // compile_file puts statics right after the code; everything before the first one is code
+    size_t static_count = array_len(program->statics, StaticData);
+    size_t text_len = code->len;
+    for (size_t i = 0; i < static_count; i++)
+    {
+        if (program->statics[i].location < text_len)
+            text_len = program->statics[i].location;
+    }
+    if (text_len > 0)
+        bytes_push(&sections[_ELF_SEC_TEXT].data, code->data, text_len);
+    
+    // statics, with their offsets in .rodata
+    byte_buffer * rodata = &sections[_ELF_SEC_RODATA].data;
+    uint64_t * static_offsets = (uint64_t *)zero_alloc(sizeof(uint64_t) * static_count);
+    for (size_t i = 0; i < static_count; i++)
+    {
+        StaticData stat = program->statics[i];
+        size_t size = type_size(stat.type);
+        _elf_pad_to(rodata, size_guess_align(size));
+        static_offsets[i] = rodata->len;
+        if (size <= 8)
+            bytes_push(rodata, (uint8_t *)&stat.init_data_short, size);
+        else
+            bytes_push(rodata, stat.init_data_long, size);
+    }
+    
+    sections[_ELF_SEC_BSS].size = program->globals_bytecount;
+    
+    // symbols: locals first (null, sections, and private globals), then everything else
+    byte_buffer * strtab = &sections[_ELF_SEC_STRTAB].data;
+    byte_buffer * symtab = &sections[_ELF_SEC_SYMTAB].data;
+    byte_push(strtab, 0);
+    _elf_push_symbol(symtab, 0, 0, 0, 0, 0, 0);
+    for (uint16_t s = _ELF_SEC_TEXT; s <= _ELF_SEC_BSS; s++)
+        _elf_push_symbol(symtab, 0, _ELF_STB_LOCAL, _ELF_STT_SECTION, s, 0, 0);
+    
+    size_t global_count = array_len(program->globals, GlobalData);
+    for (uint8_t pass = 0; pass < 2; pass++)
+    {
+        if (pass == 1)
+            sections[_ELF_SEC_SYMTAB].info = symtab->len / 24;
+        for (size_t i = 0; i < global_count; i++)
+        {
+            GlobalData global = program->globals[i];
+            if ((global.is_private != 0) != (pass == 0))
+                continue;
+            uint32_t name = _elf_add_string(strtab, global.name);
+            uint8_t bind = pass == 0 ? _ELF_STB_LOCAL : _ELF_STB_GLOBAL;
+            _elf_push_symbol(symtab, name, bind, _ELF_STT_OBJECT, _ELF_SEC_BSS, global.location, global.allocated_size);
+        }
+    }
+    
+    size_t func_count = 0;
+    while (symbollist[func_count].name)
+        func_count += 1;
+    for (size_t i = 0; i < func_count; i++)
+    {
+        SymbolEntry entry = symbollist[i];
+        assert(entry.kind == 1);
+        // the function runs until the next one, or the end of the code
+        size_t end = text_len;
+        for (size_t j = 0; j < func_count; j++)
+        {
+            if (symbollist[j].loc > entry.loc && symbollist[j].loc < end)
+                end = symbollist[j].loc;
+        }
+        uint32_t name = _elf_add_string(strtab, entry.name);
+        _elf_push_symbol(symtab, name, _ELF_STB_GLOBAL, _ELF_STT_FUNC, _ELF_SEC_TEXT, entry.loc, end - entry.loc);
+    }
+    
+    // relocations
+    byte_buffer * rela = &sections[_ELF_SEC_RELA_TEXT].data;
+    size_t static_reloc_count = static_addr_relocations ? array_len(static_addr_relocations, NameUsageInfo) : 0;
+    for (size_t i = 0; i < static_reloc_count; i++)
+    {
+        NameUsageInfo info = static_addr_relocations[i];
+        assert(info.size == 4);
+        size_t index = 0;
+        while (index < static_count && strcmp(program->statics[index].name, info.name) != 0)
+            index += 1;
+        assert(((void)"relocation against unknown static", index < static_count));
+        memset(sections[_ELF_SEC_TEXT].data.data + info.loc, 0, 4);
+        _elf_push_rela(rela, info.loc, _ELF_SEC_RODATA, _ELF_R_X86_64_PC32, (int64_t)static_offsets[index] - 4);
+    }
+    
+    const char ** undefined = (const char **)zero_alloc(0);
+    for (size_t i = 0; i < array_len(program->unused_relocation_log, UnusedRelocation); i++)
+    {
+        NameUsageInfo info = program->unused_relocation_log[i].info;
+        assert(info.size == 4);
+        assert(info.loc + 4 <= text_len);
+        memset(sections[_ELF_SEC_TEXT].data.data + info.loc, 0, 4);
+        
+        GlobalData global = find_global(program, info.name);
+        if (global.name)
+        {
+            _elf_push_rela(rela, info.loc, _ELF_SEC_BSS, _ELF_R_X86_64_PC32, (int64_t)global.location - 4);
+            continue;
+        }
+        
+        size_t index = 0;
+        while (index < array_len(undefined, const char *) && strcmp(undefined[index], info.name) != 0)
+            index += 1;
+        if (index == array_len(undefined, const char *))
+            array_push(undefined, const char *, info.name);
+        // undefined symbols come after every other symbol
+        size_t symbol = symtab->len / 24 + index;
+        _elf_push_rela(rela, info.loc, symbol, _ELF_R_X86_64_PLT32, -4);
+    }
+    for (size_t i = 0; i < array_len(undefined, const char *); i++)
+    {
+        uint32_t name = _elf_add_string(strtab, undefined[i]);
+        _elf_push_symbol(symtab, name, _ELF_STB_GLOBAL, _ELF_STT_NOTYPE, 0, 0, 0);
+    }
+    
+    byte_buffer * shstrtab = &sections[_ELF_SEC_SHSTRTAB].data;
+    uint32_t section_names[_ELF_SEC_COUNT];
+    byte_push(shstrtab, 0);
+    section_names[0] = 0;
+    for (size_t s = 1; s < _ELF_SEC_COUNT; s++)
+        section_names[s] = _elf_add_string(shstrtab, sections[s].name);
+    
+    for (size_t s = 0; s < _ELF_SEC_COUNT; s++)
+    {
+        if (sections[s].type != _ELF_SHT_NOBITS)
+            sections[s].size = sections[s].data.len;
+    }
+    
+    // ELF header, section contents, then the section header table
+    byte_buffer out;
+    memset(&out, 0, sizeof(byte_buffer));
+    
+    uint8_t ident[16] = {0x7F, 'E', 'L', 'F', 2, 1, 1, 0}; // 64-bit, little-endian, version 1, System V ABI
+    bytes_push(&out, ident, 16);
+    bytes_push_int(&out, 1, 2); // relocatable
+    bytes_push_int(&out, 62, 2); // x86-64
+    bytes_push_int(&out, 1, 4); // version
+    bytes_push_int(&out, 0, 8); // entry point
+    bytes_push_int(&out, 0, 8); // program headers
+    size_t section_headers_loc = out.len;
+    bytes_push_int(&out, 0, 8); // section headers, filled in below
+    bytes_push_int(&out, 0, 4); // flags
+    bytes_push_int(&out, 64, 2); // header size
+    bytes_push_int(&out, 0, 2); // program header size
+    bytes_push_int(&out, 0, 2); // program header count
+    bytes_push_int(&out, 64, 2); // section header size
+    bytes_push_int(&out, _ELF_SEC_COUNT, 2);
+    bytes_push_int(&out, _ELF_SEC_SHSTRTAB, 2);
+    
+    for (size_t s = 1; s < _ELF_SEC_COUNT; s++)
+    {
+        _elf_pad_to(&out, sections[s].align);
+        sections[s].offset = out.len;
+        if (sections[s].data.len)
+            bytes_push(&out, sections[s].data.data, sections[s].data.len);
+    }
+    
+    _elf_pad_to(&out, 8);
+    uint64_t section_headers = out.len;
+    memcpy(out.data + section_headers_loc, &section_headers, 8);
+    for (size_t s = 0; s < _ELF_SEC_COUNT; s++)
+    {
+        ElfSection * section = &sections[s];
+        bytes_push_int(&out, section_names[s], 4);
+        bytes_push_int(&out, section->type, 4);
+        bytes_push_int(&out, section->flags, 8);
+        bytes_push_int(&out, 0, 8); // address
+        bytes_push_int(&out, section->offset, 8);
+        bytes_push_int(&out, section->size, 8);
+        bytes_push_int(&out, section->link, 4);
+        bytes_push_int(&out, section->info, 4);
+        bytes_push_int(&out, section->align, 8);
+        bytes_push_int(&out, section->entsize, 8);
+        
+        free(section->data.data);
+    }
+    
+    free(code->data);
+    nullify_relocation_buffers();
+    
+    return out;
+}
+
+#endif // BBAE_API_ELF
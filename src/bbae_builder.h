@@ -95,6 +95,12 @@ static inline uint8_t block_is_terminated(Block * block)
 {
     return statement_is_terminator(block_get_last_statement(block));
 }
+/// Records how often a block runs, relative to the other blocks in its function (e.g. from a branch hint or a recorded profile).
+/// Used by block layout instead of the loop-nesting-based estimate. 0 means unknown.
+static inline void block_set_profile_weight(Block * block, uint64_t weight)
+{
+    block->profile_weight = weight;
+}
 
 static inline Statement * build_statement_3val(Block * block, const char * statement_name, Value * a, Value * b, Value * c)
 {
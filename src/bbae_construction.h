@@ -689,7 +689,7 @@ static inline Value * add_stack_slot(Function * func, const char * name, uint64_
     if (!name)
         name = make_temp_name();
     assert_no_redefinition(func, 0, name);
-    StackSlot _slot = {strcpy_z(name), size, 0, 0};
+    StackSlot _slot = {strcpy_z(name), size, 0, 0, 0};
     StackSlot * slot = (StackSlot *)zero_alloc(sizeof(StackSlot));
     *slot = _slot;
     Value * val = make_stackslot_value(slot);
@@ -1038,9 +1038,8 @@ static inline void split_blocks(Program * program)
                                 if (statement->args[n].variant == OP_KIND_VALUE && statement->args[n].value == value)
                                 {
                                     //printf("replaced a usage of %s in statement type %s\n", output_names[a], statement->statement_name);
-                                    disconnect_statement_from_operand(statement, statement->args[n], 1);
+                                    // not connected yet; block_statements_connect does that once everything is split
                                     statement->args[n].value = arg;
-                                    connect_statement_to_operand(statement, statement->args[n]);
                                 }
                             }
                         }
@@ -3,6 +3,7 @@
 
 #include "compiler_common.h"
 #include "compiler_type_cloning.h"
+#include "bbae_analysis.h"
 
 static Operand * _remap_args(Value ** block_args, Operand * exit_args, Operand * entry_args)
 {
@@ -18,6 +19,9 @@ static Operand * _remap_args(Value ** block_args, Operand * exit_args, Operand *
         Operand op_dummy = new_op_separator();
         Operand op = op_dummy;
         Operand exit_op = exit_args[i];
+        // constants don't depend on the block they're passed from
+        if (exit_op.variant == OP_KIND_VALUE && exit_op.value->variant == VALUE_CONST)
+            op = exit_op;
         for (size_t j = 0; j < block_arg_count; j++)
         {
             Value * block_arg = block_args[j];
@@ -202,6 +206,69 @@ static size_t count_op_num_times_used(Operand * list, Value * value, size_t star
     return ret;
 }
 
+// removes block arguments that liveness analysis shows are never used for anything, including ones that only get
+// passed around a loop between several blocks. returns whether it removed any
+static uint8_t _remove_dead_block_args(Function * func)
+{
+    Liveness liveness = func_analyze_liveness(func);
+    size_t block_count = array_len(func->blocks, Block *);
+    uint8_t did_work = 0;
+    
+    // drop the dead arguments from every edge into their block first, so nothing refers to them across blocks
+    for (size_t b = 0; b < block_count; b++)
+    {
+        Statement * exit = array_last(func->blocks[b]->statements, Statement *);
+        uint8_t is_if = strcmp(exit->statement_name, "if") == 0;
+        if (!is_if && strcmp(exit->statement_name, "goto") != 0)
+            continue;
+        for (size_t side = 0; side < (size_t)1 + is_if; side++)
+        {
+            size_t label = side == 0 ? is_if : find_separator_index(exit->args) + 1;
+            Block * target = find_block(func, exit->args[label].text);
+            assert(target);
+            if (target == func->entry_block)
+                continue;
+            // block temps are still block indexes from the liveness analysis
+            for (ptrdiff_t a = array_len(target->args, Value *) - 1; a >= 0; a--)
+            {
+                if (liveness_value_is_live_in(&liveness, target->temp, target->args[a]))
+                    continue;
+                disconnect_statement_from_operand(exit, exit->args[label + 1 + a], 1);
+                array_erase(exit->args, Operand, label + 1 + a);
+                did_work = 1;
+            }
+        }
+    }
+    if (!did_work)
+        return 0;
+    
+    // then whatever computed the dead arguments' replacements, and whatever only used the dead arguments
+    for (size_t b = 0; b < block_count; b++)
+    {
+        Block * block = func->blocks[b];
+        for (ptrdiff_t i = array_len(block->statements, Statement *) - 2; i >= 0; i--)
+        {
+            Statement * statement = block->statements[i];
+            if (!statement->output || array_len(statement->output->edges_out, Statement *) != 0 ||
+                statement_has_side_effects(statement))
+                continue;
+            for (size_t j = 0; j < array_len(statement->args, Operand); j++)
+                disconnect_statement_from_operand(statement, statement->args[j], 1);
+            array_erase(block->statements, Statement *, i);
+        }
+        if (block == func->entry_block)
+            continue;
+        for (ptrdiff_t a = array_len(block->args, Value *) - 1; a >= 0; a--)
+        {
+            if (liveness_value_is_live_in(&liveness, b, block->args[a]))
+                continue;
+            assert(((void)"dead block argument still in use", array_len(block->args[a]->edges_out, Statement *) == 0));
+            array_erase(block->args, Value *, a);
+        }
+    }
+    return 1;
+}
+
 static void optimization_unused_value_removal(Program * program)
 {
     for (size_t f = 0; f < array_len(program->functions, Function *); f++)
@@ -210,7 +277,7 @@ static void optimization_unused_value_removal(Program * program)
         uint8_t did_work = 1;
         while (did_work)
         {
-            did_work = 0;
+            did_work = _remove_dead_block_args(func);
             for (size_t b = 0; b < array_len(func->blocks, Block *); b++)
             {
                 Block * block = func->blocks[b];
@@ -255,9 +322,8 @@ static void optimization_unused_value_removal(Program * program)
                             assert(statement->block == statement->args[0].value->ssa->block);
                             
                             disconnect_statement_from_operand(statement, statement->args[0], 0);
-                            block_replace_statement_val_args(block, statement->output, statement->args[0].value);
-                            
                             array_erase(block->statements, Statement *, i);
+                            block_replace_statement_val_args(block, statement->output, statement->args[0].value);
                             i -= 1;
                             
                             did_work = 1;
@@ -478,6 +544,321 @@ static void optimization_trivial_block_splicing(Program * program)
     _block_edges_fix(program);
 }
 
+static uint64_t _const_type_mask(Type type)
+{
+    size_t bits = type_size(type) * 8;
+    return bits >= 64 ? ~(uint64_t)0 : ((uint64_t)1 << bits) - 1;
+}
+static int64_t _const_sext(Type type, uint64_t n)
+{
+    size_t bits = type_size(type) * 8;
+    if (bits >= 64)
+        return (int64_t)n;
+    uint64_t sign = (uint64_t)1 << (bits - 1);
+    n &= _const_type_mask(type);
+    return (int64_t)((n ^ sign) - sign);
+}
+
+// evaluates an integer operation with constant operands (b is ignored for unary operations)
+// returns 0 if the operation can't be folded
+static uint8_t _const_fold(const char * name, Type type, uint64_t a, uint64_t b, uint64_t * out)
+{
+    if (!type_is_int(type) && !type_is_ptr(type))
+        return 0;
+    uint64_t mask = _const_type_mask(type);
+    uint64_t bits = type_size(type) * 8;
+    a &= mask;
+    b &= mask;
+    int64_t sa = _const_sext(type, a);
+    int64_t sb = _const_sext(type, b);
+    
+    if (strcmp(name, "mov") == 0)
+        *out = a;
+    else if (strcmp(name, "add") == 0)
+        *out = a + b;
+    else if (strcmp(name, "sub") == 0)
+        *out = a - b;
+    else if (strcmp(name, "mul") == 0 || strcmp(name, "imul") == 0)
+        *out = a * b;
+    else if (strcmp(name, "and") == 0)
+        *out = a & b;
+    else if (strcmp(name, "or") == 0)
+        *out = a | b;
+    else if (strcmp(name, "xor") == 0)
+        *out = a ^ b;
+    else if (strcmp(name, "bnot") == 0)
+        *out = ~a;
+    else if (strcmp(name, "neg") == 0)
+        *out = -a;
+    else if (strcmp(name, "not") == 0)
+        *out = a == 0;
+    else if (strcmp(name, "bool") == 0)
+        *out = a != 0;
+    else if (strcmp(name, "shl") == 0)
+        *out = b >= bits ? 0 : a << b;
+    else if (strcmp(name, "shr") == 0)
+        *out = b >= bits ? 0 : a >> b;
+    else if (strcmp(name, "sar") == 0)
+        *out = (uint64_t)(b >= bits ? (sa < 0 ? -1 : 0) : sa >> b);
+    else if (strcmp(name, "cmp_eq") == 0)
+        *out = a == b;
+    else if (strcmp(name, "cmp_ne") == 0)
+        *out = a != b;
+    else if (strcmp(name, "cmp_ge") == 0)
+        *out = a >= b;
+    else if (strcmp(name, "cmp_le") == 0)
+        *out = a <= b;
+    else if (strcmp(name, "cmp_g") == 0)
+        *out = a > b;
+    else if (strcmp(name, "cmp_l") == 0)
+        *out = a < b;
+    else if (strcmp(name, "icmp_ge") == 0)
+        *out = sa >= sb;
+    else if (strcmp(name, "icmp_le") == 0)
+        *out = sa <= sb;
+    else if (strcmp(name, "icmp_g") == 0)
+        *out = sa > sb;
+    else if (strcmp(name, "icmp_l") == 0)
+        *out = sa < sb;
+    else
+        return 0;
+    
+    *out &= mask;
+    return 1;
+}
+
+// copies a block (with fresh names) and appends it to the function
+// the copy has the same block args and exit as the original, but no incoming edges
+static Block * _block_duplicate(Function * func, Block * block)
+{
+    Block * dup = new_block();
+    dup->name = string_concat(string_concat(make_temp_name(), "_"), block->name);
+    
+    RemapInfo * remap = (RemapInfo *)zero_alloc(0);
+    for (size_t i = 0; i < array_len(block->args, Value *); i++)
+    {
+        Value * old = block->args[i];
+        Value * arg = make_value(old->type);
+        arg->variant = VALUE_ARG;
+        arg->arg = old->arg;
+        array_push(dup->args, Value *, arg);
+        remap_add(&remap, old, arg);
+    }
+    
+    for (size_t i = 0; i < array_len(block->statements, Statement *); i++)
+    {
+        Statement * old = block->statements[i];
+        Statement * statement = new_statement();
+        statement->output_name = old->output_name;
+        statement->statement_name = old->statement_name;
+        statement->block = dup;
+        
+        for (size_t j = 0; j < array_len(old->args, Operand); j++)
+        {
+            Operand op = old->args[j];
+            if (op.variant == OP_KIND_VALUE && remap_lookup(remap, op.value))
+                op.value = (Value *)remap_lookup(remap, op.value);
+            array_push(statement->args, Operand, op);
+        }
+        for (size_t j = 0; j < array_len(statement->args, Operand); j++)
+            connect_statement_to_operand(statement, statement->args[j]);
+        
+        if (old->output)
+        {
+            statement->output = make_value(old->output->type);
+            statement->output->variant = VALUE_SSA;
+            statement->output->ssa = statement;
+            remap_add(&remap, old->output, statement->output);
+        }
+        array_push(dup->statements, Statement *, statement);
+    }
+    
+    array_push(func->blocks, Block *, dup);
+    return dup;
+}
+
+// turns an if statement into a goto to one of its two targets
+static void _if_to_goto(Statement * statement, uint8_t which)
+{
+    assert(strcmp(statement->statement_name, "if") == 0);
+    size_t separator_pos = find_separator_index(statement->args);
+    assert(separator_pos != (size_t)-1);
+    
+    size_t start = which ? 1 : separator_pos + 1;
+    size_t end = which ? separator_pos : array_len(statement->args, Operand);
+    
+    Operand * args = (Operand *)zero_alloc(0);
+    for (size_t i = start; i < end; i++)
+        array_push(args, Operand, statement->args[i]);
+    
+    for (size_t i = 0; i < array_len(statement->args, Operand); i++)
+        disconnect_statement_from_operand(statement, statement->args[i], 1);
+    
+    statement->statement_name = strcpy_z("goto");
+    statement->args = args;
+    for (size_t i = 1; i < array_len(statement->args, Operand); i++)
+        connect_statement_to_operand(statement, statement->args[i]);
+}
+
+// figures out whether the condition of a block's exit `if` is known when entering the block through the given edge
+// returns 0 if unknown, otherwise 1 and writes the condition's truthiness to `truth`
+static uint8_t _edge_known_condition(Block * block, Statement * entry, size_t entry_label_offset, uint8_t * truth)
+{
+    Statement * exit = array_last(block->statements, Statement *);
+    Value * cond = exit->args[0].value;
+    Operand * incoming = entry->args + entry_label_offset + 1;
+    
+    if (type_is_float(cond->type))
+        return 0;
+    if (cond->variant == VALUE_CONST)
+    {
+        *truth = cond->constant != 0;
+        return 1;
+    }
+    
+    Value ** known = (Value **)zero_alloc(0);
+    uint64_t * known_consts = (uint64_t *)zero_alloc(0);
+    
+    for (size_t i = 0; i < array_len(block->args, Value *); i++)
+    {
+        Value * in = incoming[i].value;
+        Value * arg = block->args[i];
+        // constants passed along edges have been moved into registers by construction
+        if (in->variant == VALUE_SSA && strcmp(in->ssa->statement_name, "mov") == 0)
+            in = in->ssa->args[0].value;
+        if (in->variant == VALUE_CONST && type_is_basic(in->type) && !type_is_float(in->type))
+        {
+            array_push(known, Value *, arg);
+            array_push(known_consts, uint64_t, in->constant);
+        }
+        // the predecessor's own branch condition, passed along unchanged
+        else if (arg == cond && strcmp(entry->statement_name, "if") == 0 && in == entry->args[0].value)
+        {
+            *truth = entry_label_offset == 1;
+            return 1;
+        }
+    }
+    
+    for (size_t i = 0; i + 1 < array_len(block->statements, Statement *); i++)
+    {
+        Statement * statement = block->statements[i];
+        size_t arg_count = array_len(statement->args, Operand);
+        if (!statement->output || arg_count == 0 || arg_count > 2)
+            continue;
+        
+        uint64_t consts[2] = {0, 0};
+        uint8_t all_known = 1;
+        for (size_t j = 0; j < arg_count && all_known; j++)
+        {
+            Operand op = statement->args[j];
+            if (op.variant != OP_KIND_VALUE)
+                all_known = 0;
+            else if (op.value->variant == VALUE_CONST)
+                consts[j] = op.value->constant;
+            else
+            {
+                size_t index = ptr_array_find(known, op.value);
+                if (index == (size_t)-1)
+                    all_known = 0;
+                else
+                    consts[j] = known_consts[index];
+            }
+        }
+        
+        uint64_t result = 0;
+        if (all_known && _const_fold(statement->statement_name, statement->args[0].value->type, consts[0], consts[1], &result))
+        {
+            array_push(known, Value *, statement->output);
+            array_push(known_consts, uint64_t, result);
+        }
+    }
+    
+    size_t index = ptr_array_find(known, cond);
+    if (index == (size_t)-1)
+        return 0;
+    *truth = known_consts[index] != 0;
+    return 1;
+}
+
+// maximum number of statements in a block that gets copied for jump threading
+#define JUMP_THREADING_MAX_STATEMENTS 8
+
+// jump threading: when the condition of a block's `if` is known on an incoming edge (e.g. a block argument that's a
+// constant on that edge, or the predecessor's own branch condition passed along), that edge gets its own copy of the
+// block, with the `if` replaced by a goto straight to the known target. blocks with only one incoming edge are
+// rewritten in place instead of being copied.
+static void optimization_jump_threading(Program * program)
+{
+    for (size_t f = 0; f < array_len(program->functions, Function *); f++)
+    {
+        Function * func = program->functions[f];
+        // don't revisit copies
+        size_t block_count = array_len(func->blocks, Block *);
+        for (size_t b = 1; b < block_count; b++)
+        {
+            Block * block = func->blocks[b];
+            Statement * exit = array_last(block->statements, Statement *);
+            if (strcmp(exit->statement_name, "if") != 0)
+                continue;
+            
+            // collect incoming edges as (statement, label offset) pairs
+            Statement ** entries = (Statement **)zero_alloc(0);
+            size_t * label_offsets = (size_t *)zero_alloc(0);
+            for (size_t i = 0; i < array_len(block->edges_in, Statement *); i++)
+            {
+                Statement * entry = block->edges_in[i];
+                if (ptr_array_find(entries, entry) != (size_t)-1)
+                    continue;
+                if (strcmp(entry->statement_name, "goto") == 0)
+                {
+                    array_push(entries, Statement *, entry);
+                    array_push(label_offsets, size_t, 0);
+                }
+                else if (strcmp(entry->statement_name, "if") == 0)
+                {
+                    size_t separator_pos = find_separator_index(entry->args);
+                    assert(separator_pos != (size_t)-1);
+                    if (strcmp(entry->args[1].text, block->name) == 0)
+                    {
+                        array_push(entries, Statement *, entry);
+                        array_push(label_offsets, size_t, 1);
+                    }
+                    if (strcmp(entry->args[separator_pos + 1].text, block->name) == 0)
+                    {
+                        array_push(entries, Statement *, entry);
+                        array_push(label_offsets, size_t, separator_pos + 1);
+                    }
+                }
+            }
+            
+            size_t edge_count = array_len(entries, Statement *);
+            for (size_t e = 0; e < edge_count; e++)
+            {
+                Statement * entry = entries[e];
+                // a block looping back into itself would need its copy to loop into the original instead; not worth it
+                if (entry->block == block)
+                    continue;
+                uint8_t truth = 0;
+                if (!_edge_known_condition(block, entry, label_offsets[e], &truth))
+                    continue;
+                
+                if (edge_count == 1)
+                {
+                    _if_to_goto(exit, truth);
+                    break;
+                }
+                if (array_len(block->statements, Statement *) > JUMP_THREADING_MAX_STATEMENTS)
+                    continue;
+                
+                Block * dup = _block_duplicate(func, block);
+                _if_to_goto(array_last(dup->statements, Statement *), truth);
+                entry->args[label_offsets[e]] = new_op_text(dup->name);
+            }
+        }
+    }
+    _block_edges_fix(program);
+}
+
 // common subexpression elimination
 static void optimization_local_CSE(Program * program)
 {
@@ -495,7 +876,22 @@ static void optimization_local_CSE(Program * program)
                 Statement * statement = block->statements[i];
                 if (!statement->output || statement_has_side_effects(statement))
                     continue;
-                for (size_t j = 0; j < i; j++)
+                // loads can only be merged with earlier loads if nothing in between might have written to memory
+                size_t start = 0;
+                if (strcmp(statement->statement_name, "load") == 0)
+                {
+                    for (size_t j = i; j > 0; j--)
+                    {
+                        Statement * prev = block->statements[j - 1];
+                        if (strcmp(prev->statement_name, "store") == 0 || strcmp(prev->statement_name, "call") == 0 ||
+                            strcmp(prev->statement_name, "call_eval") == 0)
+                        {
+                            start = j;
+                            break;
+                        }
+                    }
+                }
+                for (size_t j = start; j < i; j++)
                 {
                     Statement * prev = block->statements[j];
                     if (statements_same(prev, statement))
@@ -503,6 +899,9 @@ static void optimization_local_CSE(Program * program)
                         array_erase(block->statements, Statement *, i);
                         i -= 1;
                         
+                        for (size_t n = 0; n < array_len(statement->args, Operand); n++)
+                            disconnect_statement_from_operand(statement, statement->args[n], 1);
+                        
                         block_replace_statement_val_args(block, statement->output, prev->output);
                         break;
                     }
@@ -511,6 +910,441 @@ static void optimization_local_CSE(Program * program)
         }
     }
 }
+// turns `name` into `mov value`, where value is something the statement's output is already known to equal
+static void _statement_rewrite_as_mov(Statement * statement, Value * value)
+{
+    for (size_t n = 0; n < array_len(statement->args, Operand); n++)
+        disconnect_statement_from_operand(statement, statement->args[n], 1);
+    statement->args = (Operand *)zero_alloc(0);
+    Operand op = new_op_val(value);
+    array_push(statement->args, Operand, op);
+    connect_statement_to_operand(statement, op);
+    statement->statement_name = strcpy_z("mov");
+}
+
+// uses integer range analysis to turn safe divisions and right shifts into their unsafe forms when the divisor is
+// known to be nonzero or the shift amount is known to be in range, so that the backend doesn't need to guard them
+// also removes extensions of values that were just trimmed without losing anything, and collapses extension chains
+static void optimization_range_lowering(Program * program)
+{
+    for (size_t f = 0; f < array_len(program->functions, Function *); f++)
+    {
+        Function * func = program->functions[f];
+        ValueRange * ranges = func_analyze_ranges(func);
+        for (size_t b = 0; b < array_len(func->blocks, Block *); b++)
+        {
+            Block * block = func->blocks[b];
+            Value ** touched = (Value **)zero_alloc(0);
+            for (size_t i = 0; i < array_len(block->statements, Statement *); i++)
+            {
+                Statement * statement = block->statements[i];
+                const char * name = statement->statement_name;
+                if (!statement->output || !type_is_int(statement->output->type))
+                    continue;
+                
+                if (strcmp(name, "div") == 0 || strcmp(name, "idiv") == 0 ||
+                    strcmp(name, "rem") == 0 || strcmp(name, "irem") == 0)
+                {
+                    if (value_get_range(ranges, statement->args[1].value).lo >= 1)
+                        statement->statement_name = string_concat(name, "_unsafe");
+                }
+                else if (strcmp(name, "shr") == 0 || strcmp(name, "sar") == 0)
+                {
+                    Value * amount = statement->args[1].value;
+                    if (type_is_int(amount->type) &&
+                        value_get_range(ranges, amount).hi < type_size(statement->args[0].value->type) * 8)
+                        statement->statement_name = string_concat(name, "_unsafe");
+                }
+                else if (strcmp(name, "trim") == 0 || strcmp(name, "zext") == 0 || strcmp(name, "sext") == 0)
+                {
+                    Value * arg = statement->args[1].value;
+                    if (!type_is_int(arg->type))
+                        continue;
+                    if (type_size(arg->type) == type_size(statement->output->type))
+                    {
+                        // same-size conversions are no-ops
+                        _statement_rewrite_as_mov(statement, arg);
+                        array_push(touched, Value *, arg);
+                        continue;
+                    }
+                    if (strcmp(name, "trim") == 0 || arg->variant != VALUE_SSA)
+                        continue;
+                    
+                    Statement * inner = arg->ssa;
+                    if (strcmp(inner->statement_name, "trim") == 0 && inner->args[1].value->variant != VALUE_CONST &&
+                        types_same(inner->args[1].value->type, statement->output->type))
+                    {
+                        // extending a trimmed value back to its original type gives back the original value, as long
+                        // as the trim didn't lose anything that the extension can't recreate
+                        Value * original = inner->args[1].value;
+                        uint64_t limit = _range_mask(arg->type);
+                        if (strcmp(name, "sext") == 0)
+                            limit >>= 1;
+                        if (value_get_range(ranges, original).hi <= limit)
+                        {
+                            _statement_rewrite_as_mov(statement, original);
+                            array_push(touched, Value *, original);
+                        }
+                    }
+                    else if (strcmp(inner->statement_name, "zext") == 0 ||
+                             (strcmp(inner->statement_name, "sext") == 0 && strcmp(name, "sext") == 0))
+                    {
+                        // zext of zext, or sext of sext, is a single extension from the innermost type
+                        // sext of zext is too, since the middle value's top bit is always clear (unless it's a no-op)
+                        Value * original = inner->args[1].value;
+                        if (original->variant == VALUE_CONST)
+                            continue;
+                        if (strcmp(inner->statement_name, "zext") == 0 &&
+                            type_size(original->type) == type_size(arg->type))
+                            continue;
+                        disconnect_statement_from_operand(statement, statement->args[1], 1);
+                        statement->args[1] = new_op_val(original);
+                        connect_statement_to_operand(statement, statement->args[1]);
+                        statement->statement_name = strcpy_z(inner->statement_name);
+                        array_push(touched, Value *, original);
+                    }
+                }
+            }
+            for (size_t i = 0; i < array_len(block->statements, Statement *); i++)
+                block->statements[i]->temp = i;
+            for (size_t i = 0; i < array_len(touched, Value *); i++)
+                value_sort_edges_out(touched[i]);
+        }
+    }
+}
+
+static uint8_t _is_extension(Statement * statement)
+{
+    return strcmp(statement->statement_name, "zext") == 0 || strcmp(statement->statement_name, "sext") == 0 ||
+           strcmp(statement->statement_name, "qext") == 0;
+}
+
+// turns a conversion statement into the given kind of conversion of a different value, keeping its output type
+static void _conversion_rewrite(Statement * statement, const char * name, Value * value)
+{
+    disconnect_statement_from_operand(statement, statement->args[1], 1);
+    statement->args[1] = new_op_val(value);
+    connect_statement_to_operand(statement, statement->args[1]);
+    statement->statement_name = strcpy_z(name);
+}
+
+// how many of the low bits of an operand the statement can observe, given how many of its output's low bits are
+// observed. the low bits of sums, products, bitwise operations, and left shifts only depend on the low bits of their
+// operands
+static uint64_t _demanded_operand_bits(Statement * statement, size_t n, uint64_t output_bits)
+{
+    const char * name = statement->statement_name;
+    Value * value = statement->args[n].value;
+    uint64_t full = type_size(value->type) * 8;
+    uint64_t bits = full;
+    if (strcmp(name, "trim") == 0)
+        bits = type_size(statement->output->type) * 8;
+    else if (strcmp(name, "add") == 0 || strcmp(name, "sub") == 0 || strcmp(name, "mul") == 0 ||
+             strcmp(name, "imul") == 0 || strcmp(name, "and") == 0 || strcmp(name, "or") == 0 ||
+             strcmp(name, "xor") == 0 || (strcmp(name, "shl") == 0 && n == 0) || _is_extension(statement))
+        bits = output_bits;
+    return bits < full ? bits : full;
+}
+
+// simplifies chains of integer conversions and bitcasts, which frontends for languages with narrow integer types
+// produce a lot of:
+// - bitcasts back to the original type become movs, and bitcasts of bitcasts become a single bitcast
+// - trims of extensions and trims of trims become a single conversion (or a mov) from the original value
+// - extensions of extensions where the outer one doesn't care about the new bits become a single extension
+// - zero and sign extensions whose new bits are never observed become qexts, which don't need any instructions
+static void optimization_conversion_folding(Program * program)
+{
+    for (size_t f = 0; f < array_len(program->functions, Function *); f++)
+    {
+        Function * func = program->functions[f];
+        for (size_t b = 0; b < array_len(func->blocks, Block *); b++)
+        {
+            Block * block = func->blocks[b];
+            Value ** touched = (Value **)zero_alloc(0);
+            size_t count = array_len(block->statements, Statement *);
+            for (size_t i = 0; i < count; i++)
+            {
+                Statement * statement = block->statements[i];
+                const char * name = statement->statement_name;
+                if (!statement->output || array_len(statement->args, Operand) != 2)
+                    continue;
+                Value * arg = statement->args[1].value;
+                if (!arg || arg->variant != VALUE_SSA)
+                    continue;
+                Statement * inner = arg->ssa;
+                Value * original = array_len(inner->args, Operand) == 2 ? inner->args[1].value : 0;
+                if (!original || original->variant == VALUE_CONST)
+                    continue;
+                
+                if (strcmp(name, "bitcast") == 0 && strcmp(inner->statement_name, "bitcast") == 0)
+                {
+                    if (types_same(original->type, statement->output->type))
+                        _statement_rewrite_as_mov(statement, original);
+                    else
+                        _conversion_rewrite(statement, "bitcast", original);
+                    array_push(touched, Value *, original);
+                }
+                else if (strcmp(name, "trim") == 0 && strcmp(inner->statement_name, "trim") == 0)
+                {
+                    _conversion_rewrite(statement, "trim", original);
+                    array_push(touched, Value *, original);
+                }
+                else if (strcmp(name, "trim") == 0 && _is_extension(inner) && type_is_int(original->type))
+                {
+                    // the trim only keeps bits that came from the original value, plus maybe some of the new ones
+                    size_t out_size = type_size(statement->output->type);
+                    size_t original_size = type_size(original->type);
+                    if (out_size == original_size)
+                        _statement_rewrite_as_mov(statement, original);
+                    else if (out_size < original_size)
+                        _conversion_rewrite(statement, "trim", original);
+                    else
+                        _conversion_rewrite(statement, inner->statement_name, original);
+                    array_push(touched, Value *, original);
+                }
+                else if (strcmp(name, "qext") == 0 && _is_extension(inner))
+                {
+                    _conversion_rewrite(statement, inner->statement_name, original);
+                    array_push(touched, Value *, original);
+                }
+            }
+            
+            // find how many low bits of each output are observed, working backwards from their uses. values used
+            // outside of the block are passed to it by its terminator, which observes all of their bits
+            uint64_t * demanded = (uint64_t *)zero_alloc(sizeof(uint64_t) * count);
+            for (size_t i = 0; i < count; i++)
+                block->statements[i]->temp = i;
+            for (size_t i = count; i > 0; i--)
+            {
+                Statement * statement = block->statements[i - 1];
+                if (statement->output && (strcmp(statement->statement_name, "zext") == 0 ||
+                                          strcmp(statement->statement_name, "sext") == 0))
+                {
+                    Value * arg = statement->args[1].value;
+                    if (arg->variant != VALUE_CONST && type_is_int(arg->type) &&
+                        demanded[i - 1] <= type_size(arg->type) * 8)
+                        statement->statement_name = strcpy_z("qext");
+                }
+                for (size_t n = 0; n < array_len(statement->args, Operand); n++)
+                {
+                    Value * value = statement->args[n].value;
+                    if (statement->args[n].variant != OP_KIND_VALUE || !value || value->variant != VALUE_SSA ||
+                        value->ssa->block != block || !type_is_int(value->type))
+                        continue;
+                    uint64_t bits = _demanded_operand_bits(statement, n, demanded[i - 1]);
+                    if (bits > demanded[value->ssa->temp])
+                        demanded[value->ssa->temp] = bits;
+                }
+            }
+            
+            for (size_t i = 0; i < array_len(touched, Value *); i++)
+                value_sort_edges_out(touched[i]);
+        }
+    }
+}
+
+// memory contents known to be held by some value
+typedef struct _AvailLoad {
+    MemLoc loc;
+    Type type;
+    // null for contents that are known on entry to the block but haven't been needed yet. giving them a value means
+    // passing it in from every predecessor through a new block argument
+    Value * value;
+} AvailLoad;
+
+static AvailLoad * _avail_find(AvailLoad ** avail, MemLoc loc, Type type)
+{
+    for (size_t i = 0; i < array_len(avail, AvailLoad *); i++)
+    {
+        if (memlocs_same(avail[i]->loc, loc) && types_same(avail[i]->type, type))
+            return avail[i];
+    }
+    return 0;
+}
+
+// gets the value that holds the given available memory contents within the block, passing it in from the block's
+// predecessors if needed
+static Value * _avail_get(Function * func, AvailLoad *** outs, Block * block, AvailLoad * entry, Value *** touched)
+{
+    if (entry->value)
+        return entry->value;
+    
+    Value * arg = make_value(entry->type);
+    arg->variant = VALUE_ARG;
+    arg->arg = make_temp_name();
+    array_push(block->args, Value *, arg);
+    entry->value = arg;
+    
+    // blocks only have contents available on entry if all of their predecessors came before them, so this recursion
+    // always terminates
+    Statement ** seen = (Statement **)zero_alloc(0);
+    for (size_t e = 0; e < array_len(block->edges_in, Statement *); e++)
+    {
+        Statement * exit = block->edges_in[e];
+        if (ptr_array_find(seen, exit) != (size_t)-1)
+            continue;
+        array_push(seen, Statement *, exit);
+        
+        Block * pred = exit->block;
+        AvailLoad * pred_entry = _avail_find(outs[pred->temp], entry->loc, entry->type);
+        assert(pred_entry);
+        Value * value = _avail_get(func, outs, pred, pred_entry, touched);
+        // constants and stack addresses can't be passed to blocks directly
+        if (value->variant != VALUE_SSA && value->variant != VALUE_ARG)
+        {
+            Statement * mov = new_statement();
+            mov->block = pred;
+            mov->output_name = make_temp_name();
+            mov->statement_name = strcpy_z("mov");
+            Operand op = new_op_val(value);
+            array_push(mov->args, Operand, op);
+            connect_statement_to_operand(mov, op);
+            mov->output = make_value(entry->type);
+            mov->output->variant = VALUE_SSA;
+            mov->output->ssa = mov;
+            // emission expects the comparison that an `if` branches on to be right before it
+            size_t pos = array_len(pred->statements, Statement *) - 1;
+            if (strcmp(exit->statement_name, "if") == 0 && pos > 0)
+                pos -= 1;
+            array_insert(pred->statements, Statement *, pos, mov);
+            value = mov->output;
+        }
+        array_push(*touched, Value *, value);
+        
+        // the second target of an `if` gets its arguments at the end, and the first one right before the separator
+        if (strcmp(exit->statement_name, "if") == 0)
+        {
+            size_t separator_pos = find_separator_index(exit->args);
+            assert(separator_pos != (size_t)-1);
+            if (strcmp(exit->args[separator_pos + 1].text, block->name) == 0)
+            {
+                Operand op = new_op_val(value);
+                array_push(exit->args, Operand, op);
+                connect_statement_to_operand(exit, op);
+            }
+            if (strcmp(exit->args[1].text, block->name) == 0)
+            {
+                Operand op = new_op_val(value);
+                array_insert(exit->args, Operand, separator_pos, op);
+                connect_statement_to_operand(exit, op);
+            }
+        }
+        else
+        {
+            assert(strcmp(exit->statement_name, "goto") == 0);
+            Operand op = new_op_val(value);
+            array_push(exit->args, Operand, op);
+            connect_statement_to_operand(exit, op);
+        }
+    }
+    return arg;
+}
+
+// removes loads of memory whose contents are already known, because they were stored or loaded earlier, either in
+// the same block or along every path leading to it
+// uses alias analysis to tell which stores and calls can change what's known
+static void optimization_load_elimination(Program * program)
+{
+    for (size_t f = 0; f < array_len(program->functions, Function *); f++)
+    {
+        Function * func = program->functions[f];
+        Block ** order = func_reverse_postorder(func);
+        size_t block_count = array_len(func->blocks, Block *);
+        AvailLoad *** outs = (AvailLoad ***)zero_alloc(sizeof(AvailLoad **) * block_count);
+        uint8_t * done = (uint8_t *)zero_alloc(block_count);
+        Value ** touched = (Value **)zero_alloc(0);
+        
+        for (size_t o = 0; o < array_len(order, Block *); o++)
+        {
+            Block * block = order[o];
+            
+            // contents known on entry are the ones known at the exit of every predecessor
+            AvailLoad ** avail = (AvailLoad **)zero_alloc(0);
+            uint8_t all_preds_done = block != func->entry_block && array_len(block->edges_in, Statement *) > 0;
+            for (size_t e = 0; e < array_len(block->edges_in, Statement *); e++)
+                all_preds_done = all_preds_done && done[block->edges_in[e]->block->temp];
+            if (all_preds_done)
+            {
+                AvailLoad ** first = outs[block->edges_in[0]->block->temp];
+                for (size_t i = 0; i < array_len(first, AvailLoad *); i++)
+                {
+                    uint8_t everywhere = 1;
+                    for (size_t e = 1; e < array_len(block->edges_in, Statement *) && everywhere; e++)
+                        everywhere = _avail_find(outs[block->edges_in[e]->block->temp], first[i]->loc, first[i]->type) != 0;
+                    if (!everywhere)
+                        continue;
+                    AvailLoad * entry = (AvailLoad *)zero_alloc(sizeof(AvailLoad));
+                    entry->loc = first[i]->loc;
+                    entry->type = first[i]->type;
+                    array_push(avail, AvailLoad *, entry);
+                }
+            }
+            
+            for (size_t i = 0; i < array_len(block->statements, Statement *); i++)
+            {
+                Statement * statement = block->statements[i];
+                if (strcmp(statement->statement_name, "load") == 0)
+                {
+                    MemLoc loc = memloc_of_statement(statement);
+                    AvailLoad * entry = _avail_find(avail, loc, statement->output->type);
+                    if (entry)
+                    {
+                        Value * value = _avail_get(func, outs, block, entry, &touched);
+                        _statement_rewrite_as_mov(statement, value);
+                        array_push(touched, Value *, value);
+                        continue;
+                    }
+                    entry = (AvailLoad *)zero_alloc(sizeof(AvailLoad));
+                    entry->loc = loc;
+                    entry->type = statement->output->type;
+                    entry->value = statement->output;
+                    array_push(avail, AvailLoad *, entry);
+                }
+                else if (strcmp(statement->statement_name, "store") == 0)
+                {
+                    MemLoc loc = memloc_of_statement(statement);
+                    for (size_t a = array_len(avail, AvailLoad *); a > 0; a--)
+                    {
+                        if (memlocs_may_alias(avail[a - 1]->loc, loc))
+                            array_erase(avail, AvailLoad *, a - 1);
+                    }
+                    AvailLoad * entry = (AvailLoad *)zero_alloc(sizeof(AvailLoad));
+                    entry->loc = loc;
+                    entry->type = statement->args[1].value->type;
+                    entry->value = statement->args[1].value;
+                    array_push(avail, AvailLoad *, entry);
+                }
+                else if (strcmp(statement->statement_name, "call") == 0 || strcmp(statement->statement_name, "call_eval") == 0)
+                {
+                    for (size_t a = array_len(avail, AvailLoad *); a > 0; a--)
+                    {
+                        if (call_may_write(program, statement, avail[a - 1]->loc))
+                            array_erase(avail, AvailLoad *, a - 1);
+                    }
+                }
+            }
+            
+            // addresses that we can't see through are only meaningful within the block that computed them
+            for (size_t a = array_len(avail, AvailLoad *); a > 0; a--)
+            {
+                if (avail[a - 1]->loc.kind == MEMBASE_UNKNOWN)
+                    array_erase(avail, AvailLoad *, a - 1);
+            }
+            outs[block->temp] = avail;
+            done[block->temp] = 1;
+        }
+        
+        for (size_t b = 0; b < block_count; b++)
+        {
+            Block * block = func->blocks[b];
+            for (size_t i = 0; i < array_len(block->statements, Statement *); i++)
+                block->statements[i]->temp = i;
+        }
+        for (size_t i = 0; i < array_len(touched, Value *); i++)
+            value_sort_edges_out(touched[i]);
+    }
+}
+
 static void optimization_global_mem2reg(Program * program)
 {
     // TODO: also remove stack slots that are never loaded from or addressed
@@ -533,16 +1367,24 @@ static void optimization_global_mem2reg(Program * program)
             for (size_t s = 0; s < array_len(slot->edges_out, Statement *); s++)
             {
                 Statement * edge = slot->edges_out[s];
+                Type edge_type;
                 if (strcmp(edge->statement_name, "load") == 0)
                 {
                     ever_loaded = 1;
-                    type = edge->output->type;
-                    type_set = 1;
+                    edge_type = edge->output->type;
                 }
                 else if (strcmp(edge->statement_name, "store") == 0)
+                {
                     ever_stored = 1;
+                    edge_type = edge->args[1].value->type;
+                }
                 else // anything else? we probably took its address. FUTURE: do capture/ownership leakage detection
                     goto full_continue;
+                // accessed as more than one type (e.g. storing an i64 and loading its low i32); leave it in memory
+                if (type_set && !types_same(type, edge_type))
+                    goto full_continue;
+                type = edge_type;
+                type_set = 1;
             }
             // if the value is never loaded, we can eliminate it and all of its stores
             // TODO: do so instead of just skipping
@@ -742,6 +1584,9 @@ static void optimization_function_inlining(Program * program)
                 continue;
             }
             Function * called_func = find_func(program, call_arg->ssa->args[0].text);
+            // defined outside of this module, e.g. linked in with an AOT-compiled object file
+            if (!called_func)
+                continue;
             // TODO: support inlining functions that perform calls. need to check for recursion.
             if (called_func->performs_calls)
             {
@@ -913,7 +1758,7 @@ static void optimization_function_inlining(Program * program)
             for (size_t b = 0; b < array_len(cloned_func->blocks, Block *); b++)
             {
                 Block * rw_block = cloned_func->blocks[b];
-                rw_block->name = string_concat(name_prefix, called_func->name);
+                rw_block->name = string_concat(name_prefix, rw_block->name);
                 
                 for (size_t s = 0; s < array_len(rw_block->statements, Statement *); s++)
                 {
@@ -984,4 +1829,514 @@ static void optimization_function_inlining(Program * program)
     _block_edges_fix(program);
 }
 
+// sparse conditional constant propagation lattice states, per value
+#define SCCP_UNKNOWN 0 // not reached yet; could still be anything
+#define SCCP_CONST 1
+#define SCCP_VARYING 2
+
+typedef struct _SccpValue {
+    Value * value;
+    uint8_t state;
+    uint64_t constant;
+} SccpValue;
+
+static SccpValue _sccp_get(SccpValue * lattice, Value * value)
+{
+    SccpValue ret;
+    memset(&ret, 0, sizeof(SccpValue));
+    ret.value = value;
+    ret.state = SCCP_VARYING;
+    if (value->variant == VALUE_CONST && type_is_int(value->type))
+    {
+        ret.state = SCCP_CONST;
+        ret.constant = value->constant & _const_type_mask(value->type);
+    }
+    else if (value->temp < array_len(lattice, SccpValue) && lattice[value->temp].value == value)
+        ret = lattice[value->temp];
+    return ret;
+}
+// lowers a value's state to the meet of it and the given state, returning whether it changed
+static uint8_t _sccp_lower(SccpValue * lattice, Value * value, SccpValue in)
+{
+    SccpValue * dest = &lattice[value->temp];
+    if (in.state == SCCP_UNKNOWN || dest->state == SCCP_VARYING)
+        return 0;
+    if (dest->state == SCCP_CONST && in.state == SCCP_CONST && dest->constant == in.constant)
+        return 0;
+    if (dest->state == SCCP_UNKNOWN && in.state == SCCP_CONST)
+    {
+        dest->state = SCCP_CONST;
+        dest->constant = in.constant;
+        return 1;
+    }
+    dest->state = SCCP_VARYING;
+    return 1;
+}
+static uint8_t _sccp_flow_into(SccpValue * lattice, Function * func, uint8_t * executable, Operand * args, size_t count,
+                               const char * label)
+{
+    Block * target = find_block(func, label);
+    assert(target);
+    assert(array_len(target->args, Value *) == count);
+    uint8_t changed = !executable[target->temp];
+    executable[target->temp] = 1;
+    for (size_t i = 0; i < count; i++)
+        changed |= _sccp_lower(lattice, target->args[i], _sccp_get(lattice, args[i].value));
+    return changed;
+}
+
+// sparse conditional constant propagation: finds integer values that are constant along every path that can actually
+// be taken, assuming branches on constants only go one way. constant statements and block arguments become `mov`s of
+// their constants, and `if`s on constants become `goto`s. leaves dead code and unreachable blocks for other passes.
+static void _func_sccp(Function * func)
+{
+    size_t block_count = array_len(func->blocks, Block *);
+    if (block_count == 0)
+        return;
+    
+    SccpValue * lattice = (SccpValue *)zero_alloc(0);
+    for (size_t b = 0; b < block_count; b++)
+    {
+        Block * block = func->blocks[b];
+        block->temp = b;
+        for (size_t i = 0; i < array_len(block->args, Value *); i++)
+        {
+            SccpValue v;
+            memset(&v, 0, sizeof(SccpValue));
+            v.value = block->args[i];
+            v.state = type_is_int(v.value->type) ? SCCP_UNKNOWN : SCCP_VARYING;
+            v.value->temp = array_len(lattice, SccpValue);
+            array_push(lattice, SccpValue, v);
+        }
+        for (size_t i = 0; i < array_len(block->statements, Statement *); i++)
+        {
+            Statement * statement = block->statements[i];
+            if (!statement->output)
+                continue;
+            SccpValue v;
+            memset(&v, 0, sizeof(SccpValue));
+            v.value = statement->output;
+            v.state = type_is_int(v.value->type) && !statement_has_side_effects(statement) ? SCCP_UNKNOWN : SCCP_VARYING;
+            v.value->temp = array_len(lattice, SccpValue);
+            array_push(lattice, SccpValue, v);
+        }
+    }
+    // the entry block can be entered from outside
+    for (size_t i = 0; i < array_len(func->blocks[0]->args, Value *); i++)
+        lattice[func->blocks[0]->args[i]->temp].state = SCCP_VARYING;
+    
+    uint8_t * executable = (uint8_t *)zero_alloc(block_count);
+    executable[0] = 1;
+    uint8_t changed = 1;
+    while (changed)
+    {
+        changed = 0;
+        for (size_t b = 0; b < block_count; b++)
+        {
+            Block * block = func->blocks[b];
+            if (!executable[b])
+                continue;
+            for (size_t i = 0; i + 1 < array_len(block->statements, Statement *); i++)
+            {
+                Statement * statement = block->statements[i];
+                if (!statement->output || lattice[statement->output->temp].state == SCCP_VARYING)
+                    continue;
+                
+                size_t arg_count = array_len(statement->args, Operand);
+                SccpValue in;
+                memset(&in, 0, sizeof(SccpValue));
+                in.state = SCCP_CONST;
+                uint64_t consts[2] = {0, 0};
+                if (arg_count == 0 || arg_count > 2)
+                    in.state = SCCP_VARYING;
+                for (size_t j = 0; j < arg_count && in.state != SCCP_VARYING; j++)
+                {
+                    if (statement->args[j].variant != OP_KIND_VALUE)
+                    {
+                        in.state = SCCP_VARYING;
+                        break;
+                    }
+                    SccpValue arg = _sccp_get(lattice, statement->args[j].value);
+                    if (arg.state == SCCP_VARYING)
+                        in.state = SCCP_VARYING;
+                    else if (arg.state == SCCP_UNKNOWN)
+                        in.state = SCCP_UNKNOWN;
+                    else
+                        consts[j] = arg.constant;
+                }
+                if (in.state == SCCP_CONST &&
+                    !_const_fold(statement->statement_name, statement->args[0].value->type, consts[0], consts[1], &in.constant))
+                    in.state = SCCP_VARYING;
+                changed |= _sccp_lower(lattice, statement->output, in);
+            }
+            
+            Statement * exit = array_last(block->statements, Statement *);
+            if (strcmp(exit->statement_name, "goto") == 0)
+                changed |= _sccp_flow_into(lattice, func, executable, exit->args + 1,
+                                           array_len(exit->args, Operand) - 1, exit->args[0].text);
+            else if (strcmp(exit->statement_name, "if") == 0)
+            {
+                size_t separator_pos = find_separator_index(exit->args);
+                SccpValue cond = _sccp_get(lattice, exit->args[0].value);
+                if (type_is_float(exit->args[0].value->type))
+                    cond.state = SCCP_VARYING;
+                if (cond.state == SCCP_VARYING || (cond.state == SCCP_CONST && cond.constant != 0))
+                    changed |= _sccp_flow_into(lattice, func, executable, exit->args + 2, separator_pos - 2, exit->args[1].text);
+                if (cond.state == SCCP_VARYING || (cond.state == SCCP_CONST && cond.constant == 0))
+                    changed |= _sccp_flow_into(lattice, func, executable, exit->args + separator_pos + 2,
+                                               array_len(exit->args, Operand) - separator_pos - 2,
+                                               exit->args[separator_pos + 1].text);
+            }
+        }
+    }
+    
+    for (size_t b = 0; b < block_count; b++)
+    {
+        Block * block = func->blocks[b];
+        if (!executable[b])
+            continue;
+        for (size_t i = 0; i < array_len(block->args, Value *); i++)
+        {
+            Value * arg = block->args[i];
+            SccpValue v = _sccp_get(lattice, arg);
+            if (v.state != SCCP_CONST)
+                continue;
+            Statement * mov = new_statement();
+            mov->block = block;
+            mov->output_name = make_temp_name();
+            mov->statement_name = strcpy_z("mov");
+            array_push(mov->args, Operand, new_op_val(make_const_value(arg->type.variant, v.constant)));
+            mov->output = make_value(arg->type);
+            mov->output->variant = VALUE_SSA;
+            mov->output->ssa = mov;
+            array_insert(block->statements, Statement *, 0, mov);
+            block_replace_statement_val_args(block, arg, mov->output);
+        }
+        for (size_t i = 0; i < array_len(block->statements, Statement *); i++)
+        {
+            Statement * statement = block->statements[i];
+            if (strcmp(statement->statement_name, "if") == 0)
+            {
+                SccpValue cond = _sccp_get(lattice, statement->args[0].value);
+                if (cond.state == SCCP_CONST && !type_is_float(statement->args[0].value->type))
+                    _if_to_goto(statement, cond.constant != 0);
+                continue;
+            }
+            if (!statement->output || (strcmp(statement->statement_name, "mov") == 0 &&
+                                       statement->args[0].value->variant == VALUE_CONST))
+                continue;
+            SccpValue v = _sccp_get(lattice, statement->output);
+            if (v.state != SCCP_CONST)
+                continue;
+            for (size_t n = 0; n < array_len(statement->args, Operand); n++)
+                disconnect_statement_from_operand(statement, statement->args[n], 1);
+            statement->args = (Operand *)zero_alloc(0);
+            array_push(statement->args, Operand, new_op_val(make_const_value(statement->output->type.variant, v.constant)));
+            statement->statement_name = strcpy_z("mov");
+        }
+    }
+}
+
+// don't specialize functions bigger than this many statements
+#define SPECIALIZATION_MAX_STATEMENTS 1000
+// maximum number of specialized copies of any one function
+#define SPECIALIZATION_MAX_CLONES 4
+// minimum estimated block weight (see func_estimate_block_weights) for a call site to be worth specializing for
+#define SPECIALIZATION_MIN_WEIGHT 8
+
+typedef struct _Specialization {
+    Function * original;
+    Function * clone;
+    uint64_t * consts; // per argument; only meaningful where is_const is set
+    uint8_t * is_const;
+} Specialization;
+
+// interprocedural constant propagation: hot calls (see SPECIALIZATION_MIN_WEIGHT) that pass constant integer arguments
+// to functions that didn't get inlined are redirected to a copy of the function specialized for those arguments. the
+// constant arguments are removed from the copy's signature and propagated through it with SCCP. call sites that pass
+// the same constants share a copy.
+static void optimization_function_specialization(Program * program)
+{
+    Specialization * specializations = (Specialization *)zero_alloc(0);
+    size_t original_count = array_len(program->functions, Function *);
+    for (size_t f = 0; f < original_count; f++)
+    {
+        Function * func = program->functions[f];
+        func_recalc_statement_count(func);
+    }
+    for (size_t f = 0; f < original_count; f++)
+    {
+        Function * func = program->functions[f];
+        func_estimate_block_weights(func);
+        for (size_t b = 0; b < array_len(func->blocks, Block *); b++)
+        {
+            Block * block = func->blocks[b];
+            if (block->weight < SPECIALIZATION_MIN_WEIGHT)
+                continue;
+            for (size_t i = 0; i < array_len(block->statements, Statement *); i++)
+            {
+                Statement * call = block->statements[i];
+                if (strcmp(call->statement_name, "call") != 0 && strcmp(call->statement_name, "call_eval") != 0)
+                    continue;
+                
+                // only direct calls to functions in this program
+                Value * call_arg = call->args[0].value;
+                if (call_arg->variant != VALUE_SSA ||
+                    (strcmp(call_arg->ssa->statement_name, "symbol_lookup") != 0 &&
+                     strcmp(call_arg->ssa->statement_name, "symbol_lookup_unsized") != 0))
+                    continue;
+                Function * called_func = find_func(program, call_arg->ssa->args[0].text);
+                if (!called_func || called_func == func || called_func->statement_count > SPECIALIZATION_MAX_STATEMENTS)
+                    continue;
+                size_t arg_count = array_len(called_func->args, Value *);
+                if (array_len(call->args, Operand) != arg_count + 1)
+                    continue;
+                
+                uint64_t * consts = (uint64_t *)zero_alloc(sizeof(uint64_t) * arg_count);
+                uint8_t * is_const = (uint8_t *)zero_alloc(arg_count);
+                uint8_t any_const = 0;
+                for (size_t a = 0; a < arg_count; a++)
+                {
+                    Value * value = call->args[a + 1].value;
+                    // constants that can't be immediates have been moved into registers by construction
+                    if (value->variant == VALUE_SSA && strcmp(value->ssa->statement_name, "mov") == 0)
+                        value = value->ssa->args[0].value;
+                    if (value->variant == VALUE_CONST && type_is_int(value->type) &&
+                        types_same(value->type, called_func->args[a]->type))
+                    {
+                        consts[a] = value->constant & _const_type_mask(value->type);
+                        is_const[a] = 1;
+                        any_const = 1;
+                    }
+                }
+                if (!any_const)
+                    continue;
+                
+                // reuse an existing copy with the same constants if possible
+                Function * clone = 0;
+                size_t clone_count = 0;
+                for (size_t s = 0; s < array_len(specializations, Specialization); s++)
+                {
+                    Specialization * spec = &specializations[s];
+                    if (spec->original != called_func)
+                        continue;
+                    clone_count += 1;
+                    uint8_t same = 1;
+                    for (size_t a = 0; a < arg_count && same; a++)
+                        same = spec->is_const[a] == is_const[a] && (!is_const[a] || spec->consts[a] == consts[a]);
+                    if (same)
+                    {
+                        clone = spec->clone;
+                        break;
+                    }
+                }
+                if (!clone)
+                {
+                    if (clone_count >= SPECIALIZATION_MAX_CLONES)
+                        continue;
+                    
+                    RemapInfo * info = 0;
+                    clone = func_clone(&info, called_func);
+                    clone->name = string_concat(string_concat(called_func->name, "_"), make_temp_name());
+                    
+                    // turn the constant arguments into movs at the start of the copy
+                    Block * entry = clone->blocks[0];
+                    for (size_t a = arg_count; a > 0; a--)
+                    {
+                        if (!is_const[a - 1])
+                            continue;
+                        Value * param = clone->args[a - 1];
+                        Statement * mov = new_statement();
+                        mov->block = entry;
+                        mov->output_name = make_temp_name();
+                        mov->statement_name = strcpy_z("mov");
+                        array_push(mov->args, Operand, new_op_val(make_const_value(param->type.variant, consts[a - 1])));
+                        mov->output = make_value(param->type);
+                        mov->output->variant = VALUE_SSA;
+                        mov->output->ssa = mov;
+                        array_insert(entry->statements, Statement *, 0, mov);
+                        block_replace_statement_val_args(entry, param, mov->output);
+                        array_erase(clone->args, Value *, a - 1);
+                    }
+                    _func_sccp(clone);
+                    
+                    Specialization spec;
+                    spec.original = called_func;
+                    spec.clone = clone;
+                    spec.consts = consts;
+                    spec.is_const = is_const;
+                    array_push(specializations, Specialization, spec);
+                    array_push(program->functions, Function *, clone);
+                }
+                
+                // point the call at the copy and drop the constant arguments
+                Statement * lookup = new_statement();
+                lookup->block = block;
+                lookup->output_name = make_temp_name();
+                lookup->statement_name = strcpy_z("symbol_lookup_unsized");
+                array_push(lookup->args, Operand, new_op_text(clone->name));
+                lookup->output = make_value(basic_type(TYPE_IPTR));
+                lookup->output->variant = VALUE_SSA;
+                lookup->output->ssa = lookup;
+                array_insert(block->statements, Statement *, i, lookup);
+                i += 1;
+                
+                disconnect_statement_from_operand(call, call->args[0], 1);
+                call->args[0] = new_op_val(lookup->output);
+                connect_statement_to_operand(call, call->args[0]);
+                for (size_t a = arg_count; a > 0; a--)
+                {
+                    if (!is_const[a - 1])
+                        continue;
+                    disconnect_statement_from_operand(call, call->args[a], 1);
+                    array_erase(call->args, Operand, a);
+                }
+            }
+        }
+    }
+    _block_edges_fix(program);
+}
+
+typedef struct _LayoutEdge {
+    Block * from;
+    Block * to;
+    double weight;
+    size_t index;
+} LayoutEdge;
+
+static int _layout_edge_compare(const void * a, const void * b)
+{
+    const LayoutEdge * x = (const LayoutEdge *)a;
+    const LayoutEdge * y = (const LayoutEdge *)b;
+    if (x->weight != y->weight)
+        return x->weight < y->weight ? 1 : -1;
+    // keep declaration order for ties, so that layout is deterministic
+    return x->index < y->index ? -1 : x->index > y->index;
+}
+
+// reorders func->blocks so that the hottest edges become fallthroughs
+// blocks are chained together greedily along edges in order of decreasing weight, then chains are placed starting with
+// the entry chain, always picking whichever remaining chain is jumped to most heavily from already-placed code.
+// chains that leave the function (return/exit) and cold chains are placed at the end.
+// must run after the last pass that changes the CFG
+static void optimization_block_layout(Program * program)
+{
+    for (size_t f = 0; f < array_len(program->functions, Function *); f++)
+    {
+        Function * func = program->functions[f];
+        size_t block_count = array_len(func->blocks, Block *);
+        if (block_count < 3)
+            continue;
+        
+        func_estimate_block_weights(func);
+        
+        LayoutEdge * edges = (LayoutEdge *)zero_alloc(0);
+        for (size_t b = 0; b < block_count; b++)
+        {
+            Block * block = func->blocks[b];
+            Block * succ[2];
+            size_t succ_count = block_get_successors(func, block, succ);
+            // split the block's own weight between its successors, proportional to their weights
+            double total = 0.0;
+            for (size_t i = 0; i < succ_count; i++)
+                total += (double)succ[i]->weight;
+            for (size_t i = 0; i < succ_count; i++)
+            {
+                LayoutEdge edge;
+                edge.from = block;
+                edge.to = succ[i];
+                if (total > 0.0)
+                    edge.weight = (double)block->weight * (double)succ[i]->weight / total;
+                else
+                    edge.weight = 0.0;
+                edge.index = array_len(edges, LayoutEdge);
+                array_push(edges, LayoutEdge, edge);
+            }
+        }
+        qsort(edges, array_len(edges, LayoutEdge), sizeof(LayoutEdge), _layout_edge_compare);
+        
+        // each block starts out as its own chain. chains are merged tail-to-head along edges.
+        Block *** chains = (Block ***)zero_alloc(sizeof(Block **) * block_count);
+        size_t * chain_of = (size_t *)zero_alloc(sizeof(size_t) * block_count);
+        for (size_t b = 0; b < block_count; b++)
+        {
+            chains[b] = (Block **)zero_alloc(0);
+            array_push(chains[b], Block *, func->blocks[b]);
+            chain_of[b] = b;
+        }
+        for (size_t e = 0; e < array_len(edges, LayoutEdge); e++)
+        {
+            LayoutEdge edge = edges[e];
+            // entry block has to stay first
+            if (edge.from == edge.to || edge.to->temp == 0)
+                continue;
+            size_t from_chain = chain_of[edge.from->temp];
+            size_t to_chain = chain_of[edge.to->temp];
+            if (from_chain == to_chain)
+                continue;
+            if (array_last(chains[from_chain], Block *) != edge.from || chains[to_chain][0] != edge.to)
+                continue;
+            for (size_t i = 0; i < array_len(chains[to_chain], Block *); i++)
+            {
+                Block * block = chains[to_chain][i];
+                array_push(chains[from_chain], Block *, block);
+                chain_of[block->temp] = from_chain;
+            }
+            chains[to_chain] = 0;
+        }
+        
+        // place chains, deferring the ones that leave the function or never run
+        Block ** new_blocks = (Block **)zero_alloc(0);
+        uint8_t * chain_placed = (uint8_t *)zero_alloc(block_count);
+        uint8_t * chain_deferred = (uint8_t *)zero_alloc(block_count);
+        for (size_t c = 0; c < block_count; c++)
+        {
+            if (!chains[c])
+                continue;
+            Block * tail = array_last(chains[c], Block *);
+            Block * succ[2];
+            uint8_t exits = block_get_successors(func, tail, succ) == 0 && tail->loop_depth == 0;
+            uint8_t cold = 1;
+            for (size_t i = 0; i < array_len(chains[c], Block *); i++)
+            {
+                if (chains[c][i]->weight)
+                    cold = 0;
+            }
+            chain_deferred[c] = cold ? 2 : exits;
+        }
+        
+        size_t next_chain = chain_of[0];
+        while (next_chain != (size_t)-1)
+        {
+            chain_placed[next_chain] = 1;
+            for (size_t i = 0; i < array_len(chains[next_chain], Block *); i++)
+                array_push(new_blocks, Block *, chains[next_chain][i]);
+            
+            next_chain = (size_t)-1;
+            // edges are sorted by weight, so the first edge out of placed code into an unplaced chain is the heaviest
+            for (size_t e = 0; e < array_len(edges, LayoutEdge) && next_chain == (size_t)-1; e++)
+            {
+                size_t from_chain = chain_of[edges[e].from->temp];
+                size_t to_chain = chain_of[edges[e].to->temp];
+                if (chain_placed[from_chain] && !chain_placed[to_chain] && !chain_deferred[to_chain])
+                    next_chain = to_chain;
+            }
+            // nothing connected; fall back to declaration order, then deferred chains
+            for (uint8_t pass = 0; pass < 3 && next_chain == (size_t)-1; pass++)
+            {
+                for (size_t b = 0; b < block_count && next_chain == (size_t)-1; b++)
+                {
+                    size_t c = chain_of[b];
+                    if (!chain_placed[c] && chain_deferred[c] == pass)
+                        next_chain = c;
+                }
+            }
+        }
+        
+        assert(array_len(new_blocks, Block *) == block_count);
+        assert(new_blocks[0] == func->blocks[0]);
+        func->blocks = new_blocks;
+    }
+}
+
 #endif // BBAE_OPTIMIZATION
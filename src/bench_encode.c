@@ -0,0 +1,117 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <time.h>
+
+// Encoder throughput benchmark. Encodes a synthetic function over and over, both through minst_encode (what
+// compile_file uses, including branch relaxation) and one instruction at a time through enc_emit_n (with every jump in
+// its long form), and prints instructions per second for each.
+// usage: bench_encode [rounds]
+
+#define COMPILER_DEBUG_QUIET
+
+#include "memory.h"
+#include "bbae_api_jit.h"
+
+// a mix of what compile_file emits a lot of: moves, ALU ops with registers, immediates and memory operands, address
+// arithmetic, scalar floats, and compare-and-branch pairs
+static MInst * bench_make_function(size_t count)
+{
+    MInst * insts = (MInst *)zero_alloc(0);
+    size_t label_count = count / 16 + 1;
+    char ** labels = (char **)zero_alloc(sizeof(char *) * label_count);
+    for (size_t i = 0; i < label_count; i++)
+    {
+        labels[i] = (char *)zero_alloc(24);
+        snprintf(labels[i], 24, "block_%zu", i);
+    }
+    EncOperand rax = enc_reg(REG_RAX, 8);
+    EncOperand rcx = enc_reg(REG_RCX, 8);
+    EncOperand rdx = enc_reg(REG_RDX, 8);
+    EncOperand r9 = enc_reg(REG_R9, 8);
+    EncOperand eax = enc_reg(REG_RAX, 4);
+    EncOperand xmm0 = enc_reg(REG_XMM0, 8);
+    EncOperand xmm1 = enc_reg(REG_XMM1, 8);
+    EncOperand slot = enc_mem(REG_RBP, -0x20, 8);
+    EncOperand indexed = enc_mem_full(REG_RDI, REG_RCX, 8, 0x10, 8);
+    
+    // each block loops back to its own start, or goes on to the next one
+    size_t i = 0;
+    while (i < count)
+    {
+        size_t label = i / 16;
+        minst_label(&insts, labels[label]);
+        minst_emit_2(&insts, INST_MOV, rax, rcx);
+        minst_emit_2(&insts, INST_ADD, rax, enc_imm(8, 4));
+        minst_emit_2(&insts, INST_MOV, rdx, slot);
+        minst_emit_2(&insts, INST_MOV, indexed, r9);
+        minst_emit_2(&insts, INST_IMUL, rdx, rax);
+        minst_emit_2(&insts, INST_LEA, rcx, indexed);
+        minst_emit_2(&insts, INST_SUB, eax, enc_imm(3, 4));
+        minst_emit_2(&insts, INST_XOR, rdx, slot);
+        minst_emit_2(&insts, INST_MOVSD, xmm0, slot);
+        minst_emit_2(&insts, INST_ADDSD, xmm0, xmm1);
+        minst_emit_2(&insts, INST_MULSD, xmm1, xmm0);
+        minst_emit_2(&insts, INST_SHL, rcx, enc_imm(3, 1));
+        minst_emit_2(&insts, INST_AND, r9, rdx);
+        minst_emit_2(&insts, INST_CMP, rax, enc_imm(100, 4));
+        minst_emit_jump(&insts, INST_JL, labels[label]);
+        minst_emit_jump(&insts, INST_JMP, labels[label + 1]);
+        i += 16;
+    }
+    minst_label(&insts, labels[label_count - 1]);
+    minst_emit_0(&insts, INST_RET);
+    return insts;
+}
+
+static double bench_seconds(clock_t start)
+{
+    return (double)(clock() - start) / CLOCKS_PER_SEC;
+}
+
+int main(int argc, char ** argv)
+{
+    size_t rounds = argc > 1 ? (size_t)strtoull(argv[1], 0, 10) : 2000;
+    size_t count = 4096;
+    MInst * insts = bench_make_function(count);
+    size_t inst_count = 0;
+    for (size_t i = 0; i < array_len(insts, MInst); i++)
+        inst_count += insts[i].kind != MINST_LABEL;
+    
+    byte_buffer code;
+    memset(&code, 0, sizeof(byte_buffer));
+    clock_t start = clock();
+    for (size_t r = 0; r < rounds; r++)
+    {
+        code.len = 0;
+        minst_encode(&code, insts);
+    }
+    double minst_time = bench_seconds(start);
+    size_t code_len = code.len;
+    
+    start = clock();
+    for (size_t r = 0; r < rounds; r++)
+    {
+        code.len = 0;
+        for (size_t i = 0; i < array_len(insts, MInst); i++)
+        {
+            MInst * inst = &insts[i];
+            if (inst->kind == MINST_JUMP)
+                enc_emit_1(&code, inst->name, enc_imm(0x7FFFFFFF, 4));
+            else if (inst->kind == MINST_INST)
+                enc_emit_n(&code, inst->name, inst->ops, inst->op_count);
+        }
+    }
+    double single_time = bench_seconds(start);
+    
+    double total = (double)inst_count * (double)rounds;
+    printf("%zu instructions (%zu bytes) x %zu rounds\n", inst_count, code_len, rounds);
+    printf("minst_encode: %.3f s, %.2f M instructions/s\n", minst_time, total / minst_time / 1000000.0);
+    printf("enc_emit_n:   %.3f s, %.2f M instructions/s (%zu bytes)\n", single_time, total / single_time / 1000000.0, code.len);
+    
+    free(code.data);
+    free_all_compiler_allocs();
+    return 0;
+}
@@ -43,6 +43,8 @@ W_WLIB_FUNCPREFIX uint64_t byteswap_int(uint64_t value, uint8_t bytecount)
 
 W_WLIB_FUNCPREFIX void bytes_reserve(byte_buffer * buf, size_t extra)
 {
+    if (buf->data && buf->len + extra < buf->cap)
+        return;
     if (buf->cap < 8)
         buf->cap = 8;
     while (buf->len + extra >= buf->cap)
@@ -359,6 +359,10 @@ typedef struct _Value {
     uint64_t regalloc;
     // regalloced and regalloc are set once and never changed
     
+    // register that function-wide allocation would like this value to end up in, if regalloc_hinted is set
+    uint8_t regalloc_hinted;
+    uint64_t regalloc_hint;
+    
     struct _StackSlot * spilled; // set if currently spilled, null otherwise
     // set once when spilled. when unspilling, Value needs to be duplicated, modified, and injected into descendants.
     
@@ -423,8 +427,15 @@ typedef struct _Block {
     Statement ** edges_in;
     // statements within the block (array)
     Statement ** statements;
-    // where the block starts within its associated byte buffer
-    uint64_t start_offset;
+    // relative execution count from branch hints or a recorded profile. 0 if unknown
+    uint64_t profile_weight;
+    
+    // metadata calculated by bbae_analysis.h
+    uint64_t weight; // estimated relative execution count
+    uint32_t loop_depth;
+    uint8_t is_loop_header;
+    
+    uint64_t temp; // temporary, used by specific algorithms as a kind of cache
 } Block;
 
 static inline Block * new_block(void)
@@ -441,6 +452,7 @@ typedef struct _StackSlot {
     size_t size;
     int64_t offset;
     uint64_t align;
+    uint8_t is_spill; // created by the register allocator, which only ever stores to it once
 } StackSlot;
 
 typedef struct _Function {
@@ -460,7 +472,8 @@ typedef struct _Function {
     
     // metadata used by some optimizations
     size_t statement_count; // inlining heuristic
-    uint8_t performs_calls; // inlining heuristic and regalloc heuristic
+    uint8_t performs_calls; // inlining heuristic
+    Block * callee_save_block; // where callee-saved registers get saved, on the way in, if not in the prologue
 } Function;
 
 static inline Function * new_func(void)
@@ -880,11 +893,11 @@ static inline void add_statement_output(Statement * statement)
         {
             statement->output = make_value(basic_type(TYPE_IPTR));
         }
-        else if (strcmp(statement->statement_name, "f64_to_f32"))
+        else if (strcmp(statement->statement_name, "f64_to_f32") == 0)
         {
             statement->output = make_value(basic_type(TYPE_F32));
         }
-        else if (strcmp(statement->statement_name, "f32_to_f64"))
+        else if (strcmp(statement->statement_name, "f32_to_f64") == 0)
         {
             statement->output = make_value(basic_type(TYPE_F64));
         }
@@ -986,6 +999,27 @@ static inline void disconnect_statement_from_operand(Statement * statement, Oper
     }
 }
 
+// restores statement order in a value's edges_out after new uses have been connected out of order
+// expects each statement's position within its block to be cached in its temp field
+static inline void value_sort_edges_out(Value * value)
+{
+    // stack slots are used across blocks, and register allocation doesn't care about their order
+    if (value->variant == VALUE_STACKADDR)
+        return;
+    Statement ** edges = value->edges_out;
+    for (size_t i = 1; i < array_len(edges, Statement *); i++)
+    {
+        Statement * statement = edges[i];
+        size_t j = i;
+        while (j > 0 && edges[j - 1]->temp > statement->temp)
+        {
+            edges[j] = edges[j - 1];
+            j -= 1;
+        }
+        edges[j] = statement;
+    }
+}
+
 static inline size_t find_separator_index(Operand * args)
 {
     for (size_t i = 2; i < array_len(args, Operand); i++)
@@ -1071,6 +1105,26 @@ static inline void block_replace_statement_val_args(Block * block, Value * old,
             }
         }
     }
+    // the new uses were appended after any existing ones, but register allocation expects uses in statement order
+    // uses from other blocks (only possible while blocks are being spliced together) are kept in front
+    if (new_val->variant != VALUE_SSA && new_val->variant != VALUE_ARG)
+        return;
+    Statement ** edges = new_val->edges_out;
+    new_val->edges_out = (Statement **)zero_alloc(0);
+    for (size_t j = 0; j < array_len(edges, Statement *); j++)
+    {
+        if (edges[j]->block != block)
+            array_push(new_val->edges_out, Statement *, edges[j]);
+    }
+    for (size_t j = 0; j < array_len(block->statements, Statement *); j++)
+    {
+        Statement * statement = block->statements[j];
+        for (size_t n = 0; n < array_len(statement->args, Operand); n++)
+        {
+            if (statement->args[n].variant == OP_KIND_VALUE && statement->args[n].value == new_val)
+                array_push(new_val->edges_out, Statement *, statement);
+        }
+    }
 }
 
 static inline void validate_links(Program * program)
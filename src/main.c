@@ -5,9 +5,11 @@
 #include <assert.h>
 
 //#define BBAE_DEBUG_SPILLS
+//#define BBAE_REGALLOC_LOCAL
 
 #include "memory.h"
 #include "bbae_api_jit.h"
+#include "bbae_api_elf.h"
 
 /*
 void print_asm(uint8_t * code, size_t len)
@@ -43,6 +45,10 @@ int main(int argc, char ** argv)
 {
     if (argc < 2)
         return puts("please provide file"), 0;
+    // `main file.bbae -o file.o` compiles to an object file instead of running the module's main function
+    const char * object_fname = 0;
+    if (argc >= 4 && strcmp(argv[2], "-o") == 0)
+        object_fname = argv[3];
     
     FILE * f = fopen(argv[1], "rb");
     
@@ -61,6 +67,23 @@ int main(int argc, char ** argv)
     
     Program * program = parse(buffer);
     do_optimization(program);
+    
+    if (object_fname)
+    {
+        byte_buffer object = do_elf_lowering(program);
+        FILE * out = fopen(object_fname, "wb");
+        if (!out)
+            return printf("failed to open %s\n", object_fname), 1;
+        size_t written = fwrite(object.data, 1, object.len, out);
+        // fclose flushes what's still buffered, so a full disk can show up there too
+        if (fclose(out) != 0 || written != object.len)
+            return printf("failed to write %s\n", object_fname), 1;
+        free(object.data);
+        free_all_compiler_allocs();
+        free(buffer);
+        return 0;
+    }
+    
     JitOutput jitinfo = do_jit_lowering(program);
     SymbolEntry * symbollist = jitinfo.symbollist;
     uint8_t * jit_code = jitinfo.jit_code;
@@ -53,27 +53,6 @@ static void apply_relocations(Program * program, NameUsageInfo * usages, byte_bu
     }
 }
 
-static NameUsageInfo * emitter_label_usages = 0;
-static void add_label_relocation(uint64_t loc, const char * name, uint8_t size)
-{
-    add_relocation(&emitter_label_usages, loc, name, size);
-}
-static int64_t get_block_loc_or_assert(const char * name, void * _func)
-{
-    Function * func = (Function *)_func;
-    Block * block = find_block(func, name);
-    if (!block)
-    {
-        printf("failed to find block with name %s\n", name);
-        assert(0); 
-    }
-    return block->start_offset;
-}
-static void apply_label_relocations(Program * program, byte_buffer * code, Function * func)
-{
-    apply_relocations(program, emitter_label_usages, code, get_block_loc_or_assert, (void *)func);
-}
-
 static NameUsageInfo * static_addr_relocations = 0;
 static void add_static_relocation(uint64_t loc, const char * name, uint8_t size)
 {
@@ -137,7 +116,6 @@ static void apply_symbol_relocations(Program * program, byte_buffer * code, Symb
 
 static void nullify_relocation_buffers(void)
 {
-    emitter_label_usages = 0;
     static_addr_relocations = 0;
     emitter_symbol_usages = 0;
 }
@@ -4,8 +4,12 @@
 #include <string.h>
 #include <assert.h>
 
+// check every register allocation the tests do
+#define BBAE_VERIFY_REGALLOC
+
 #include "memory.h"
 #include "bbae_api_jit.h"
+#include "bbae_api_elf.h"
 
 #if __STDC_VERSION__ <= 199901L
 #define _Static_assert(a, b) assert(((void)(b), a))
@@ -182,6 +186,145 @@ static int _old_stdout = 0;
 #define REOPEN_STDOUT ;
 */
 
+// compiles a program from source and calls its main function once per arg, without recompiling in between
+void compile_source_and_run_each(const char * source, const uint64_t * args, uint64_t * out, size_t count)
+{
+    Program * program = parse(source);
+    do_optimization(program);
+    JitOutput jitinfo = do_jit_lowering(program);
+    SymbolEntry * symbollist = jitinfo.symbollist;
+    assert(symbollist);
+    
+    ptrdiff_t loc = -1;
+    for (size_t i = 0; symbollist[i].name; i++)
+    {
+        if (strcmp(symbollist[i].name, "main") == 0)
+            loc = symbollist[i].loc;
+    }
+    assert(loc >= 0);
+
+#ifndef _MSC_VER
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpedantic"
+#endif
+    uint64_t (*jit_main)(uint64_t) = (uint64_t(*)(uint64_t))(void *)(&jitinfo.jit_code[loc]);
+#ifndef _MSC_VER
+#pragma GCC diagnostic pop
+#endif
+    
+    for (size_t i = 0; i < count; i++)
+        out[i] = jit_main(args[i]);
+    
+    jit_free(jitinfo);
+    free_all_compiler_allocs();
+}
+
+// checks div, idiv, rem, and irem by every divisor in [first, last] (as bit patterns) against C's own division
+// divisions by constants get lowered to multiplications by magic numbers, which are different for every divisor, so
+// this tries all of them, in batches of one function each
+void test_const_division_sweep(int bits, uint64_t first, uint64_t last)
+{
+    const size_t batch = 64;
+    const char * ops[] = {"div", "idiv", "rem", "irem"};
+    uint64_t mask = ((uint64_t)1 << bits) - 1;
+    uint64_t sign = (uint64_t)1 << (bits - 1);
+    // everything but the most negative number, which overflows when divided by -1
+    uint64_t args[] = {0, 1, 2, 7, 100, 127, 1000, 12345, 32767, mask, mask - 6, mask - 999, sign + 1, sign + 12345, sign - 1};
+    size_t arg_count = sizeof(args) / sizeof(args[0]);
+    uint64_t out[sizeof(args) / sizeof(args[0])];
+    
+    size_t source_cap = batch * 4 * 160 + 256;
+    char * source = (char *)malloc(source_cap);
+    assert(source);
+    
+    for (uint64_t start = first; start <= last; start += batch)
+    {
+        uint64_t end = start + batch - 1 < last ? start + batch - 1 : last;
+        size_t len = snprintf(source, source_cap, "func main returns i64\n    arg a i64\n    x = trim i%d a\n    h0 = mov 0i64\n", bits);
+        size_t n = 0;
+        for (uint64_t d = start; d <= end; d++)
+        {
+            int64_t sd = (int64_t)((d ^ sign) - sign);
+            for (size_t o = 0; o < 4; o++)
+            {
+                len += snprintf(source + len, source_cap - len,
+                    "    q%zu = %s x %lldi%d\n    z%zu = zext i64 q%zu\n    m%zu = mul h%zu 31i64\n    h%zu = add m%zu z%zu\n",
+                    n, ops[o], (long long)sd, bits, n, n, n, n, n + 1, n, n);
+                n += 1;
+            }
+        }
+        len += snprintf(source + len, source_cap - len, "    return h%zu\nendfunc\n", n);
+        assert(len < source_cap);
+        
+        compile_source_and_run_each(source, args, out, arg_count);
+        
+        for (size_t i = 0; i < arg_count; i++)
+        {
+            uint64_t ux = args[i] & mask;
+            int64_t sx = (int64_t)((ux ^ sign) - sign);
+            uint64_t h = 0;
+            for (uint64_t d = start; d <= end; d++)
+            {
+                int64_t sd = (int64_t)((d ^ sign) - sign);
+                uint64_t results[] = {ux / d, (uint64_t)(sx / sd), ux % d, (uint64_t)(sx % sd)};
+                for (size_t o = 0; o < 4; o++)
+                    h = h * 31 + (results[o] & mask);
+            }
+            if (out[i] != h)
+            {
+                REOPEN_STDOUT;
+                printf("i%d division by %zu to %zu of %zu: got %zu, expected %zu\n", bits, start, end, ux, out[i], h);
+                assert(out[i] == h);
+            }
+        }
+    }
+    
+    free(source);
+}
+
+// compiles to an ELF object file and links it against a C driver with the system compiler, which has to exit with 0
+void compile_and_link(const char * fname, const char * object_fname, const char * driver_fname)
+{
+    FILE * f = fopen(fname, "rb");
+    
+    fseek(f, 0, SEEK_END);
+    long length = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    
+    char * buffer = (char *)malloc(length+1);
+    if (!buffer)
+        puts("failed to allocate memory"), exit(-1);
+    
+    size_t n = fread(buffer, 1, length, f);
+    assert(n == (size_t)length);
+    buffer[length] = 0;
+    
+    fclose(f);
+    
+    Program * program = parse(buffer);
+    do_optimization(program);
+    byte_buffer object = do_elf_lowering(program);
+    
+    f = fopen(object_fname, "wb");
+    assert(f);
+    n = fwrite(object.data, 1, object.len, f);
+    assert(n == object.len);
+    fclose(f);
+    
+    free(object.data);
+    free_all_compiler_allocs();
+    free(buffer);
+    
+    char command[1024];
+    snprintf(command, sizeof(command), "cc %s %s -o %s.out && ./%s.out", driver_fname, object_fname, object_fname, object_fname);
+    int status = system(command);
+    assert(status == 0);
+    
+    snprintf(command, sizeof(command), "%s.out", object_fname);
+    remove(command);
+    remove(object_fname);
+}
+
 #define TEST_XMM(X, T, V) { \
     CLOSE_STDOUT; \
     uint64_t n = compile_and_run(X, 0, 1); \
@@ -223,7 +366,63 @@ int main(int argc, char ** argv)
     
     TEST_RAX("examples/fib.bbae", uint64_t, 433494437);
     
+    TEST_RAX("tests/layouttest.bbae", uint64_t, 4950);
+    TEST_RAX("tests/jumpthreadtest.bbae", uint64_t, 5);
+    TEST_RAX("tests/addrmodetest.bbae", uint64_t, 285);
+    TEST_RAX("tests/constdivtest.bbae", uint64_t, 9249144853799021606ULL);
+    TEST_RAX("tests/rangetest.bbae", uint64_t, 9112986350884330724ULL);
+    TEST_RAX("tests/specializetest.bbae", uint64_t, 13899528724443830915ULL);
+    TEST_RAX("tests/scheduletest.bbae", uint64_t, 28400965283ULL);
+    TEST_RAX("tests/loadelimtest.bbae", uint64_t, 709052);
+    TEST_RAX("tests/exttest.bbae", uint64_t, 8549736969134810648ULL);
+    TEST_RAX("tests/cmptest.bbae", uint64_t, 5810652886697548170ULL);
+    TEST_RAX("tests/regalloctest.bbae", uint64_t, 18446744073709548280ULL);
+    TEST_RAX("tests/remattest.bbae", uint64_t, 11867390722282167888ULL);
+    TEST_RAX("tests/slotsharetest.bbae", uint64_t, 6678545933364056163ULL);
+    TEST_RAX("tests/shrinkwraptest.bbae", uint64_t, 103297109ULL);
+    TEST_RAX("tests/deadargtest.bbae", uint64_t, 2450);
+    TEST_RAX("tests/shuffletest.bbae", uint64_t, 4796917314417653542ULL);
+    TEST_RAX("tests/avxtest.bbae", uint64_t, 13986187390170662982ULL);
+    TEST_RAX("tests/memoptest.bbae", uint64_t, 4743131937073094038ULL);
+    TEST_RAX("tests/indexaliastest.bbae", uint64_t, 49);
+    TEST_RAX("tests/immregtest.bbae", uint64_t, 526);
+    
+    // every i8 divisor, and i16 divisors near zero and near the ends of the signed range
+    CLOSE_STDOUT;
+    test_const_division_sweep(8, 1, 0xFF);
+    test_const_division_sweep(16, 1, 0x3FF);
+    test_const_division_sweep(16, 0x7E00, 0x81FF);
+    test_const_division_sweep(16, 0xFC00, 0xFFFF);
+    REOPEN_STDOUT;
+    puts("constant division sweep -- pass!");
     TEST_RUNS("examples/global.bbae");
+
+#if defined(__linux__) && defined(__x86_64__)
+    {
+        CLOSE_STDOUT;
+        compile_and_link("tests/elftest.bbae", "tests/elftest.o", "tests/elfdriver.c");
+        REOPEN_STDOUT;
+        puts("tests/elftest.bbae: (linked and ran) -- pass!");
+    }
+#endif
+    
+    // again with the SSE and legacy shift forms, for when the CPU running the tests has AVX and BMI2
+    x86_features_set(0, 0);
+    TEST_XMM("tests/gravtest.bbae", double, 4899999.999928221106529235839844);
+    TEST_RAX("tests/rangetest.bbae", uint64_t, 9112986350884330724ULL);
+    TEST_RAX("tests/avxtest.bbae", uint64_t, 13986187390170662982ULL);
+    TEST_RAX("tests/memoptest.bbae", uint64_t, 4743131937073094038ULL);
+    
+    // again with more loop header padding, and with none, which moves jumps in and out of rel8 range
+    code_align_set_level(2);
+    TEST_XMM("tests/gravtest.bbae", double, 4899999.999928221106529235839844);
+    TEST_RAX("tests/layouttest.bbae", uint64_t, 4950);
+    TEST_RAX("tests/slotsharetest.bbae", uint64_t, 6678545933364056163ULL);
+    TEST_RAX("tests/shrinkwraptest.bbae", uint64_t, 103297109ULL);
+    code_align_set_level(0);
+    TEST_RAX("tests/layouttest.bbae", uint64_t, 4950);
+    TEST_RAX("tests/slotsharetest.bbae", uint64_t, 6678545933364056163ULL);
+    code_align_set_level(1);
     
     puts("Tests finished!");
     fflush(stdout);
@@ -5,23 +5,187 @@
 // NOTE: Despite the name, this is the AMD64/x86_64 (64-bit only) backend. x86 is treated as an architecture family, not a specific architecture.
 
 #include "regalloc_x86.h"
+#ifdef BBAE_VERIFY_REGALLOC
+#include "regalloc_verify_x86.h"
+#endif
 #include "emitter_x86.h"
+#include "minst_x86.h"
+#include "peephole_x86.h"
+#include "isel_x86.h"
+#include "schedule_x86.h"
 #include "../compiler_common.h"
 #include "../relocation_helpers.h"
 
+// How compile_file pads code with NOPs so that it starts on cache line and fetch block boundaries.
+// Function entries are always aligned. Loop headers (that aren't cold) are aligned too, so that small loops are less
+// likely to straddle a 32-byte or 64-byte boundary, which costs an extra fetch or uop cache line every iteration. But
+// anything that falls through into a loop header has to run its padding, so padding longer than loop_max_padding is
+// left out and the header stays where it is.
+typedef struct _CodeAlignPolicy {
+    uint8_t function_align;
+    uint8_t loop_align; // 0 to not align loop headers
+    uint8_t loop_max_padding;
+} CodeAlignPolicy;
+
+static CodeAlignPolicy code_align_policy = {16, 16, 10};
+
+// 0: smallest code, 1: the default, 2: fastest code (bigger alignment, which takes more padding)
+static inline void code_align_set_level(int level)
+{
+    CodeAlignPolicy policies[] = {
+        {16, 0, 0},
+        {16, 16, 10},
+        {16, 32, 15},
+    };
+    assert(level >= 0 && level <= 2);
+    code_align_policy = policies[level];
+}
+
+// Where a stack slot is in use. Slots that are only ever directly loaded from and stored to, all within one block,
+// and first stored to, are live from their first access to their last one. Anything else is live everywhere.
+typedef struct _SlotLifetime {
+    uint64_t size;
+    uint64_t align;
+    size_t index;
+    uint8_t used;
+    uint8_t everywhere;
+    uint8_t starts_with_store;
+    Block * block;
+    size_t start;
+    size_t end;
+} SlotLifetime;
+
+// Bigger alignment first, then bigger size, so that sharing slots need as little padding as possible.
+static int _slot_lifetime_compare(const void * a, const void * b)
+{
+    const SlotLifetime * x = (const SlotLifetime *)a;
+    const SlotLifetime * y = (const SlotLifetime *)b;
+    if (x->align != y->align)
+        return x->align < y->align ? 1 : -1;
+    if (x->size != y->size)
+        return x->size < y->size ? 1 : -1;
+    return x->index < y->index ? -1 : x->index > y->index;
+}
+
+static uint8_t slot_lifetimes_interfere(SlotLifetime * a, SlotLifetime * b)
+{
+    if (!a->used || !b->used)
+        return 0;
+    if (a->everywhere || b->everywhere)
+        return 1;
+    return a->block == b->block && a->start <= b->end && b->start <= a->end;
+}
+
+static SlotLifetime * find_slot_lifetimes(Function * func)
+{
+    size_t slot_count = array_len(func->stack_slots, Value *);
+    SlotLifetime * lifetimes = (SlotLifetime *)zero_alloc(sizeof(SlotLifetime) * slot_count);
+    for (size_t s = 0; s < slot_count; s++)
+    {
+        assert(func->stack_slots[s]->variant == VALUE_STACKADDR);
+        StackSlot * slot = func->stack_slots[s]->slotinfo;
+        lifetimes[s].size = slot->size;
+        lifetimes[s].align = size_guess_align(slot->size);
+        lifetimes[s].index = s;
+    }
+    
+    for (size_t b = 0; b < array_len(func->blocks, Block *); b++)
+    {
+        Block * block = func->blocks[b];
+        for (size_t i = 0; i < array_len(block->statements, Statement *); i++)
+        {
+            Statement * statement = block->statements[i];
+            for (size_t a = 0; a < array_len(statement->args, Operand); a++)
+            {
+                Operand op = statement->args[a];
+                if (op.variant != OP_KIND_VALUE || !op.value || op.value->variant != VALUE_STACKADDR)
+                    continue;
+                
+                SlotLifetime * lifetime = 0;
+                for (size_t s = 0; s < slot_count; s++)
+                {
+                    if (func->stack_slots[s]->slotinfo == op.value->slotinfo)
+                        lifetime = lifetimes + s;
+                }
+                assert(((void)"stack address of a slot from another function", lifetime));
+                
+                uint8_t is_store = strcmp(statement->statement_name, "store") == 0 && a == 0;
+                uint8_t is_load = strcmp(statement->statement_name, "load") == 0 && a == 1;
+                // loads folded into arithmetic by instruction selection, and read-modify-write stores
+                is_load = is_load || (a == 1 && isel_statement_reads_memory(statement)) ||
+                    (a == 0 && str_begins_with(statement->statement_name, "store_"));
+                // the address escapes (mov, add, call, stored as a value, etc), so we can't see every access
+                if (!is_store && !is_load)
+                    lifetime->everywhere = 1;
+                
+                if (!lifetime->used)
+                {
+                    lifetime->used = 1;
+                    // only a store that overwrites the whole slot hides whatever was in it before
+                    lifetime->starts_with_store = is_store && array_len(statement->args, Operand) <= 3 &&
+                        (array_len(statement->args, Operand) == 2 || statement->args[2].rawint == 0) &&
+                        type_size(statement->args[1].value->type) >= lifetime->size;
+                    lifetime->block = block;
+                    lifetime->start = i;
+                }
+                else if (lifetime->block != block)
+                    lifetime->everywhere = 1;
+                lifetime->end = i;
+            }
+        }
+    }
+    
+    for (size_t s = 0; s < slot_count; s++)
+    {
+        // loaded from before being stored to: the value comes from a previous trip through the block, or is garbage
+        if (lifetimes[s].used && !lifetimes[s].starts_with_store)
+            lifetimes[s].everywhere = 1;
+    }
+    
+    return lifetimes;
+}
+
+// Slots with disjoint lifetimes (mostly spill slots) share the same stack space.
 static void allocate_stack_slots(Program * program)
 {
     for (size_t f = 0; f < array_len(program->functions, Function *); f++)
     {
         Function * func = program->functions[f];
+        size_t slot_count = array_len(func->stack_slots, Value *);
+        SlotLifetime * lifetimes = find_slot_lifetimes(func);
+        qsort(lifetimes, slot_count, sizeof(SlotLifetime), _slot_lifetime_compare);
+        
+        // region each (sorted) slot lives in; regions are named by their first, and thus largest, slot
+        size_t * region = (size_t *)zero_alloc(sizeof(size_t) * slot_count);
+        for (size_t s = 0; s < slot_count; s++)
+        {
+            region[s] = s;
+            for (size_t r = 0; r < s && region[s] == s; r++)
+            {
+                if (region[r] != r || lifetimes[r].size < lifetimes[s].size || lifetimes[r].align < lifetimes[s].align)
+                    continue;
+                uint8_t fits = 1;
+                for (size_t m = r; m < s && fits; m++)
+                {
+                    if (region[m] == r && slot_lifetimes_interfere(lifetimes + m, lifetimes + s))
+                        fits = 0;
+                }
+                if (fits)
+                    region[s] = r;
+            }
+        }
+        
         uint64_t offset = 0;
-        for (size_t s = 0; s < array_len(func->stack_slots, Value *); s++)
+        for (size_t s = 0; s < slot_count; s++)
         {
-            assert(func->stack_slots[s]->variant == VALUE_STACKADDR);
-            StackSlot * slot = func->stack_slots[s]->slotinfo;
-            uint64_t align = size_guess_align(slot->size);
+            StackSlot * slot = func->stack_slots[lifetimes[s].index]->slotinfo;
+            if (region[s] != s)
+            {
+                slot->offset = func->stack_slots[lifetimes[region[s]].index]->slotinfo->offset;
+                continue;
+            }
             offset += slot->size;
-            while (offset % align)
+            while (offset % lifetimes[s].align)
                 offset += 1;
             slot->offset = offset;
         }
@@ -64,141 +228,502 @@ static EncOperand get_basic_encoperand_mem(Value * value, uint8_t want_ptr)
     }
 }
 
+// memory operand for a load or store, including any address arithmetic that isel_fold_addressing_modes folded into it
+// the folded operands start at addr_index + 1 for loads and addr_index + 2 for stores
+static EncOperand get_address_encoperand(Statement * statement, size_t addr_index, size_t extra_index, int word_size)
+{
+    Value * base = statement->args[addr_index].value;
+    if (array_len(statement->args, Operand) <= extra_index)
+        return enc_mem_change_size(get_basic_encoperand_mem(base, 1), word_size);
+    
+    assert(statement->args[extra_index].variant == OP_KIND_RAWINTEGER);
+    int64_t offset = statement->args[extra_index].rawint;
+    enum Register index_reg = REG_NONE;
+    int scale = 0;
+    if (array_len(statement->args, Operand) > extra_index + 1)
+    {
+        Value * index = statement->args[extra_index + 1].value;
+        assert(index && index->regalloced);
+        index_reg = (enum Register)index->regalloc;
+        scale = (int)statement->args[extra_index + 2].rawint;
+    }
+    
+    enum Register base_reg;
+    if (base->variant == VALUE_STACKADDR)
+    {
+        base_reg = REG_RBP;
+        offset -= base->slotinfo->offset;
+    }
+    else
+    {
+        assert(base->regalloced);
+        base_reg = (enum Register)base->regalloc;
+    }
+    return enc_mem_full(base_reg, index_reg, scale, offset, word_size);
+}
+
 static EncOperand get_basic_encoperand(Value * value)
 {
     return get_basic_encoperand_mem(value, 0);
 }
 
+// sign- or zero-extends a register to the (larger) size of the destination register
+static void emit_extend(MInst ** insts, EncOperand dest, EncOperand src, uint8_t is_signed)
+{
+    if (src.size == dest.size)
+    {
+        if (!encops_equal(dest, src))
+            minst_emit_2(insts, INST_MOV, dest, src);
+    }
+    else if (is_signed)
+        minst_emit_2(insts, INST_MOVSX, dest, src);
+    else if (src.size == 4)
+    {
+        dest.size = 4;
+        minst_emit_2(insts, INST_MOV, dest, src);
+    }
+    else
+        minst_emit_2(insts, INST_MOVZX, dest, src);
+}
+
+// a condition that conditional jumps can test the flags for
+// float comparisons also have to look at the parity flag, which ucomiss/ucomisd set when either side is NaN
+typedef struct _BranchCond {
+    int jcc; // the jump that's taken when the flags say that the condition holds
+    uint8_t parity; // 0: doesn't care about parity, 1: also needs parity to be clear, 2: also holds if parity is set
+} BranchCond;
+
+static BranchCond branch_cond_invert(BranchCond cond)
+{
+    // jumps come in pairs of opposite conditions
+    cond.jcc = INST_JO + ((cond.jcc - INST_JO) ^ 1);
+    cond.parity = cond.parity == 1 ? 2 : cond.parity == 2 ? 1 : 0;
+    return cond;
+}
+
+static void emit_branch(MInst ** insts, BranchCond cond, const char * label)
+{
+    if (cond.parity == 1)
+    {
+        const char * skip_label = make_temp_name();
+        minst_emit_jump(insts, INST_JP, skip_label);
+        minst_emit_jump(insts, cond.jcc, label);
+        minst_label(insts, skip_label);
+    }
+    else
+    {
+        minst_emit_jump(insts, cond.jcc, label);
+        if (cond.parity == 2)
+            minst_emit_jump(insts, INST_JP, label);
+    }
+}
+
+static uint8_t statement_is_compare(Statement * statement)
+{
+    return str_begins_with(statement->statement_name, "cmp_") || str_begins_with(statement->statement_name, "icmp_") ||
+           str_begins_with(statement->statement_name, "fcmp_");
+}
+
+// emits the flag-setting part of a comparison, returning the condition that the flags have to be tested for
+static BranchCond emit_compare(MInst ** insts, Statement * statement)
+{
+    const char * name = statement->statement_name;
+    Value * a = statement->args[0].value;
+    Value * b = statement->args[1].value;
+    BranchCond cond;
+    cond.parity = 0;
+    
+    if (str_begins_with(name, "fcmp_"))
+    {
+        // unordered results set ZF, PF, and CF, so "above" and "above or equal" are false for NaNs. less-than is
+        // greater-than with the operands swapped, and equality needs a parity check
+        const char * kind = name + 5;
+        if (strcmp(kind, "l") == 0 || strcmp(kind, "le") == 0)
+        {
+            Value * temp = a;
+            a = b;
+            b = temp;
+        }
+        if (strcmp(kind, "g") == 0 || strcmp(kind, "l") == 0)
+            cond.jcc = INST_JNBE;
+        else if (strcmp(kind, "ge") == 0 || strcmp(kind, "le") == 0)
+            cond.jcc = INST_JNB;
+        else if (strcmp(kind, "eq") == 0)
+        {
+            cond.jcc = INST_JZ;
+            cond.parity = 1;
+        }
+        else if (strcmp(kind, "ne") == 0)
+        {
+            cond.jcc = INST_JNZ;
+            cond.parity = 2;
+        }
+        else
+            assert(((void)"unknown float comparison", 0));
+        
+        EncOperand op1 = get_basic_encoperand(a);
+        EncOperand op2 = get_basic_encoperand(b);
+        if ((int64_t)a->regalloc < 0)
+        {
+            EncOperand scratch = enc_reg(REG_XMM5, 8);
+            minst_emit_2(insts, INST_MOVQ, scratch, op1);
+            op1 = scratch;
+        }
+        minst_emit_2(insts, a->type.variant == TYPE_F32 ? INST_UCOMISS : INST_UCOMISD, op1, op2);
+        return cond;
+    }
+    
+    uint8_t is_signed = name[0] == 'i';
+    const char * kind = name + 4 + is_signed;
+    if (strcmp(kind, "eq") == 0)
+        cond.jcc = INST_JZ;
+    else if (strcmp(kind, "ne") == 0)
+        cond.jcc = INST_JNZ;
+    else if (strcmp(kind, "g") == 0)
+        cond.jcc = is_signed ? INST_JNLE : INST_JNBE;
+    else if (strcmp(kind, "ge") == 0)
+        cond.jcc = is_signed ? INST_JNL : INST_JNB;
+    else if (strcmp(kind, "l") == 0)
+        cond.jcc = is_signed ? INST_JL : INST_JB;
+    else if (strcmp(kind, "le") == 0)
+        cond.jcc = is_signed ? INST_JLE : INST_JBE;
+    else
+        assert(((void)"unknown comparison", 0));
+    
+    EncOperand op1 = get_basic_encoperand(a);
+    EncOperand op2 = get_basic_encoperand(b);
+    // x86 can't compare two memory operands
+    if ((int64_t)a->regalloc < 0 && b->variant != VALUE_CONST && (int64_t)b->regalloc < 0)
+    {
+        EncOperand scratch = enc_reg(REG_R11, op1.size);
+        minst_emit_2(insts, INST_MOV, scratch, op1);
+        op1 = scratch;
+    }
+    minst_emit_2(insts, INST_CMP, op1, op2);
+    return cond;
+}
+
+// writes the condition that the flags hold into a byte
+static void emit_setcc(MInst ** insts, BranchCond cond, EncOperand dest)
+{
+    minst_emit_1(insts, INST_SETO + (cond.jcc - INST_JO), dest);
+    if (cond.parity)
+    {
+        EncOperand scratch = enc_reg(REG_R11, 1);
+        minst_emit_1(insts, cond.parity == 1 ? INST_SETNP : INST_SETP, scratch);
+        minst_emit_2(insts, cond.parity == 1 ? INST_AND : INST_OR, dest, scratch);
+    }
+}
+
+// whether the value's register is known to have everything above its low 32 bits cleared, because x86 clears the
+// upper half of 64-bit registers when writing to their 32-bit halves
+static uint8_t value_upper_bits_cleared(Value * value)
+{
+    if (value->variant != VALUE_SSA || !type_is_int(value->type) || type_size(value->type) != 4)
+        return 0;
+    if ((int64_t)value->regalloc < 0 || value->regalloc >= REG_XMM0)
+        return 0;
+    Statement * statement = value->ssa;
+    const char * name = statement->statement_name;
+    // these always end by writing their output's 32-bit register, unlike movs and trims, which skip copies to the
+    // same register
+    const char * writers[] = {
+        "add", "sub", "mul", "imul", "and", "or", "xor",
+        "shl", "shr", "sar", "shr_unsafe", "sar_unsafe",
+        "load",
+    };
+    for (size_t i = 0; i < sizeof(writers)/sizeof(char *); i++)
+    {
+        if (strcmp(name, writers[i]) == 0)
+            return 1;
+    }
+    // extensions from narrower types are done with 32-bit movzx/movsx
+    if ((strcmp(name, "zext") == 0 || strcmp(name, "sext") == 0) && type_size(statement->args[1].value->type) < 4)
+        return 1;
+    // constants get moved into registers with 32-bit moves
+    return strcmp(name, "mov") == 0 && statement->args[0].value->variant == VALUE_CONST;
+}
+
 uint8_t reg_shuffle_needed(Value ** block_args, Operand * args, size_t count)
 {
-    return 1;
     for (size_t i = 0; i < count; i++)
     {
         assert(args[i].value);
-        if (args[i].value->variant == VALUE_CONST)
+        if (args[i].value->variant == VALUE_CONST || args[i].value->variant == VALUE_STACKADDR)
             return 1;
         if (block_args[i]->regalloc != args[i].value->regalloc)
             return 1;
     }
     return 0;
 }
-void reg_shuffle_single(byte_buffer * code, int64_t * in2out, uint8_t * in2out_color, size_t in)
+
+// a parallel copy into registers: every destination register gets its value from the state before any of the moves
+// happen, so moves have to be ordered such that nothing gets overwritten before it's read
+typedef struct _RegShuffle {
+    int64_t src[32]; // register each register's new value comes from, or -1
+    Value * value[32]; // constants and stack slot addresses, which don't live in registers
+    uint8_t used[32];
+} RegShuffle;
+
+static void reg_shuffle_init(RegShuffle * shuffle)
 {
-    int64_t out = in2out[in];
-    EncOperand reg_scratch_int = enc_reg(REG_R11, 8);
-    EncOperand reg_scratch_float = enc_reg(REG_XMM5, 8);
-    
-    EncOperand reg_out = enc_reg(out, 8);
-    EncOperand reg_in = enc_reg(in, 8);
-    
-    if (in2out[out] < 0) // not a typo
+    for (size_t i = 0; i < 32; i++)
+        shuffle->src[i] = -1;
+    memset(shuffle->value, 0, sizeof(shuffle->value));
+    memset(shuffle->used, 0, sizeof(shuffle->used));
+}
+
+// records that `value` has to end up in register `out`
+static void reg_shuffle_add(RegShuffle * shuffle, Value * value, int64_t out)
+{
+    assert(out >= 0 && out < 32);
+    assert(((void)"register written twice in one shuffle", !shuffle->used[out]));
+    shuffle->used[out] = 1;
+    if (value->variant == VALUE_CONST || value->variant == VALUE_STACKADDR)
     {
-        //puts("a");
-        if (in <= REG_R15)
-            enc_emit_2(code, INST_MOV, reg_out, reg_in);
-        else
-            enc_emit_2(code, INST_MOVAPS, reg_out, reg_in);
-        in2out[in] = -1;
+        shuffle->value[out] = value;
+        return;
+    }
+    assert(value->variant == VALUE_SSA || value->variant == VALUE_ARG);
+    assert(value->regalloced);
+    assert(((void)"spilled shuffle sources not yet supported", (int64_t)value->regalloc >= 0));
+    assert(value->regalloc < 32);
+    // no MOV needed
+    if ((int64_t)value->regalloc != out)
+        shuffle->src[out] = value->regalloc;
+}
+static void reg_shuffle_emit_value(MInst ** insts, Value * value, int64_t out)
+{
+    if (value->variant == VALUE_STACKADDR)
+    {
+        minst_emit_2(insts, INST_LEA, enc_reg(out, 8), enc_mem_change_size(get_basic_encoperand(value), 8));
+        return;
     }
+    if (out <= REG_R15)
+        minst_emit_2(insts, INST_MOV, enc_reg(out, type_size(value->type)), get_basic_encoperand(value));
+    else if (value_is_basic_zero_constant(value))
+        minst_emit_2(insts, INST_XORPS, enc_reg(out, 8), enc_reg(out, 8));
     else
     {
-        // hit a cycle! mov into temp register. will be mov'd out of at the end of the cycle
-        if (in2out_color[out])
+        EncOperand reg_scratch_int = enc_reg(REG_R11, 8);
+        minst_emit_2(insts, INST_MOV, reg_scratch_int, enc_imm(value->constant, 8));
+        minst_emit_2(insts, INST_MOVQ, enc_reg(out, 8), reg_scratch_int);
+    }
+}
+
+// emits one move per destination that isn't already in place, plus per cycle of registers that all need each
+// other's values either one fewer xchg than the cycle is long (general purpose registers) or one extra move through
+// the scratch register (xmm registers, which have no xchg)
+static void reg_shuffle_emit(MInst ** insts, RegShuffle * shuffle)
+{
+    // number of moves that still need to read from each register
+    uint8_t readers[32];
+    memset(readers, 0, sizeof(readers));
+    for (size_t out = 0; out < 32; out++)
+    {
+        if (shuffle->src[out] >= 0)
+            readers[shuffle->src[out]] += 1;
+    }
+    
+    // moves into registers that nothing needs to read anymore can be done right away, which can free up their sources
+    uint8_t progress = 1;
+    while (progress)
+    {
+        progress = 0;
+        for (size_t out = 0; out < 32; out++)
         {
-            //puts("b");
-            if (out <= REG_R15)
-            {
-                enc_emit_2(code, INST_MOV, reg_scratch_int, reg_out);
-                enc_emit_2(code, INST_MOV, reg_out, reg_in);
-            }
-            else
+            int64_t in = shuffle->src[out];
+            if (in < 0 || readers[out] > 0)
+                continue;
+            minst_emit_2(insts, out <= REG_R15 ? INST_MOV : INST_MOVAPS, enc_reg(out, 8), enc_reg(in, 8));
+            readers[in] -= 1;
+            shuffle->src[out] = -1;
+            progress = 1;
+        }
+    }
+    
+    // every register that's left is read exactly once, so what's left is a set of disjoint cycles
+    for (size_t start = 0; start < 32; start++)
+    {
+        if (shuffle->src[start] < 0)
+            continue;
+        int64_t out = start;
+        if (start <= REG_R15)
+        {
+            // each xchg puts one value into place and moves the start's old value one step along the cycle
+            while (shuffle->src[out] != (int64_t)start)
             {
-                enc_emit_2(code, INST_MOVAPS, reg_scratch_float, reg_out);
-                enc_emit_2(code, INST_MOVAPS, reg_out, reg_in);
+                int64_t in = shuffle->src[out];
+                minst_emit_2(insts, INST_XCHG, enc_reg(out, 8), enc_reg(in, 8));
+                shuffle->src[out] = -1;
+                out = in;
             }
-            
-            in2out[in] = -1;
-            in2out_color[out] = 2;
         }
         else
         {
-            //puts("c");
-            in2out_color[in] = 1;
-            reg_shuffle_single(code, in2out, in2out_color, out);
-            if (in2out_color[in] == 2)
-            {
-                //puts("d");
-                if (in <= REG_R15)
-                    enc_emit_2(code, INST_MOV, reg_out, reg_scratch_int);
-                else
-                    enc_emit_2(code, INST_MOVAPS, reg_out, reg_scratch_float);
-            }
-            else
+            EncOperand reg_scratch_float = enc_reg(REG_XMM5, 8);
+            minst_emit_2(insts, INST_MOVAPS, reg_scratch_float, enc_reg(start, 8));
+            while (shuffle->src[out] != (int64_t)start)
             {
-                //puts("e");
-                if (in <= REG_R15)
-                    enc_emit_2(code, INST_MOV, reg_out, reg_in);
-                else
-                    enc_emit_2(code, INST_MOVAPS, reg_out, reg_in);
+                int64_t in = shuffle->src[out];
+                minst_emit_2(insts, INST_MOVAPS, enc_reg(out, 8), enc_reg(in, 8));
+                shuffle->src[out] = -1;
+                out = in;
             }
-            in2out[in] = -1;
+            minst_emit_2(insts, INST_MOVAPS, enc_reg(out, 8), reg_scratch_float);
         }
+        shuffle->src[out] = -1;
     }
-}
-
-void do_reg_shuffle(byte_buffer * code, int64_t * in2out, uint8_t * in2out_color)
-{
-    //puts("----");
+    
+    // these don't read from any register that the shuffle writes to, so they go last
     for (size_t out = 0; out < 32; out++)
     {
-        if (in2out[out] < 0)
-            continue;
-        reg_shuffle_single(code, in2out, in2out_color, out);
+        if (shuffle->value[out])
+            reg_shuffle_emit_value(insts, shuffle->value[out], out);
     }
 }
-void reg_shuffle_block_args(byte_buffer * code, Value ** block_args, Operand * args, size_t count)
+void reg_shuffle_block_args(MInst ** insts, Value ** block_args, Operand * args, size_t count)
 {
-    int64_t in2out[32];
-    for (size_t i = 0; i < 32; i++)
-        in2out[i] = -1;
-    uint8_t in2out_color[32]; // for cycle detection
-    memset(in2out_color, 0, sizeof(in2out_color));
+    RegShuffle shuffle;
+    reg_shuffle_init(&shuffle);
     
     for (size_t i = 0; i < count; i++)
     {
         assert(args[i].value);
-        if (args[i].value->variant == VALUE_CONST)
-        {
-            assert(((void)"FIXME handle const block args", 0));
-            continue;
-        }
-        assert(args[i].value->variant == VALUE_SSA || args[i].value->variant == VALUE_ARG);
         
         assert(block_args[i]->regalloced);
         assert(((void)"spilled block args not yet supported", (int64_t)block_args[i]->regalloc >= 0));
         assert(block_args[i]->regalloc < 32);
         
-        assert(args[i].value->regalloced);
-        assert(((void)"spilled block args not yet supported", (int64_t)args[i].value->regalloc >= 0));
-        assert(args[i].value->regalloc < 32);
-        
-        // no MOV needed
-        if (block_args[i]->regalloc == args[i].value->regalloc)
-            continue;
-        
-        in2out[args[i].value->regalloc] = block_args[i]->regalloc;
+        reg_shuffle_add(&shuffle, args[i].value, block_args[i]->regalloc);
     }
     
-    do_reg_shuffle(code, in2out, in2out_color);
+    reg_shuffle_emit(insts, &shuffle);
 }
 
-void reg_shuffle_call(byte_buffer * code, Statement * call)
+// saves or restores the callee-saved registers that the function writes to, in the space reserved for them at the
+// bottom of its stack frame
+static void emit_callee_saved_moves(MInst ** insts, Function * func, uint8_t restore)
 {
-    int64_t in2out[32];
-    for (size_t i = 0; i < 32; i++)
-        in2out[i] = -1;
-    uint8_t in2out_color[32]; // for cycle detection
-    memset(in2out_color, 0, sizeof(in2out_color));
+    size_t n = 0;
+    for (size_t i = 0; i < sizeof(func->written_registers); i++)
+    {
+        if (func->written_registers[i] == 2 && i != REG_RBP && i != REG_RSP)
+        {
+            EncOperand mem = enc_mem(REG_RSP, n * 8, 8);
+            if (restore)
+                minst_emit_2(insts, i >= REG_XMM0 ? INST_MOVQ : INST_MOV, enc_reg(i, 8), mem);
+            else
+                minst_emit_2(insts, i >= REG_XMM0 ? INST_MOVQ : INST_MOV, mem, enc_reg(i, 8));
+            n += 1;
+        }
+    }
+}
+
+// number of instructions each edge needed to get its arguments into place, for tuning register allocation
+typedef struct _ShuffleStat {
+    const char * func_name;
+    const char * from;
+    const char * to;
+    size_t moves;
+} ShuffleStat;
+
+static ShuffleStat * shuffle_stats = 0;
+
+void shuffle_stat_record(Function * func, Block * from, Block * to, size_t moves)
+{
+    ShuffleStat stat;
+    stat.func_name = func->name;
+    stat.from = from->name;
+    stat.to = to->name;
+    stat.moves = moves;
+    array_push(shuffle_stats, ShuffleStat, stat);
+}
+
+void reg_shuffle_edge(MInst ** insts, Function * func, Block * from, Block * to, Operand * args)
+{
+    // callee-saved registers have to be saved before the shuffle into the block that saves them writes to them
+    if (to == func->callee_save_block)
+        emit_callee_saved_moves(insts, func, 0);
+    size_t start = array_len(*insts, MInst);
+    reg_shuffle_block_args(insts, to->args, args, array_len(to->args, Value *));
+    shuffle_stat_record(func, from, to, array_len(*insts, MInst) - start);
+}
+
+static void print_shuffle_stats(void)
+{
+    if (!shuffle_stats)
+        return;
+    size_t total = 0;
+    size_t edges_with_moves = 0;
+    for (size_t i = 0; i < array_len(shuffle_stats, ShuffleStat); i++)
+    {
+        ShuffleStat stat = shuffle_stats[i];
+        if (stat.moves == 0)
+            continue;
+        printf("shuffle %s: %s -> %s: %zu\n", stat.func_name, stat.from, stat.to, stat.moves);
+        total += stat.moves;
+        edges_with_moves += 1;
+    }
+    printf("shuffle moves: %zu on %zu out of %zu edges\n", total, edges_with_moves, array_len(shuffle_stats, ShuffleStat));
+}
+
+// what register allocation ended up costing each function, for tuning the allocator
+typedef struct _AllocStat {
+    const char * func_name;
+    size_t spills; // stores into spill slots
+    size_t reloads; // loads from spill slots
+    size_t shuffle_moves; // instructions on edges that move block arguments into place
+    size_t callee_saved; // callee-saved registers that had to be saved and restored
+} AllocStat;
+
+static AllocStat * alloc_stats = 0;
+
+static void alloc_stat_record(Function * func, size_t first_shuffle_stat)
+{
+    AllocStat stat;
+    memset(&stat, 0, sizeof(AllocStat));
+    stat.func_name = func->name;
+    for (size_t b = 0; b < array_len(func->blocks, Block *); b++)
+    {
+        Block * block = func->blocks[b];
+        for (size_t i = 0; i < array_len(block->statements, Statement *); i++)
+        {
+            Statement * statement = block->statements[i];
+            if (strcmp(statement->statement_name, "store") == 0 && statement->args[0].value->variant == VALUE_STACKADDR &&
+                statement->args[0].value->slotinfo->is_spill)
+                stat.spills += 1;
+            if (strcmp(statement->statement_name, "load") == 0 && statement->args[1].value->variant == VALUE_STACKADDR &&
+                statement->args[1].value->slotinfo->is_spill)
+                stat.reloads += 1;
+        }
+    }
+    for (size_t i = first_shuffle_stat; i < array_len(shuffle_stats, ShuffleStat); i++)
+        stat.shuffle_moves += shuffle_stats[i].moves;
+    for (size_t i = 0; i < sizeof(func->written_registers); i++)
+    {
+        if (func->written_registers[i] == 2 && i != REG_RBP && i != REG_RSP)
+            stat.callee_saved += 1;
+    }
+    array_push(alloc_stats, AllocStat, stat);
+}
+
+static void print_alloc_stats(void)
+{
+    if (!alloc_stats)
+        return;
+    for (size_t i = 0; i < array_len(alloc_stats, AllocStat); i++)
+    {
+        AllocStat stat = alloc_stats[i];
+        printf("regalloc %s: %zu spills, %zu reloads, %zu shuffle moves, %zu callee-saved registers\n",
+               stat.func_name, stat.spills, stat.reloads, stat.shuffle_moves, stat.callee_saved);
+    }
+}
+
+void reg_shuffle_call(MInst ** insts, Statement * call)
+{
+    RegShuffle shuffle;
+    reg_shuffle_init(&shuffle);
     
     size_t count = array_len(call->args, Operand);
     
@@ -208,29 +733,114 @@ void reg_shuffle_call(byte_buffer * code, Statement * call)
     {
         Value * value = call->args[i].value;
         assert(value);
-        if (value->variant == VALUE_CONST)
-        {
-            assert(((void)"FIXME handle const call args", 0));
-            continue;
-        }
-        assert(value->variant == VALUE_SSA || value->variant == VALUE_ARG);
-        
-        assert(value->regalloced);
-        assert(((void)"spilled call args not yet supported",  (int64_t)value->regalloc >= 0));
-        assert(value->regalloc < 32);
         assert(type_is_basic(value->type));
         
         int64_t where = abi_get_next_arg_basic(type_is_float(value->type));
         assert(((void)"on-stack call args not yet supported", where >= 0));
         
-        // no MOV needed
-        if (value->regalloc == (uint64_t)where)
+        reg_shuffle_add(&shuffle, value, where);
+    }
+    
+    reg_shuffle_emit(insts, &shuffle);
+}
+
+static uint8_t block_writes_callee_saved(Function * func, Block * block)
+{
+    for (size_t i = 0; i < array_len(block->statements, Statement *); i++)
+    {
+        Value * output = block->statements[i]->output;
+        if (output && output->regalloced && func->written_registers[output->regalloc] == 2)
+            return 1;
+    }
+    // block arguments get written to on the edges into the block, but the saves go first on those edges anyway
+    for (size_t i = 0; i < array_len(block->args, Value *); i++)
+    {
+        if (block != func->entry_block && func->written_registers[block->args[i]->regalloc] == 2)
+            return 1;
+    }
+    return 0;
+}
+
+// shrink-wrapping: picks the block to save callee-saved registers on the way into, so that paths through the function
+// that never touch them don't pay to save and restore them. the block has to dominate every block that writes to them,
+// can't be part of a loop, and has to dominate every return it can reach, so that exactly the returns that come after
+// the saves restore them. returns the entry block if nothing else works, meaning the saves go in the prologue
+// restores[b] gets set for every block b whose returns have to restore the registers
+static Block * find_callee_save_block(Function * func, uint8_t * restores)
+{
+    size_t block_count = array_len(func->blocks, Block *);
+    size_t * idom = func_immediate_dominators(func);
+    
+    // nearest common dominator of every reachable block that writes to a callee-saved register
+    size_t save_at = (size_t)-1;
+    uint8_t * marked = (uint8_t *)zero_alloc(block_count);
+    for (size_t b = 0; b < block_count; b++)
+    {
+        if (idom[b] == (size_t)-1 || !block_writes_callee_saved(func, func->blocks[b]))
             continue;
+        if (save_at == (size_t)-1)
+        {
+            save_at = b;
+            continue;
+        }
+        memset(marked, 0, block_count);
+        for (size_t n = save_at; ; n = idom[n])
+        {
+            marked[n] = 1;
+            if (n == 0)
+                break;
+        }
+        size_t n = b;
+        while (!marked[n])
+            n = idom[n];
+        save_at = n;
+    }
+    
+    uint8_t * reachable = (uint8_t *)zero_alloc(block_count);
+    size_t * stack = (size_t *)zero_alloc(0);
+    while (save_at != (size_t)-1 && save_at != 0)
+    {
+        memset(reachable, 0, block_count);
+        Block * succ[2];
+        size_t succ_count = block_get_successors(func, func->blocks[save_at], succ);
+        for (size_t s = 0; s < succ_count; s++)
+            array_push(stack, size_t, succ[s]->temp);
+        while (array_len(stack, size_t) > 0)
+        {
+            size_t b = array_last(stack, size_t);
+            array_erase(stack, size_t, array_len(stack, size_t) - 1);
+            if (reachable[b])
+                continue;
+            reachable[b] = 1;
+            succ_count = block_get_successors(func, func->blocks[b], succ);
+            for (size_t s = 0; s < succ_count; s++)
+                array_push(stack, size_t, succ[s]->temp);
+        }
         
-        in2out[value->regalloc] = where;
+        uint8_t usable = !reachable[save_at];
+        for (size_t b = 0; b < block_count && usable; b++)
+        {
+            Statement * exit = array_last(func->blocks[b]->statements, Statement *);
+            if (!reachable[b] || strcmp(exit->statement_name, "return") != 0)
+                continue;
+            size_t n = b;
+            while (n != save_at && n != 0)
+                n = idom[n];
+            usable = n == save_at;
+        }
+        if (usable)
+        {
+            reachable[save_at] = 1;
+            for (size_t b = 0; b < block_count; b++)
+                restores[b] = reachable[b];
+            return func->blocks[save_at];
+        }
+        save_at = idom[save_at];
     }
     
-    do_reg_shuffle(code, in2out, in2out_color);
+    for (size_t b = 0; b < block_count; b++)
+        restores[b] = 1;
+    return func->entry_block;
 }
 
 static byte_buffer * compile_file(Program * program, SymbolEntry ** symbollist)
@@ -239,6 +849,10 @@ static byte_buffer * compile_file(Program * program, SymbolEntry ** symbollist)
     
     memset(code, 0, sizeof(byte_buffer));
     
+    shuffle_stats = (ShuffleStat *)zero_alloc(0);
+    alloc_stats = (AllocStat *)zero_alloc(0);
+    reset_peephole_stats();
+    
     EncOperand reg_scratch_int = enc_reg(REG_R11, 8);
     EncOperand reg_scratch_float = enc_reg(REG_XMM5, 8);
     
@@ -246,8 +860,12 @@ static byte_buffer * compile_file(Program * program, SymbolEntry ** symbollist)
     {
         Function * func = program->functions[f];
         
-        if (code->len % 16)
-            enc_emit_nops(code, 16 - (code->len % 16));
+        size_t function_align = code_align_policy.function_align;
+        if (code->len % function_align)
+            enc_emit_nops(code, function_align - (code->len % function_align));
+        
+        if (code_align_policy.loop_align)
+            func_analyze_loops(func);
         
         SymbolEntry func_symbol;
         memset(&func_symbol, 0, sizeof(SymbolEntry));
@@ -256,6 +874,9 @@ static byte_buffer * compile_file(Program * program, SymbolEntry ** symbollist)
         func_symbol.kind = 1; // function
         array_push(*symbollist, SymbolEntry, func_symbol);
         
+        MInst * insts = (MInst *)zero_alloc(0);
+        size_t first_shuffle_stat = array_len(shuffle_stats, ShuffleStat);
+        
         abi_get_callee_saved_regs(func->written_registers, 32);
         for (size_t i = 0; i < sizeof(func->written_registers); i++)
         {
@@ -267,38 +888,45 @@ static byte_buffer * compile_file(Program * program, SymbolEntry ** symbollist)
         
         EncOperand rbp = enc_reg(REG_RBP, 8);
         EncOperand rsp = enc_reg(REG_RSP, 8);
-        enc_emit_1(code, INST_PUSH, rbp);
-        enc_emit_2(code, INST_MOV, rbp, rsp);
+        minst_emit_1(&insts, INST_PUSH, rbp);
+        minst_emit_2(&insts, INST_MOV, rbp, rsp);
+        
+        uint8_t * restores = (uint8_t *)zero_alloc(array_len(func->blocks, Block *));
+        Block * save_block = find_callee_save_block(func, restores);
+        func->callee_save_block = save_block == func->entry_block ? 0 : save_block;
         
         if (func->stack_height)
         {
             EncOperand height = enc_imm(func->stack_height, 4);
-            enc_emit_2(code, INST_SUB, rsp, height);
+            minst_emit_2(&insts, INST_SUB, rsp, height);
             
-            size_t n = 0;
-            for (size_t i = 0; i < sizeof(func->written_registers); i++)
-            {
-                if (func->written_registers[i] == 2 && i != REG_RBP && i != REG_RSP)
-                {
-                    EncOperand mem = enc_mem(REG_RSP, n * 8, 8);
-                    enc_emit_2(code, i >= REG_XMM0 ? INST_MOVQ : INST_MOV, mem, enc_reg(i, 8));
-                    n += 1;
-                }
-            }
+            if (!func->callee_save_block)
+                emit_callee_saved_moves(&insts, func, 0);
         }
         
         for (size_t b = 0; b < array_len(func->blocks, Block *); b++)
         {
             Block * block = func->blocks[b];
             Block * next_block = (b + 1 < array_len(func->blocks, Block *)) ? func->blocks[b + 1] : 0;
+            // the last block can't fall through into anything
+            const char * next_block_name = next_block ? next_block->name : "";
+            
+            if (code_align_policy.loop_align && block->is_loop_header && !block_is_cold(block))
+                minst_label_aligned(&insts, block->name, code_align_policy.loop_align, code_align_policy.loop_max_padding);
+            else
+                minst_label(&insts, block->name);
             
-            block->start_offset = code->len;
+            // the most recent comparison in the block, and where its flags got turned into a value
+            Statement * flags_compare = 0;
+            BranchCond flags_cond;
+            memset(&flags_cond, 0, sizeof(BranchCond));
+            size_t flags_set_start = 0;
+            size_t flags_set_end = 0;
             
             for (size_t i = 0; i < array_len(block->statements, Statement *); i++)
             {
-                Statement * prev_statement = i > 0 ? block->statements[i - 1] : 0;
                 Statement * statement = block->statements[i];
-                Statement * next_statement = (i + 1 < array_len(block->statements, Statement *)) ? block->statements[i + 1] : 0;
+                const IselFixedPattern * fixed = isel_fixed_pattern_find(statement->statement_name);
                 
                 if (strcmp(statement->statement_name, "return") == 0)
                 {
@@ -308,39 +936,67 @@ static byte_buffer * compile_file(Program * program, SymbolEntry ** symbollist)
                         Operand op = statement->args[0];
                         assert(op.variant == OP_KIND_VALUE);
                         
-                        EncOperand op2 = get_basic_encoperand(op.value);
-                        if (op.value->type.variant == TYPE_F64 || op.value->type.variant == TYPE_F64)
-                        {
-                            EncOperand op1 = enc_reg(REG_XMM0, type_size(op.value->type));
-                            if (!encops_equal(op1, op2))
-                                enc_emit_2(code, INST_MOVQ, op1, op2);
-                        }
-                        else
+                        RegShuffle shuffle;
+                        reg_shuffle_init(&shuffle);
+                        reg_shuffle_add(&shuffle, op.value, type_is_float(op.value->type) ? REG_XMM0 : REG_RAX);
+                        reg_shuffle_emit(&insts, &shuffle);
+                    }
+                    
+                    if (restores[b])
+                        emit_callee_saved_moves(&insts, func, 1);
+                    
+                    minst_emit_0(&insts, INST_LEAVE);
+                    minst_emit_0(&insts, INST_RET);
+                }
+                else if (fixed && fixed->kind == ISEL_FIXED_MULHI)
+                {
+                    // high half of a multiplication
+                    Operand op1_op = statement->args[0];
+                    assert(op1_op.variant == OP_KIND_VALUE);
+                    Operand op2_op = statement->args[1];
+                    assert(op2_op.variant == OP_KIND_VALUE);
+                    
+                    assert(statement->output->regalloced);
+                    assert(op1_op.value->regalloced);
+                    
+                    uint8_t is_signed = fixed->is_signed;
+                    int size = type_size(statement->output->type);
+                    EncOperand op1 = get_basic_encoperand(op1_op.value);
+                    EncOperand op2 = get_basic_encoperand(op2_op.value);
+                    EncOperand scratch = enc_reg(REG_R11, 8);
+                    
+                    if (size == 8)
+                    {
+                        assert(statement->output->regalloc == (uint64_t)isel_fixed_registers(fixed, size).output);
+                        if (op2.is_imm)
                         {
-                            EncOperand op1 = enc_reg(REG_RAX, type_size(op.value->type));
-                            if (!encops_equal(op1, op2))
-                                enc_emit_2(code, INST_MOV, op1, op2);
+                            minst_emit_2(&insts, INST_MOV, scratch, op2);
+                            op2 = scratch;
                         }
+                        if (op1_op.value->regalloc != REG_RAX)
+                            minst_emit_2(&insts, INST_MOV, enc_reg(REG_RAX, 8), op1);
+                        minst_emit_1(&insts, is_signed ? INST_IMUL : INST_MUL, op2);
                     }
-                    
-                    size_t n = 0;
-                    for (size_t i = 0; i < sizeof(func->written_registers); i++)
+                    else
                     {
-                        if (func->written_registers[i] == 2 && i != REG_RBP && i != REG_RSP)
+                        // narrow products fit in 64 bits, so use a normal multiply and shift the high half down
+                        EncOperand op0 = enc_reg(statement->output->regalloc, 8);
+                        if (op2.is_imm)
                         {
-                            EncOperand mem = enc_mem(REG_RSP, n * 8, 8);
-                            enc_emit_2(code, i >= REG_XMM0 ? INST_MOVQ : INST_MOV, enc_reg(i, 8), mem);
-                            n += 1;
+                            uint64_t n = op2_op.value->constant & (((uint64_t)1 << (size * 8)) - 1);
+                            uint64_t sign = (uint64_t)1 << (size * 8 - 1);
+                            if (is_signed)
+                                n = (n ^ sign) - sign;
+                            minst_emit_2(&insts, INST_MOV, scratch, enc_imm(n, 8));
                         }
+                        else
+                            emit_extend(&insts, scratch, op2, is_signed);
+                        emit_extend(&insts, op0, op1, is_signed);
+                        minst_emit_2(&insts, INST_IMUL, op0, scratch);
+                        minst_emit_2(&insts, is_signed ? INST_SAR : INST_SHR, op0, enc_imm(size * 8, 1));
                     }
-                    
-                    enc_emit_0(code, INST_LEAVE);
-                    enc_emit_0(code, INST_RET);
                 }
-                else if (strcmp(statement->statement_name, "div") == 0 ||
-                         strcmp(statement->statement_name, "idiv") == 0 ||
-                         strcmp(statement->statement_name, "rem") == 0 ||
-                         strcmp(statement->statement_name, "irem") == 0)
+                else if (fixed && fixed->kind == ISEL_FIXED_DIV)
                 {
                     Operand op1_op = statement->args[0];
                     assert(op1_op.variant == OP_KIND_VALUE);
@@ -350,59 +1006,97 @@ static byte_buffer * compile_file(Program * program, SymbolEntry ** symbollist)
                     assert(op1_op.value->regalloced);
                     assert(op2_op.value->regalloced);
                     
-                    //EncOperand op0 = get_basic_encoperand(statement->output);
-                    EncOperand op2 = get_basic_encoperand(op2_op.value);
+                    uint8_t is_signed = fixed->is_signed;
+                    uint8_t is_rem = fixed->is_rem;
+                    uint8_t is_safe = !fixed->is_unsafe;
+                    size_t size = type_size(statement->output->type);
+                    size_t wide_size = size < 4 ? 4 : size; // cmov has no 8-bit form
                     
-                    if (type_size(statement->output->type) != 1)
-                        enc_emit_2(code, INST_XOR, enc_reg(REG_RDX, 4), enc_reg(REG_RDX, 4));
+                    assert(statement->output->regalloc == (uint64_t)isel_fixed_registers(fixed, size).output);
                     
-                    uint64_t forced_output = REG_RAX;
-                    if (type_size(statement->output->type) != 1 && 
-                        (strcmp(statement->statement_name, "rem") == 0 ||
-                         strcmp(statement->statement_name, "irem") == 0))
-                        forced_output = REG_RDX;
+                    EncOperand op1 = get_basic_encoperand(op1_op.value);
+                    EncOperand op2 = get_basic_encoperand(op2_op.value);
                     
-                    assert(statement->output->regalloc == forced_output);
+                    // the divisor has to survive RAX and RDX being overwritten, and the guard needs to be able to modify it
+                    if (is_safe || op2_op.value->regalloc == REG_RAX || op2_op.value->regalloc == REG_RDX)
+                    {
+                        minst_emit_2(&insts, INST_MOV, enc_reg(REG_R11, size), op2);
+                        op2 = enc_reg(REG_R11, size);
+                    }
                     
                     if (op1_op.value->regalloc != REG_RAX)
+                        minst_emit_2(&insts, INST_MOV, enc_reg(REG_RAX, size), op1);
+                    
+                    // division by zero produces 1 and remainder by zero produces 0, which is exactly what 1 / 1 does
+                    if (is_safe)
                     {
-                        EncOperand op1 = get_basic_encoperand(op1_op.value);
-                        enc_emit_2(code, INST_MOV, enc_reg(REG_RAX, type_size(op1_op.value->type)), op1);
+                        minst_emit_2(&insts, INST_MOV, enc_reg(REG_RDX, 4), enc_imm(1, 4));
+                        minst_emit_2(&insts, INST_TEST, op2, op2);
+                        minst_emit_2(&insts, INST_CMOVZ, enc_reg(REG_RAX, wide_size), enc_reg(REG_RDX, wide_size));
+                        minst_emit_2(&insts, INST_CMOVZ, enc_reg(REG_R11, wide_size), enc_reg(REG_RDX, wide_size));
                     }
                     
-                    if (strcmp(statement->statement_name, "div") == 0)
-                        enc_emit_1(code, INST_DIV, op2);
-                    else if (strcmp(statement->statement_name, "idiv") == 0)
-                        enc_emit_1(code, INST_IDIV, op2);
-                    else if (strcmp(statement->statement_name, "rem") == 0)
+                    // x86 8-bit div/idiv divide all of AX, while the wider ones divide DX:AX, EDX:EAX, or RDX:RAX
+                    if (size == 1)
+                        emit_extend(&insts, enc_reg(REG_RAX, 4), enc_reg(REG_RAX, 1), is_signed);
+                    else if (is_signed)
                     {
-                        enc_emit_1(code, INST_DIV, op2);
-                        //enc_emit_2(code, INST_SHR
+                        minst_emit_2(&insts, INST_MOV, enc_reg(REG_RDX, size), enc_reg(REG_RAX, size));
+                        minst_emit_2(&insts, INST_SAR, enc_reg(REG_RDX, size), enc_imm(size * 8 - 1, 1));
                     }
-                    else if (strcmp(statement->statement_name, "irem") == 0)
+                    else
+                        minst_emit_2(&insts, INST_XOR, enc_reg(REG_RDX, 4), enc_reg(REG_RDX, 4));
+                    
+                    minst_emit_1(&insts, is_signed ? INST_IDIV : INST_DIV, op2);
+                    
+                    // x86 8-bit div/idiv puts remainder in AH (upper 8 bits of 16-bit AX)
+                    if (size == 1 && is_rem)
+                        minst_emit_2(&insts, INST_SHR, enc_reg(REG_RAX, 4), enc_imm(8, 1));
+                }
+                else if (isel_uses_three_operand_form(statement))
+                {
+                    // AVX float arithmetic and BMI2 shifts don't overwrite either operand, so the output can be in any
+                    // register and nothing has to be copied into it first
+                    const IselPattern * pattern = isel_pattern_find(statement);
+                    const char * name = statement->statement_name;
+                    Value * amount = statement->args[1].value;
+                    EncOperand op0 = get_basic_encoperand(statement->output);
+                    EncOperand op1 = get_basic_encoperand(statement->args[0].value);
+                    EncOperand op2 = get_basic_encoperand(amount);
+                    if (isel_statement_reads_memory(statement))
+                        op2 = get_address_encoperand(statement, 1, 2, type_size(statement->output->type));
+                    
+                    if (!(pattern->flags & ISEL_SHIFT))
+                        minst_emit_3(&insts, pattern->inst3, op0, op1, op2);
+                    else
                     {
-                        enc_emit_1(code, INST_IDIV, op2);
+                        int shift_inst = pattern->inst3;
+                        // the amount register is read at the size of the shift, but only its low bits matter
+                        EncOperand count = enc_reg(amount->regalloc, op0.size);
+                        if (str_ends_with(name, "_unsafe"))
+                            minst_emit_3(&insts, shift_inst, op0, op1, count);
+                        else
+                        {
+                            // same as the legacy shifts below, but these don't write the flags, so the comparison
+                            // can come first and the output can share a register with either operand
+                            size_t shift_bits = op0.size * 8;
+                            EncOperand scratch = enc_reg(REG_R11, op0.size);
+                            if (shift_inst == INST_SARX)
+                            {
+                                minst_emit_2(&insts, INST_MOV, scratch, op1);
+                                minst_emit_2(&insts, INST_SAR, scratch, enc_imm(shift_bits - 1, 1));
+                            }
+                            else
+                                minst_emit_2(&insts, INST_XOR, enc_reg(REG_R11, 4), enc_reg(REG_R11, 4));
+                            minst_emit_2(&insts, INST_CMP, enc_reg(amount->regalloc, type_size(amount->type)), enc_imm(shift_bits, 1));
+                            minst_emit_3(&insts, shift_inst, op0, op1, count);
+                            minst_emit_2(&insts, INST_CMOVNB, op0, scratch);
+                        }
                     }
-                    else
-                        assert(((void)"FIXME handle more operations 1", 0));
                 }
-                else if (strcmp(statement->statement_name, "mul") == 0 ||
-                         strcmp(statement->statement_name, "imul") == 0 ||
-                         strcmp(statement->statement_name, "add") == 0 ||
-                         strcmp(statement->statement_name, "sub") == 0 ||
-                         strcmp(statement->statement_name, "shl") == 0 ||
-                         strcmp(statement->statement_name, "shr") == 0 ||
-                         
-                         strcmp(statement->statement_name, "and") == 0 ||
-                         strcmp(statement->statement_name, "or") == 0 ||
-                         strcmp(statement->statement_name, "xor") == 0 ||
-                         
-                         strcmp(statement->statement_name, "fadd") == 0 ||
-                         strcmp(statement->statement_name, "fsub") == 0 ||
-                         strcmp(statement->statement_name, "fdiv") == 0 ||
-                         strcmp(statement->statement_name, "fxor") == 0 ||
-                         strcmp(statement->statement_name, "fmul") == 0)
+                else if (isel_pattern_find(statement))
                 {
+                    const IselPattern * pattern = isel_pattern_find(statement);
                     Operand op1_op = statement->args[0];
                     assert(op1_op.variant == OP_KIND_VALUE);
                     Operand op2_op = statement->args[1];
@@ -414,16 +1108,11 @@ static byte_buffer * compile_file(Program * program, SymbolEntry ** symbollist)
                     EncOperand op0 = get_basic_encoperand(statement->output);
                     EncOperand op1 = get_basic_encoperand(op1_op.value);
                     EncOperand op2 = get_basic_encoperand(op2_op.value);
+                    if (isel_statement_reads_memory(statement))
+                        op2 = get_address_encoperand(statement, 1, 2, type_size(statement->output->type));
                     if (encops_equal(op0, op2))
                     {
-                        if (strcmp(statement->statement_name, "add") == 0 ||
-                            strcmp(statement->statement_name, "mul") == 0 ||
-                            strcmp(statement->statement_name, "and") == 0 ||
-                            strcmp(statement->statement_name, "or") == 0 ||
-                            strcmp(statement->statement_name, "xor") == 0 ||
-                            strcmp(statement->statement_name, "imul") == 0 ||
-                            strcmp(statement->statement_name, "fadd") == 0 ||
-                            strcmp(statement->statement_name, "fmul") == 0)
+                        if (pattern->flags & ISEL_COMMUTATIVE)
                         {
                             EncOperand temp = op1;
                             op1 = op2;
@@ -433,81 +1122,70 @@ static byte_buffer * compile_file(Program * program, SymbolEntry ** symbollist)
                             assert(((void)"FIXME handle more operations 2", 0));
                     }
                     
-                    uint8_t shift_mov_performed = 0;
-                    if (strcmp(statement->statement_name, "shl") == 0 ||
-                        strcmp(statement->statement_name, "shr") == 0 ||
-                        strcmp(statement->statement_name, "sar") == 0)
+                    int shift_inst = (pattern->flags & ISEL_SHIFT) ? pattern->inst : -1;
+                    
+                    // the safe shifts define shifting by the bit width or more, which x86 doesn't (it masks the amount):
+                    // shl and shr produce zero, and sar produces copies of the sign bit
+                    size_t shift_bits = type_size(statement->output->type) * 8;
+                    uint8_t shift_guarded = 0;
+                    uint8_t shift_to_zero = 0;
+                    if (shift_inst >= 0)
                     {
-                        if (op2_op.value->variant != VALUE_CONST && op2_op.value->regalloc != REG_RCX)
+                        uint8_t is_safe = !str_ends_with(statement->statement_name, "_unsafe");
+                        if (op2_op.value->variant != VALUE_CONST)
+                            shift_guarded = is_safe;
+                        else if (is_safe && (type_size(op2_op.value->type) == 8 ? op2_op.value->constant :
+                                             op2_op.value->constant & (((uint64_t)1 << (type_size(op2_op.value->type) * 8)) - 1)) >= shift_bits)
                         {
-                            shift_mov_performed = 1;
-                            enc_emit_2(code, INST_MOV, enc_reg(REG_RCX, type_size(op2_op.value->type)), op2);
+                            if (shift_inst == INST_SAR)
+                                op2 = enc_imm(shift_bits - 1, 1);
+                            else
+                                shift_to_zero = 1;
                         }
                     }
                     
                     if (!encops_equal(op0, op1))
                     {
                         if (statement->output->type.variant == TYPE_F64 || statement->output->type.variant == TYPE_F32)
-                            enc_emit_2(code, INST_MOVAPS, op0, op1);
+                            minst_emit_2(&insts, INST_MOVAPS, op0, op1);
                         else
-                            enc_emit_2(code, INST_MOV, op0, op1);
+                            minst_emit_2(&insts, INST_MOV, op0, op1);
                     }
                     
-                    if (strcmp(statement->statement_name, "add") == 0)
-                        enc_emit_2(code, INST_ADD, op0, op2);
-                    else if (strcmp(statement->statement_name, "sub") == 0)
-                        enc_emit_2(code, INST_SUB, op0, op2);
-                    else if (strcmp(statement->statement_name, "mul") == 0)
-                        enc_emit_2(code, INST_IMUL, op0, op2);
-                    else if (strcmp(statement->statement_name, "imul") == 0)
-                        enc_emit_2(code, INST_IMUL, op0, op2);
-                    else if (strcmp(statement->statement_name, "shl") == 0)
-                    {
-                        if (shift_mov_performed)
-                            enc_emit_2(code, INST_SHL, op0, enc_reg(REG_RCX, 1));
-                        else
-                            enc_emit_2(code, INST_SHL, op0, op2);
-                    }
-                    else if (strcmp(statement->statement_name, "shr") == 0)
-                    {
-                        if (shift_mov_performed)
-                            enc_emit_2(code, INST_SHR, op0, enc_reg(REG_RCX, 1));
-                        else
-                            enc_emit_2(code, INST_SHR, op0, op2);
-                    }
-                    else if (strcmp(statement->statement_name, "sar") == 0)
+                    if (shift_inst >= 0)
                     {
-                        if (shift_mov_performed)
-                            enc_emit_2(code, INST_SAR, op0, enc_reg(REG_RCX, 1));
+                        // variable shift amounts have to be in CL. this comes after the first operand has been copied
+                        // into the output, in case it was in RCX
+                        if (op2_op.value->variant != VALUE_CONST)
+                        {
+                            if (op2_op.value->regalloc != REG_RCX)
+                                minst_emit_2(&insts, INST_MOV, enc_reg(REG_RCX, type_size(op2_op.value->type)), op2);
+                            op2 = enc_reg(REG_RCX, 1);
+                        }
+                        if (shift_to_zero)
+                            minst_emit_2(&insts, INST_MOV, op0, enc_imm(0, op0.size));
+                        else if (shift_guarded)
+                        {
+                            // shift normally, then replace the result with what an overlong shift produces if needed
+                            size_t wide_size = op0.size < 4 ? 4 : op0.size; // cmov has no 8-bit form
+                            EncOperand scratch = enc_reg(REG_R11, op0.size);
+                            assert((int64_t)statement->output->regalloc >= 0);
+                            if (shift_inst == INST_SAR)
+                            {
+                                minst_emit_2(&insts, INST_MOV, scratch, op0);
+                                minst_emit_2(&insts, INST_SAR, scratch, enc_imm(shift_bits - 1, 1));
+                            }
+                            minst_emit_2(&insts, shift_inst, op0, op2);
+                            if (shift_inst != INST_SAR)
+                                minst_emit_2(&insts, INST_XOR, enc_reg(REG_R11, 4), enc_reg(REG_R11, 4));
+                            minst_emit_2(&insts, INST_CMP, enc_reg(REG_RCX, type_size(op2_op.value->type)), enc_imm(shift_bits, 1));
+                            minst_emit_2(&insts, INST_CMOVNB, enc_reg(statement->output->regalloc, wide_size), enc_reg(REG_R11, wide_size));
+                        }
                         else
-                            enc_emit_2(code, INST_SAR, op0, op2);
+                            minst_emit_2(&insts, shift_inst, op0, op2);
                     }
-                    else if (strcmp(statement->statement_name, "and") == 0)
-                        enc_emit_2(code, INST_AND, op0, op2);
-                    else if (strcmp(statement->statement_name, "or") == 0)
-                        enc_emit_2(code, INST_OR, op0, op2);
-                    else if (strcmp(statement->statement_name, "xor") == 0)
-                        enc_emit_2(code, INST_XOR, op0, op2);
-                    else if (strcmp(statement->statement_name, "fadd") == 0 && statement->output->type.variant == TYPE_F32)
-                        enc_emit_2(code, INST_ADDSS, op0, op2);
-                    else if (strcmp(statement->statement_name, "fadd") == 0 && statement->output->type.variant == TYPE_F64)
-                        enc_emit_2(code, INST_ADDSD, op0, op2);
-                    else if (strcmp(statement->statement_name, "fsub") == 0 && statement->output->type.variant == TYPE_F32)
-                        enc_emit_2(code, INST_SUBSS, op0, op2);
-                    else if (strcmp(statement->statement_name, "fsub") == 0 && statement->output->type.variant == TYPE_F64)
-                        enc_emit_2(code, INST_SUBSD, op0, op2);
-                    else if (strcmp(statement->statement_name, "fmul") == 0 && statement->output->type.variant == TYPE_F32)
-                        enc_emit_2(code, INST_MULSS, op0, op2);
-                    else if (strcmp(statement->statement_name, "fmul") == 0 && statement->output->type.variant == TYPE_F64)
-                        enc_emit_2(code, INST_MULSD, op0, op2);
-                    else if (strcmp(statement->statement_name, "fdiv") == 0 && statement->output->type.variant == TYPE_F32)
-                        enc_emit_2(code, INST_DIVSS, op0, op2);
-                    else if (strcmp(statement->statement_name, "fdiv") == 0 && statement->output->type.variant == TYPE_F64)
-                        enc_emit_2(code, INST_DIVSD, op0, op2);
-                    else if (strcmp(statement->statement_name, "fxor") == 0)
-                        enc_emit_2(code, INST_XORPS, op0, op2);
                     else
-                        assert(((void)"TODO", 0));
+                        minst_emit_2(&insts, pattern->inst, op0, op2);
                 }
                 else if (strcmp(statement->statement_name, "fneg") == 0)
                 {
@@ -519,14 +1197,17 @@ static byte_buffer * compile_file(Program * program, SymbolEntry ** symbollist)
                     EncOperand op0 = get_basic_encoperand(statement->output);
                     EncOperand op1 = get_basic_encoperand(op1_op.value);
                     
-                    if (!encops_equal(op0, op1))
+                    // with AVX, the sign flip can read the operand from where it is instead of copying it over first
+                    uint8_t use_vex = x86_features_get().avx && !op1.is_imm;
+                    
+                    if (!encops_equal(op0, op1) && !use_vex)
                     {
                         if (!op1.is_imm)
-                            enc_emit_2(code, INST_MOVAPS, op0, op1);
+                            minst_emit_2(&insts, INST_MOVAPS, op0, op1);
                         else
                         {
-                            enc_emit_2(code, INST_MOV, reg_scratch_int, op1);
-                            enc_emit_2(code, INST_MOVQ, op0, reg_scratch_int);
+                            minst_emit_2(&insts, INST_MOV, reg_scratch_int, op1);
+                            minst_emit_2(&insts, INST_MOVQ, op0, reg_scratch_int);
                         }
                     }
                     
@@ -534,23 +1215,85 @@ static byte_buffer * compile_file(Program * program, SymbolEntry ** symbollist)
                     {
                         Value * a = make_const_value(TYPE_I8, 0x3f);
                         EncOperand aop = get_basic_encoperand(a);
-                        enc_emit_2(code, INST_XOR, reg_scratch_int, reg_scratch_int);
-                        enc_emit_2(code, INST_BTS, reg_scratch_int, aop);
-                        enc_emit_2(code, INST_MOVQ, reg_scratch_float, reg_scratch_int);
-                        enc_emit_2(code, INST_XORPS, op0, reg_scratch_float);
+                        minst_emit_2(&insts, INST_XOR, reg_scratch_int, reg_scratch_int);
+                        minst_emit_2(&insts, INST_BTS, reg_scratch_int, aop);
+                        minst_emit_2(&insts, INST_MOVQ, reg_scratch_float, reg_scratch_int);
+                        if (use_vex)
+                            minst_emit_3(&insts, INST_VXORPS, op0, op1, reg_scratch_float);
+                        else
+                            minst_emit_2(&insts, INST_XORPS, op0, reg_scratch_float);
                     }
                     else if (statement->output->type.variant == TYPE_F32)
                     {
                         Value * a = make_const_value(TYPE_I8, 0x1f);
                         EncOperand aop = get_basic_encoperand(a);
-                        enc_emit_2(code, INST_XOR, reg_scratch_int, reg_scratch_int);
-                        enc_emit_2(code, INST_BTS, reg_scratch_int, aop);
-                        enc_emit_2(code, INST_MOVQ, reg_scratch_float, reg_scratch_int);
-                        enc_emit_2(code, INST_XORPS, op0, reg_scratch_float);
+                        minst_emit_2(&insts, INST_XOR, reg_scratch_int, reg_scratch_int);
+                        minst_emit_2(&insts, INST_BTS, reg_scratch_int, aop);
+                        minst_emit_2(&insts, INST_MOVQ, reg_scratch_float, reg_scratch_int);
+                        if (use_vex)
+                            minst_emit_3(&insts, INST_VXORPS, op0, op1, reg_scratch_float);
+                        else
+                            minst_emit_2(&insts, INST_XORPS, op0, reg_scratch_float);
                     }
                     else
                         assert(((void)"Invalid type for fneg", 0));
                 }
+                else if (strcmp(statement->statement_name, "trim") == 0 ||
+                         strcmp(statement->statement_name, "qext") == 0 ||
+                         strcmp(statement->statement_name, "zext") == 0 ||
+                         strcmp(statement->statement_name, "sext") == 0)
+                {
+                    Operand op1_op = statement->args[1];
+                    assert(op1_op.variant == OP_KIND_VALUE);
+                    
+                    assert(statement->output);
+                    assert(statement->output->regalloced);
+                    
+                    Value * value = op1_op.value;
+                    size_t in_size = type_size(value->type);
+                    size_t out_size = type_size(statement->output->type);
+                    uint8_t is_signed = strcmp(statement->statement_name, "sext") == 0;
+                    EncOperand op0 = get_basic_encoperand(statement->output);
+                    if (value->variant == VALUE_CONST)
+                    {
+                        uint64_t n = value->constant;
+                        if (in_size < 8)
+                        {
+                            uint64_t sign = (uint64_t)1 << (in_size * 8 - 1);
+                            n &= ((uint64_t)1 << (in_size * 8)) - 1;
+                            if (is_signed)
+                                n = (n ^ sign) - sign;
+                        }
+                        if (out_size < 8)
+                            n &= ((uint64_t)1 << (out_size * 8)) - 1;
+                        minst_emit_2(&insts, INST_MOV, op0, enc_imm(n, out_size));
+                    }
+                    else if (strcmp(statement->statement_name, "trim") == 0)
+                    {
+                        // the low bytes of a register or memory location are the trimmed value
+                        EncOperand op1 = get_basic_encoperand(value);
+                        if ((int64_t)value->regalloc < 0)
+                            op1 = enc_mem_change_size(op1, out_size);
+                        else
+                            op1 = enc_reg(value->regalloc, out_size);
+                        if (!encops_equal(op0, op1))
+                            minst_emit_2(&insts, INST_MOV, op0, op1);
+                    }
+                    else if (strcmp(statement->statement_name, "qext") == 0 && (int64_t)value->regalloc >= 0)
+                    {
+                        // qext leaves the new bits arbitrary, so whatever is already in the register will do
+                        EncOperand op1 = enc_reg(value->regalloc, out_size);
+                        if (!encops_equal(op0, op1))
+                            minst_emit_2(&insts, INST_MOV, op0, op1);
+                    }
+                    else if (strcmp(statement->statement_name, "zext") == 0 && in_size == 4 &&
+                             value->regalloc == statement->output->regalloc && value_upper_bits_cleared(value))
+                    {
+                        // already zero-extended by the instruction that produced it
+                    }
+                    else // including qext from memory, where reading past the value isn't safe
+                        emit_extend(&insts, op0, get_basic_encoperand(value), is_signed);
+                }
                 else if (strcmp(statement->statement_name, "mov") == 0)
                 {
                     Operand op1_op = statement->args[0];
@@ -564,7 +1307,7 @@ static byte_buffer * compile_file(Program * program, SymbolEntry ** symbollist)
                     if (op1_op.value->variant == VALUE_STACKADDR)
                     {
                         op1 = enc_mem_change_size(op1, 8);
-                        enc_emit_2(code, INST_LEA, op0, op1);
+                        minst_emit_2(&insts, INST_LEA, op0, op1);
                     }
                     else
                     {
@@ -574,8 +1317,8 @@ static byte_buffer * compile_file(Program * program, SymbolEntry ** symbollist)
                             
                             EncOperand op_dummy = enc_mem(REG_RIP, 0x7FFFFFFF, 8);
                             
-                            enc_emit_2(code, INST_MOVSD, op0, op_dummy);
-                            add_static_relocation(code->len - 4, name, 4);
+                            minst_emit_2(&insts, INST_MOVSD, op0, op_dummy);
+                            minst_set_reloc(&insts, MINST_RELOC_STATIC, name);
                         }
                         else
                         {
@@ -583,17 +1326,17 @@ static byte_buffer * compile_file(Program * program, SymbolEntry ** symbollist)
                                 statement->output->type.variant == TYPE_F32 || op1_op.value->type.variant == TYPE_F32)
                             {
                                 if (value_is_basic_zero_constant(op1_op.value))
-                                    enc_emit_2(code, INST_XORPS, op0, op0);
+                                    minst_emit_2(&insts, INST_XORPS, op0, op0);
                                 else
                                 {
                                     if (!op1_op.value->regalloced || !statement->output->regalloced || statement->output->regalloc != op1_op.value->regalloc)
-                                        enc_emit_2(code, INST_MOVAPS, op0, op1);
+                                        minst_emit_2(&insts, INST_MOVAPS, op0, op1);
                                 }
                             }
                             else
                             {
                                 if (!op1_op.value->regalloced || !statement->output->regalloced || statement->output->regalloc != op1_op.value->regalloc)
-                                    enc_emit_2(code, INST_MOV, op0, op1);
+                                    minst_emit_2(&insts, INST_MOV, op0, op1);
                             }
                         }
                     }
@@ -605,7 +1348,7 @@ static byte_buffer * compile_file(Program * program, SymbolEntry ** symbollist)
                     Operand op2_op = statement->args[1];
                     assert(op2_op.variant == OP_KIND_VALUE);
                     
-                    EncOperand op1 = get_basic_encoperand_mem(op1_op.value, 1);
+                    EncOperand op1 = get_address_encoperand(statement, 0, 2, type_size(op2_op.value->type));
                     EncOperand op2 = get_basic_encoperand(op2_op.value);
                     
                     assert(((void)"TODO", type_size(op2_op.value->type) <= 8));
@@ -623,19 +1366,31 @@ static byte_buffer * compile_file(Program * program, SymbolEntry ** symbollist)
                         
                         EncOperand addr_lower = enc_mem_change_size(op1, 4);
                         EncOperand addr_higher = enc_mem_add_offset(addr_lower, 4);
-                        enc_emit_2(code, INST_MOV, addr_lower, op_lo);
-                        enc_emit_2(code, INST_MOV, addr_higher, op_hi);
+                        minst_emit_2(&insts, INST_MOV, addr_lower, op_lo);
+                        minst_emit_2(&insts, INST_MOV, addr_higher, op_hi);
                     }
                     else
                     {
                         if (op2_op.value->type.variant == TYPE_F64)
-                            enc_emit_2(code, INST_MOVQ, op1, op2);
+                            minst_emit_2(&insts, INST_MOVQ, op1, op2);
                         else if (op2_op.value->type.variant == TYPE_F32)
-                            enc_emit_2(code, INST_MOVD, op1, op2);
+                            minst_emit_2(&insts, INST_MOVD, op1, op2);
                         else
-                            enc_emit_2(code, INST_MOV, op1, op2);
+                            minst_emit_2(&insts, INST_MOV, op1, op2);
                     }
                 }
+                else if (str_begins_with(statement->statement_name, "store_"))
+                {
+                    // a load, an operation, and a store back to the same address, fused by isel_fold_memory_operands
+                    const IselPattern * pattern = isel_pattern_find_name(statement->statement_name + 6, ISEL_INT);
+                    assert(pattern);
+                    Operand op2_op = statement->args[1];
+                    assert(op2_op.variant == OP_KIND_VALUE);
+                    
+                    EncOperand op1 = get_address_encoperand(statement, 0, 2, type_size(op2_op.value->type));
+                    EncOperand op2 = get_basic_encoperand(op2_op.value);
+                    minst_emit_2(&insts, pattern->inst, op1, op2);
+                }
                 else if (strcmp(statement->statement_name, "load") == 0)
                 {
                     Operand type_op = statement->args[0];
@@ -647,36 +1402,32 @@ static byte_buffer * compile_file(Program * program, SymbolEntry ** symbollist)
                     assert(statement->output->regalloced);
                     
                     EncOperand op0 = get_basic_encoperand(statement->output);
-                    EncOperand op1 = get_basic_encoperand_mem(op1_op.value, 1);
+                    EncOperand op1 = get_address_encoperand(statement, 1, 2, type_size(statement->output->type));
                     
                     if (statement->output->type.variant == TYPE_F64)
-                        enc_emit_2(code, INST_MOVQ, op0, op1);
+                        minst_emit_2(&insts, INST_MOVQ, op0, op1);
                     else if (statement->output->type.variant == TYPE_F32)
-                        enc_emit_2(code, INST_MOVD, op0, op1);
+                        minst_emit_2(&insts, INST_MOVD, op0, op1);
                     else
-                        enc_emit_2(code, INST_MOV, op0, op1);
+                        minst_emit_2(&insts, INST_MOV, op0, op1);
                 }
                 else if (strcmp(statement->statement_name, "goto") == 0)
                 {
                     Operand target_op = statement->args[0];
                     assert(target_op.variant == OP_KIND_TEXT);
                     
-                    Value * dummy = make_const_value(TYPE_I32, 0x7FFFFFFF);
-                    EncOperand op_dummy = get_basic_encoperand(dummy);
-                    
                     Block * target_block = find_block(func, target_op.text);
                     size_t ba_len = array_len(target_block->args, Value *);
                     size_t sa_len = array_len(statement->args, Operand) - 1;
                     assert(((void)"wrong number of arguments to block", ba_len == sa_len));
                     
-                    if (reg_shuffle_needed(target_block->args, statement->args + 1, ba_len))
-                        reg_shuffle_block_args(code, target_block->args, statement->args + 1, ba_len);
+                    if (reg_shuffle_needed(target_block->args, statement->args + 1, ba_len) || target_block == func->callee_save_block)
+                        reg_shuffle_edge(&insts, func, block, target_block, statement->args + 1);
+                    else
+                        shuffle_stat_record(func, block, target_block, 0);
                     
-                    if (strcmp(target_op.text, next_block->name) != 0)
-                    {
-                        enc_emit_1(code, INST_JMP, op_dummy);
-                        add_label_relocation(code->len - 4, target_op.text, 4);
-                    }
+                    if (strcmp(target_op.text, next_block_name) != 0)
+                        minst_emit_jump(&insts, INST_JMP, target_op.text);
                 }
                 else if (strcmp(statement->statement_name, "if") == 0)
                 {
@@ -695,44 +1446,37 @@ static byte_buffer * compile_file(Program * program, SymbolEntry ** symbollist)
                     target_op2 = statement->args[separator_pos + 1];
                     assert(target_op2.variant == OP_KIND_TEXT);
                     
-                    int jcc_yin  = INST_JZ;
-                    int jcc_yang = INST_JNZ;
+                    // yang: the condition holds, yin: it doesn't
+                    BranchCond jcc_yang;
+                    jcc_yang.jcc = INST_JNZ;
+                    jcc_yang.parity = 0;
                     
-                    if (prev_statement && str_begins_with(prev_statement->statement_name, "cmp_"))
+                    // branch on the flags of the comparison that produced the condition directly, as long as nothing
+                    // emitted since then has touched them
+                    uint8_t fused = flags_compare && op1_op.value->variant == VALUE_SSA && op1_op.value->ssa == flags_compare;
+                    for (size_t j = flags_set_end; fused && j < array_len(insts, MInst); j++)
                     {
-                        if (strcmp(prev_statement->statement_name, "cmp_g") == 0)
-                        {
-                            jcc_yin = INST_JBE;
-                            jcc_yang = INST_JNBE;
-                        }
-                        else if (strcmp(prev_statement->statement_name, "cmp_ge") == 0)
-                        {
-                            jcc_yin = INST_JB;
-                            jcc_yang = INST_JNB;
-                        }
-                        else if (strcmp(prev_statement->statement_name, "cmp_l") == 0)
-                        {
-                            jcc_yin = INST_JNB;
-                            jcc_yang = INST_JB;
-                        }
-                        else if (strcmp(prev_statement->statement_name, "cmp_le") == 0)
-                        {
-                            jcc_yin = INST_JNBE;
-                            jcc_yang = INST_JBE;
-                        }
-                        else
+                        MInst * inst = &insts[j];
+                        if (_minst_writes_flags(inst) || inst->kind != MINST_INST ||
+                            inst->name == INST_CALL || inst->name == INST_RET)
+                            fused = 0;
+                    }
+                    // turning float equality into a value clobbers the flags, so it has to go for this to work
+                    uint8_t only_use = array_len(op1_op.value->edges_out, Statement *) == 1;
+                    if (fused && (only_use || flags_cond.parity == 0))
+                    {
+                        jcc_yang = flags_cond;
+                        if (only_use)
                         {
-                            assert(((void)"TODO", 0));
+                            for (size_t j = flags_set_start; j < flags_set_end; j++)
+                                array_erase(insts, MInst, flags_set_start);
                         }
                     }
+                    else if ((int64_t)op1_op.value->regalloc < 0)
+                        minst_emit_2(&insts, INST_CMP, op1, enc_imm(0, op1.size));
                     else
-                    {
-                        enc_emit_2(code, INST_TEST, op1, op1);
-                    }
-                    
-                    //Value * dummy = make_const_value(TYPE_I32, 0x7FFFFFFF);
-                    Value * dummy = make_const_value(TYPE_I32, 0x7FFFFFFF);
-                    EncOperand op_dummy = get_basic_encoperand(dummy);
+                        minst_emit_2(&insts, INST_TEST, op1, op1);
+                    BranchCond jcc_yin = branch_cond_invert(jcc_yang);
                     
                     Operand * if_s_args = statement->args + 2;
                     Block * if_target_block = find_block(func, target_op.text);
@@ -746,100 +1490,93 @@ static byte_buffer * compile_file(Program * program, SymbolEntry ** symbollist)
                     size_t esa_len = array_len(statement->args, Operand) - separator_pos - 2;
                     assert(((void)"wrong number of arguments to block", eba_len == esa_len));
                     
-                    uint8_t if_shuffle_needed = reg_shuffle_needed(if_target_block->args, if_s_args, iba_len);
-                    uint8_t else_shuffle_needed = reg_shuffle_needed(else_target_block->args, else_s_args, eba_len);
+                    uint8_t if_shuffle_needed = reg_shuffle_needed(if_target_block->args, if_s_args, iba_len) ||
+                        if_target_block == func->callee_save_block;
+                    uint8_t else_shuffle_needed = reg_shuffle_needed(else_target_block->args, else_s_args, eba_len) ||
+                        else_target_block == func->callee_save_block;
+                    if (!if_shuffle_needed)
+                        shuffle_stat_record(func, block, if_target_block, 0);
+                    if (!else_shuffle_needed)
+                        shuffle_stat_record(func, block, else_target_block, 0);
                     
                     //printf("00-`-`-`1 - -3`2    %d %d\n", if_shuffle_needed, else_shuffle_needed);
                     
                     if (if_shuffle_needed && else_shuffle_needed)
                     {
-                        enc_emit_1(code, jcc_yin, op_dummy);
-                        size_t jump_over_loc = code->len;
+                        // the shuffle for whichever target was laid out next goes last, so its jump can be left out
+                        uint8_t then_is_next = strcmp(target_op.text, next_block_name) == 0;
+                        Block * near_block = then_is_next ? else_target_block : if_target_block;
+                        Operand * near_s_args = then_is_next ? else_s_args : if_s_args;
+                        const char * near_name = then_is_next ? target_op2.text : target_op.text;
+                        Block * far_block = then_is_next ? if_target_block : else_target_block;
+                        Operand * far_s_args = then_is_next ? if_s_args : else_s_args;
+                        const char * far_name = then_is_next ? target_op.text : target_op2.text;
                         
-                        reg_shuffle_block_args(code, if_target_block->args, if_s_args, iba_len);
+                        MInst * near_insts = (MInst *)zero_alloc(0);
+                        reg_shuffle_edge(&near_insts, func, block, near_block, near_s_args);
                         
-                        enc_emit_1(code, INST_JMP, op_dummy);
-                        add_label_relocation(code->len - 4, target_op.text, 4);
-                        
-                        size_t jump_over_target = code->len;
-                        int32_t jump_over_len = jump_over_target - jump_over_loc;
-                        memcpy(code->data + jump_over_loc - 4, &jump_over_len, 4);
-                        
-                        reg_shuffle_block_args(code, else_target_block->args, else_s_args, eba_len);
-                        
-                        if (strcmp(target_op2.text, next_block->name) != 0)
+                        // if the near target doesn't need any moves, branch straight to it instead of jumping over them
+                        if (array_len(near_insts, MInst) == 0)
+                            emit_branch(&insts, then_is_next ? jcc_yin : jcc_yang, near_name);
+                        else
                         {
-                            enc_emit_1(code, INST_JMP, op_dummy);
-                            add_label_relocation(code->len - 4, target_op2.text, 4);
+                            const char * jump_over_label = make_temp_name();
+                            emit_branch(&insts, then_is_next ? jcc_yang : jcc_yin, jump_over_label);
+                            
+                            for (size_t j = 0; j < array_len(near_insts, MInst); j++)
+                                array_push(insts, MInst, near_insts[j]);
+                            
+                            minst_emit_jump(&insts, INST_JMP, near_name);
+                            
+                            minst_label(&insts, jump_over_label);
                         }
+                        
+                        reg_shuffle_edge(&insts, func, block, far_block, far_s_args);
+                        
+                        if (strcmp(far_name, next_block_name) != 0)
+                            minst_emit_jump(&insts, INST_JMP, far_name);
                     }
                     else if (else_shuffle_needed)
                     {
-                        enc_emit_1(code, jcc_yang, op_dummy);
-                        add_label_relocation(code->len - 4, target_op.text, 4);
+                        emit_branch(&insts, jcc_yang, target_op.text);
                         
-                        reg_shuffle_block_args(code, else_target_block->args, else_s_args, eba_len);
+                        reg_shuffle_edge(&insts, func, block, else_target_block, else_s_args);
                         
-                        if (strcmp(target_op2.text, next_block->name) != 0)
-                        {
-                            enc_emit_1(code, INST_JMP, op_dummy);
-                            add_label_relocation(code->len - 4, target_op2.text, 4);
-                        }
+                        if (strcmp(target_op2.text, next_block_name) != 0)
+                            minst_emit_jump(&insts, INST_JMP, target_op2.text);
                     }
                     else if (if_shuffle_needed)
                     {
-                        enc_emit_1(code, jcc_yin, op_dummy);
-                        add_label_relocation(code->len - 4, target_op2.text, 4);
+                        emit_branch(&insts, jcc_yin, target_op2.text);
                         
-                        reg_shuffle_block_args(code, if_target_block->args, if_s_args, iba_len);
+                        reg_shuffle_edge(&insts, func, block, if_target_block, if_s_args);
                         
-                        if (strcmp(target_op.text, next_block->name) != 0)
-                        {
-                            enc_emit_1(code, INST_JMP, op_dummy);
-                            add_label_relocation(code->len - 4, target_op.text, 4);
-                        }
-                    }
-                    else if (strcmp(target_op2.text, next_block->name) == 0)
-                    {
-                        enc_emit_1(code, jcc_yang, op_dummy);
-                        add_label_relocation(code->len - 4, target_op.text, 4);
-                    }
-                    else if (strcmp(target_op.text, next_block->name) == 0)
-                    {
-                        enc_emit_1(code, jcc_yin, op_dummy);
-                        add_label_relocation(code->len - 4, target_op2.text, 4);
+                        if (strcmp(target_op.text, next_block_name) != 0)
+                            minst_emit_jump(&insts, INST_JMP, target_op.text);
                     }
+                    else if (strcmp(target_op2.text, next_block_name) == 0)
+                        emit_branch(&insts, jcc_yang, target_op.text);
+                    else if (strcmp(target_op.text, next_block_name) == 0)
+                        emit_branch(&insts, jcc_yin, target_op2.text);
                     else
                     {
-                        enc_emit_1(code, jcc_yin, op_dummy);
-                        add_label_relocation(code->len - 4, target_op2.text, 4);
-                        enc_emit_1(code, INST_JMP, op_dummy);
-                        add_label_relocation(code->len - 4, target_op.text, 4);
+                        emit_branch(&insts, jcc_yin, target_op2.text);
+                        minst_emit_jump(&insts, INST_JMP, target_op.text);
                     }
                 }
-                else if (str_begins_with(statement->statement_name, "cmp_"))
+                else if (statement_is_compare(statement))
                 {
-                    Operand op1_op = statement->args[0];
-                    assert(op1_op.variant == OP_KIND_VALUE);
-                    Operand op2_op = statement->args[1];
-                    assert(op2_op.variant == OP_KIND_VALUE);
-                    
+                    assert(statement->args[0].variant == OP_KIND_VALUE);
+                    assert(statement->args[1].variant == OP_KIND_VALUE);
                     assert(statement->output);
                     assert(statement->output->regalloced);
                     
-                    EncOperand op1 = get_basic_encoperand(op1_op.value);
-                    EncOperand op2 = get_basic_encoperand(op2_op.value);
-                    enc_emit_2(code, INST_CMP, op1, op2);
-                    
-                    EncOperand op0 = get_basic_encoperand(statement->output);
-                    
-                    if (!next_statement || strcmp(next_statement->statement_name, "if") != 0)
-                    {
-                        if ((strcmp(statement->statement_name, "cmp_g") == 0))
-                            enc_emit_1(code, INST_SETNBE, op0);
-                        else
-                            assert(((void)"TODO", 0));
-                    }
+                    flags_compare = statement;
+                    flags_cond = emit_compare(&insts, statement);
+                    flags_set_start = array_len(insts, MInst);
+                    // an `if` that branches on the result can test the flags directly and remove this
+                    emit_setcc(&insts, flags_cond, get_basic_encoperand(statement->output));
+                    flags_set_end = array_len(insts, MInst);
                 }
                 else if (strcmp(statement->statement_name, "uint_to_float") == 0)
                 {
@@ -858,9 +1595,9 @@ static byte_buffer * compile_file(Program * program, SymbolEntry ** symbollist)
                     EncOperand op0 = get_basic_encoperand(statement->output);
                     
                     if (op1_op.rawtype.variant == TYPE_F64)
-                        enc_emit_2(code, INST_CVTSI2SD, op0, op2);
+                        minst_emit_2(&insts, INST_CVTSI2SD, op0, op2);
                     else if (op1_op.rawtype.variant == TYPE_F32)
-                        enc_emit_2(code, INST_CVTSI2SS, op0, op2);
+                        minst_emit_2(&insts, INST_CVTSI2SS, op0, op2);
                     else
                         assert(((void)"TODO", 0));
                 }
@@ -877,11 +1614,11 @@ static byte_buffer * compile_file(Program * program, SymbolEntry ** symbollist)
                     EncOperand op0 = get_basic_encoperand(statement->output);
                     
                     if (type_is_intreg(statement->output->type) && type_is_intreg(op2_op.value->type))
-                        enc_emit_2(code, INST_MOV, op0, op2);
+                        minst_emit_2(&insts, INST_MOV, op0, op2);
                     else if (!type_is_intreg(statement->output->type) && !type_is_intreg(op2_op.value->type))
-                        enc_emit_2(code, INST_MOVAPS, op0, op2);
+                        minst_emit_2(&insts, INST_MOVAPS, op0, op2);
                     else
-                        enc_emit_2(code, INST_MOVQ, op0, op2);
+                        minst_emit_2(&insts, INST_MOVQ, op0, op2);
                 }
                 else if (strcmp(statement->statement_name, "symbol_lookup_unsized") == 0 ||
                          strcmp(statement->statement_name, "symbol_lookup") == 0)
@@ -898,8 +1635,8 @@ static byte_buffer * compile_file(Program * program, SymbolEntry ** symbollist)
                     
                     EncOperand op_dummy = enc_mem(REG_RIP, 0x7FFFFFFF, 8);
                     
-                    enc_emit_2(code, INST_LEA, op0, op_dummy);
-                    add_symbol_relocation(code->len - 4, symbol, 4);
+                    minst_emit_2(&insts, INST_LEA, op0, op_dummy);
+                    minst_set_reloc(&insts, MINST_RELOC_SYMBOL, symbol);
                 }
                 else if (strcmp(statement->statement_name, "call_eval") == 0 ||
                          strcmp(statement->statement_name, "call") == 0)
@@ -913,21 +1650,21 @@ static byte_buffer * compile_file(Program * program, SymbolEntry ** symbollist)
                     EncOperand target = get_basic_encoperand(op_target.value);
                     EncOperand op0 = get_basic_encoperand(statement->output);
                     
-                    reg_shuffle_call(code, statement);
+                    reg_shuffle_call(&insts, statement);
                     
-                    enc_emit_1(code, INST_CALL, target);
+                    minst_emit_1(&insts, INST_CALL, target);
                     
                     Value * value = statement->output;
                     if (type_is_intreg(value->type))
-                        enc_emit_2(code, INST_MOV, op0, enc_reg(REG_RAX, type_size(value->type)));
+                        minst_emit_2(&insts, INST_MOV, op0, enc_reg(REG_RAX, type_size(value->type)));
                     else
-                        enc_emit_2(code, INST_MOVQ, op0, enc_reg(REG_XMM0, 8));
+                        minst_emit_2(&insts, INST_MOVQ, op0, enc_reg(REG_XMM0, 8));
                     
                     func->performs_calls = 1;
                 }
                 else if (strcmp(statement->statement_name, "breakpoint") == 0)
                 {
-                    enc_emit_0(code, INST_INT3);
+                    minst_emit_0(&insts, INST_INT3);
                 }
                 else
                 {
@@ -936,7 +1673,9 @@ static byte_buffer * compile_file(Program * program, SymbolEntry ** symbollist)
                 }
             }
         }
-        apply_label_relocations(program, code, func);
+        alloc_stat_record(func, first_shuffle_stat);
+        peephole_optimize(&insts);
+        minst_encode(code, insts);
     }
     
     apply_static_relocations(program, code, program);
@@ -0,0 +1,89 @@
+#ifndef BBAE_CPU_H
+#define BBAE_CPU_H
+
+#include <stdint.h>
+
+// Optional instruction set extensions that code generation can use.
+// These are detected from the CPU that's running the compiler the first time they're asked for, which is what a JIT
+// wants. Anything compiling for a different machine should set them explicitly with x86_features_set.
+// - avx: VEX-encoded three-operand forms of the scalar float instructions (only their 128-bit forms are used, so
+//        nothing ever leaves the upper halves of the ymm registers dirty and no vzeroupper is needed)
+// - bmi2: shlx/shrx/sarx, which take the shift amount in any register and don't touch the flags
+
+#if (defined __x86_64__) || (defined _M_X64)
+#ifdef _MSC_VER
+#include <intrin.h>
+#else
+#include <cpuid.h>
+#endif
+#endif
+
+typedef struct _X86Features {
+    uint8_t detected;
+    uint8_t avx;
+    uint8_t bmi2;
+} X86Features;
+
+static X86Features x86_features;
+
+static void x86_features_detect(void)
+{
+    x86_features.detected = 1;
+    x86_features.avx = 0;
+    x86_features.bmi2 = 0;
+#if (defined __x86_64__) || (defined _M_X64)
+    uint32_t regs[4] = {0, 0, 0, 0}; // eax, ebx, ecx, edx
+#ifdef _MSC_VER
+    int info[4];
+    __cpuid(info, 0);
+    uint32_t max_leaf = (uint32_t)info[0];
+    __cpuid(info, 1);
+    for (int i = 0; i < 4; i++)
+        regs[i] = (uint32_t)info[i];
+#else
+    uint32_t max_leaf = __get_cpuid_max(0, 0);
+    __get_cpuid(1, &regs[0], &regs[1], &regs[2], &regs[3]);
+#endif
+    
+    // the OS also has to save the xmm and ymm registers on context switches (xcr0 bits 1 and 2)
+    if (((regs[2] >> 27) & 1) && ((regs[2] >> 28) & 1))
+    {
+#ifdef _MSC_VER
+        uint64_t xcr0 = _xgetbv(0);
+#else
+        uint32_t xcr0_lo, xcr0_hi;
+        __asm__ volatile ("xgetbv" : "=a"(xcr0_lo), "=d"(xcr0_hi) : "c"(0));
+        uint64_t xcr0 = ((uint64_t)xcr0_hi << 32) | xcr0_lo;
+#endif
+        x86_features.avx = (xcr0 & 6) == 6;
+    }
+    
+    if (max_leaf >= 7)
+    {
+#ifdef _MSC_VER
+        __cpuidex(info, 7, 0);
+        regs[1] = (uint32_t)info[1];
+#else
+        __cpuid_count(7, 0, regs[0], regs[1], regs[2], regs[3]);
+#endif
+        x86_features.bmi2 = (regs[1] >> 8) & 1;
+    }
+#endif
+}
+
+static X86Features x86_features_get(void)
+{
+    if (!x86_features.detected)
+        x86_features_detect();
+    return x86_features;
+}
+
+// overrides detection, e.g. to target an older CPU
+static inline void x86_features_set(uint8_t avx, uint8_t bmi2)
+{
+    x86_features.detected = 1;
+    x86_features.avx = avx;
+    x86_features.bmi2 = bmi2;
+}
+
+#endif // BBAE_CPU_H
@@ -43,7 +43,8 @@ extern "C"
 
 #undef enc_imm
 
-#define FE_ISMEM(x) (!!((x).op & INT64_MIN))
+// negative immediates have the top bit set too
+#define FE_ISMEM(x) (!(x).is_imm && !!((x).op & INT64_MIN))
 #define FE_ISREG(x) (!FE_ISMEM(x))
 #define FE_ISREG(x) (!FE_ISMEM(x))
 #define FE_ISGEN(x) ((x).op >= FE_AX && (x).op <= FE_R15)
@@ -202,8 +203,10 @@ enum InstName {
     INST_MOVQ, // supports all semantically valid moves
     INST_MOVSD, // doesn't support XMM<->BASEREG non-memory moves
     INST_MOVSS, // doesn't support XMM<->BASEREG non-memory moves
+    INST_MOVSX,
     INST_MOVUPD, // equivalent to MOVUPS, but has more instruction bytes. disprefer.
     INST_MOVUPS,
+    INST_MOVZX, // 8-bit and 16-bit sources only; 32-bit movs already zero-extend
     
     INST_MUL,
     INST_MULPD,
@@ -249,6 +252,10 @@ enum InstName {
     INST_SHR,
     INST_SAR,
     
+    INST_SHLX, // BMI2
+    INST_SHRX, // BMI2
+    INST_SARX, // BMI2
+    
     INST_SHUFPD,
     INST_SHUFPS,
     
@@ -273,6 +280,17 @@ enum InstName {
     INST_XOR,
     INST_XORPS,
     
+    // AVX (VEX.128) three-operand forms
+    INST_VADDSD,
+    INST_VADDSS,
+    INST_VDIVSD,
+    INST_VDIVSS,
+    INST_VMULSD,
+    INST_VMULSS,
+    INST_VSUBSD,
+    INST_VSUBSS,
+    INST_VXORPS,
+    
     INST_LFENCE,
     INST_MFENCE,
     INST_SFENCE,
@@ -428,12 +446,43 @@ static inline uint64_t name_to_inst(int name, EncOperand * ops, int n)
         assert(0); \
     }
     
+    #define _BBAE_EXTLIKE_BIT(NAME, S) FE_ISMEM(ops[1]) ? NAME##m##S : NAME##r##S
+    
+    #define _BBAE_EXTLIKE(NAME) { \
+        assert(n == 2); \
+        assert(!ops[0].is_imm && !ops[1].is_imm); \
+        assert(FE_ISREG(ops[0])); \
+        assert(ops[1].size < ops[0].size); \
+        if (ops[0].size == 2 && ops[1].size == 1) return _BBAE_EXTLIKE_BIT(FE_##NAME##r16, 8); \
+        if (ops[0].size == 4 && ops[1].size == 1) return _BBAE_EXTLIKE_BIT(FE_##NAME##r32, 8); \
+        if (ops[0].size == 4 && ops[1].size == 2) return _BBAE_EXTLIKE_BIT(FE_##NAME##r32, 16); \
+        if (ops[0].size == 8 && ops[1].size == 1) return _BBAE_EXTLIKE_BIT(FE_##NAME##r64, 8); \
+        if (ops[0].size == 8 && ops[1].size == 2) return _BBAE_EXTLIKE_BIT(FE_##NAME##r64, 16); \
+        assert(0); \
+    }
+    
+    #define _BBAE_VEXLIKE_BIT(NAME) FE_ISMEM(ops[2]) ? NAME##rrm : NAME##rrr
+    
+    #define _BBAE_VEXx2(NAME) \
+        case INST_V##NAME##SD : assert(n == 3); assert(FE_ISREG(ops[0]) && FE_ISREG(ops[1])); return _BBAE_VEXLIKE_BIT(FE_V##NAME##SD); \
+        case INST_V##NAME##SS : assert(n == 3); assert(FE_ISREG(ops[0]) && FE_ISREG(ops[1])); return _BBAE_VEXLIKE_BIT(FE_V##NAME##SS);
+    
+    // the shift amount is the last operand, and has to be a register of the same size as the others
+    #define _BBAE_SHLXLIKE(NAME) { \
+        assert(n == 3); \
+        assert(!ops[1].is_imm && !ops[2].is_imm); \
+        assert(FE_ISREG(ops[0]) && FE_ISREG(ops[2])); \
+        if (ops[0].size == 4) return FE_ISMEM(ops[1]) ? FE_##NAME##32rmr : FE_##NAME##32rrr; \
+        if (ops[0].size == 8) return FE_ISMEM(ops[1]) ? FE_##NAME##64rmr : FE_##NAME##64rrr; \
+        assert(0); \
+    }
+    
     #define _BBAE_XCHGLIKE_BIT(NAME) FE_ISMEM(ops[0]) ? NAME##mr : NAME##rr
     
     #define _BBAE_XCHGLIKE(NAME) { \
         assert(n == 2); \
-        assert(!ops[0].is_imm && ops[1].is_imm); \
-        assert(FE_ISREG(ops[0])); \
+        assert(!ops[0].is_imm && !ops[1].is_imm); \
+        assert(FE_ISREG(ops[1])); \
         if (ops[0].size == 1) return _BBAE_XCHGLIKE_BIT(FE_##NAME##8); \
         if (ops[0].size == 2) return _BBAE_XCHGLIKE_BIT(FE_##NAME##16); \
         if (ops[0].size == 4) return _BBAE_XCHGLIKE_BIT(FE_##NAME##32); \
@@ -457,7 +506,7 @@ static inline uint64_t name_to_inst(int name, EncOperand * ops, int n)
         case INST_BTR       : _BBAE_BTLIKE(BTR)
         case INST_BTS       : _BBAE_BTLIKE(BTS)
         
-        case INST_CALL      : return FE_CALL;
+        case INST_CALL      : assert(n == 1); return ops[0].is_imm ? FE_CALL : FE_ISREG(ops[0]) ? FE_CALLr : FE_CALLm;
         
         case INST_CMOVO     : _BBAE_CMOVLIKE(CMOVO)
         case INST_CMOVNO    : _BBAE_CMOVLIKE(CMOVNO)
@@ -568,6 +617,15 @@ static inline uint64_t name_to_inst(int name, EncOperand * ops, int n)
             assert(0);
         }
         
+        case INST_MOVSX     :
+        {
+            // movsxd
+            if (n == 2 && ops[0].size == 8 && ops[1].size == 4 && !ops[1].is_imm)
+                return FE_ISMEM(ops[1]) ? FE_MOVSXr64m32 : FE_MOVSXr64r32;
+            _BBAE_EXTLIKE(MOVSX)
+        }
+        case INST_MOVZX     : _BBAE_EXTLIKE(MOVZX)
+        
         case INST_MUL       : _BBAE_DECLIKE(MUL)
         _BBAE_SSEx2(MUL, P)
         _BBAE_SSEx2(MUL, S)
@@ -583,7 +641,7 @@ static inline uint64_t name_to_inst(int name, EncOperand * ops, int n)
         
         case INST_ROL       : _BBAE_SHRLIKE(ROL)
         case INST_ROR       : _BBAE_SHRLIKE(ROR)
-            
+        
         _BBAE_SSEFLAGx2(ROUND, P)
         _BBAE_SSEFLAGx2(ROUND, S)
         
@@ -608,6 +666,10 @@ static inline uint64_t name_to_inst(int name, EncOperand * ops, int n)
         case INST_SHR       : _BBAE_SHRLIKE(SHR)
         case INST_SAR       : _BBAE_SHRLIKE(SAR)
         
+        case INST_SHLX      : _BBAE_SHLXLIKE(SHLX)
+        case INST_SHRX      : _BBAE_SHLXLIKE(SHRX)
+        case INST_SARX      : _BBAE_SHLXLIKE(SARX)
+        
         _BBAE_SSEFLAGx2(SHUF, P)
         
         _BBAE_SSEx2(SQRT, P)
@@ -625,7 +687,13 @@ static inline uint64_t name_to_inst(int name, EncOperand * ops, int n)
         
         case INST_XOR        : _BBAE_ADDLIKE(XOR)
         case INST_XORPS     : return _BBAE_CMOVLIKE_BIT(FE_SSE_XORPS);
-            
+        
+        _BBAE_VEXx2(ADD)
+        _BBAE_VEXx2(DIV)
+        _BBAE_VEXx2(MUL)
+        _BBAE_VEXx2(SUB)
+        case INST_VXORPS    : assert(n == 3); assert(FE_ISREG(ops[0]) && FE_ISREG(ops[1])); return _BBAE_VEXLIKE_BIT(FE_VXORPS128);
+        
         case INST_LFENCE    : return FE_LFENCE;
         case INST_MFENCE    : return FE_MFENCE;
         case INST_SFENCE    : return FE_SFENCE;
@@ -654,6 +722,11 @@ static inline uint64_t name_to_inst(int name, EncOperand * ops, int n)
     #undef _BBAE_LEALIKE
     #undef _BBAE_SHRLIKE
     #undef _BBAE_TESTLIKE
+    #undef _BBAE_EXTLIKE_BIT
+    #undef _BBAE_EXTLIKE
+    #undef _BBAE_VEXLIKE_BIT
+    #undef _BBAE_VEXx2
+    #undef _BBAE_SHLXLIKE
     #undef _BBAE_XCHGLIKE_BIT
     #undef _BBAE_XCHGLIKE
 }
@@ -788,56 +861,89 @@ const char * ZyanStatusText(ZyanStatus status)
 }
 */
 
-static inline void enc_emit_n(byte_buffer * bytes, int name, EncOperand * ops, int n)
+// no x86 instruction is longer than this
+#define ENC_MAX_INST_LEN 15
+
+// encodes an instruction straight into memory at *cur and moves *cur past it, returning nonzero on failure
+// there has to be room for ENC_MAX_INST_LEN bytes at *cur. jump immediates are relative to the start of the instruction
+static inline int enc_encode_n(uint8_t ** cur, int name, EncOperand * ops, int n)
 {
-    assert(n <= 5);
-    
-    uint8_t buf[16];
-    memset(buf, 0, 16);
-    uint8_t * cur = buf;
-    
-    printf("inst: %d\n", name);
-    for (int64_t i = 0; i < n; i++)
-        printf("op%zu: %zX %d\n", i, ops[i].op, ops[i].is_imm);
-    
+    assert(n <= 4);
     uint64_t inst = name_to_inst(name, ops, n);
     
+    int64_t args[4] = {0, 0, 0, 0};
+    for (int i = 0; i < n; i++)
+        args[i] = ops[i].op;
+    
     // Fadec has a design flaw where the expected value for jump operands is a pointer into the encoding buffer.
     // Here we fix this.
-    if (inst == FE_JMP || inst == FE_JCXZ ||
-        inst == FE_JO || inst == FE_JNO || inst == FE_JC || inst == FE_JNC ||
-        inst == FE_JZ || inst == FE_JNZ || inst == FE_JBE || inst == FE_JA ||
-        inst == FE_JS || inst == FE_JNS || inst == FE_JP || inst == FE_JNP ||
-        inst == FE_JL || inst == FE_JGE || inst == FE_JLE || inst == FE_JG)
+    if (name >= INST_JMP && name <= INST_JNLE)
     {
         assert(n == 1);
-        uint64_t offs = (uint64_t)buf;
         if (ops[0].is_imm)
-            ops[0].op += offs;
+            args[0] += (int64_t)*cur;
     }
     
-    int failed = 0;
-    
-    if (n == 4)
-        failed = fe_enc64(&cur, inst, ops[0].op, ops[1].op, ops[2].op, ops[3].op);
-    else if (n == 3)
-        failed = fe_enc64(&cur, inst, ops[0].op, ops[1].op, ops[2].op);
-    else if (n == 2)
-        failed = fe_enc64(&cur, inst, ops[0].op, ops[1].op);
-    else if (n == 1)
-        failed = fe_enc64(&cur, inst, ops[0].op);
-    else if (n == 0)
-        failed = fe_enc64(&cur, inst);
+    // operands past the instruction's own are zero, same as when fe_enc64 is given fewer of them
+    return fe_enc64(cur, inst, args[0], args[1], args[2], args[3]);
+}
+
+// encodes a jump whose target is relative to the start of the jump, in its rel32 form if is_long and its rel8 one if not
+// these are written out directly, since going through fadec costs several times as much, and minst_encode encodes
+// every jump in a function after everything else
+static inline int enc_encode_jump(uint8_t ** cur, int name, EncOperand target, uint8_t is_long)
+{
+    assert(name == INST_JMP || (name >= INST_JO && name <= INST_JNLE));
+    uint8_t * p = *cur;
+    int64_t rel = (int64_t)target.op;
+    if (!is_long)
+    {
+        rel -= 2;
+        if (rel < -128 || rel > 127)
+            return -1;
+        p[0] = name == INST_JMP ? 0xEB : 0x70 + (name - INST_JO);
+        p[1] = (uint8_t)rel;
+        *cur += 2;
+        return 0;
+    }
+    size_t len = name == INST_JMP ? 5 : 6;
+    rel -= len;
+    if (rel < -(int64_t)0x80000000 || rel > (int64_t)0x7FFFFFFF)
+        return -1;
+    if (name == INST_JMP)
+        p[0] = 0xE9;
+    else
+    {
+        p[0] = 0x0F;
+        p[1] = 0x80 + (name - INST_JO);
+    }
+    int32_t rel32 = (int32_t)rel;
+    memcpy(p + len - 4, &rel32, 4);
+    *cur += len;
+    return 0;
+}
+
+static inline void enc_emit_n(byte_buffer * bytes, int name, EncOperand * ops, int n)
+{
+#ifndef COMPILER_DEBUG_QUIET
+    printf("inst: %d\n", name);
+    for (int64_t i = 0; i < n; i++)
+        printf("op%zu: %zX %d\n", i, ops[i].op, ops[i].is_imm);
+#endif
     
+    bytes_reserve(bytes, ENC_MAX_INST_LEN);
+    uint8_t * cur = bytes->data + bytes->len;
+    int failed = enc_encode_n(&cur, name, ops, n);
+
+#ifndef COMPILER_DEBUG_QUIET
     printf("error code: %d\n", failed);
+#endif
     if (failed)
     {
         assert(!failed);
     }
     
-    size_t len = cur - buf;
-    
-    bytes_push(bytes, buf, len);
+    bytes->len = cur - bytes->data;
 }
 
 static inline void enc_emit_4(byte_buffer * bytes, int name, EncOperand op1, EncOperand op2, EncOperand op3, EncOperand op4)
@@ -867,54 +973,43 @@ static inline void enc_emit_0(byte_buffer * bytes, int name)
     enc_emit_n(bytes, name, 0, 0);
 }
 
-static inline void enc_emit_nops(byte_buffer * bytes, int count)
+// the recommended multi-byte NOPs, which decode as one instruction each, indexed by length
+static const uint8_t enc_nops[10][9] = {
+    {0},
+    {0x90},
+    {0x66, 0x90},
+    {0x0f, 0x1f, 0x00},
+    {0x0f, 0x1f, 0x40, 0x00},
+    {0x0f, 0x1f, 0x44, 0x00, 0x00},
+    {0x66, 0x0f, 0x1f, 0x44, 0x00, 0x00},
+    {0x0f, 0x1f, 0x80, 0x00, 0x00, 0x00, 0x00},
+    {0x0f, 0x1f, 0x84, 0x00, 0x00, 0x00, 0x00, 0x00},
+    {0x66, 0x0f, 0x1f, 0x84, 0x00, 0x00, 0x00, 0x00, 0x00},
+};
+
+// writes count bytes of padding that run as few NOPs as possible
+static inline void enc_encode_nops(uint8_t ** cur, size_t count)
 {
-    assert(count <= 15);
     while (count > 0)
     {
-        if (count == 1)
-            byte_push(bytes, 0x90);
-        else if (count == 1)
-        {
-            uint8_t buf[] = {0x66, 0x90};
-            bytes_push(bytes, buf, 2);
-        }
-        else if (count == 3)
-        {
-            uint8_t buf[] = {0x0f, 0x1f, 0x00};
-            bytes_push(bytes, buf, 3);
-        }
-        else if (count == 4)
-        {
-            uint8_t buf[] = {0x0f, 0x1f, 0x40, 0x00};
-            bytes_push(bytes, buf, 4);
-        }
-        else if (count == 5)
-        {
-            uint8_t buf[] = {0x0f, 0x1f, 0x44, 0x00, 0x00};
-            bytes_push(bytes, buf, 5);
-        }
-        else if (count == 6)
-        {
-            uint8_t buf[] = {0x66, 0x0f, 0x1f, 0x44, 0x00, 0x00};
-            bytes_push(bytes, buf, 6);
-        }
-        else if (count == 7)
-        {
-            uint8_t buf[] = {0x0f, 0x1f, 0x80, 0x00, 0x00, 0x00, 0x00};
-            bytes_push(bytes, buf, 7);
-        }
-        else if (count >= 8)
-        {
-            uint8_t buf[] = {0x0f, 0x1f, 0x84, 0x00, 0x00, 0x00, 0x00, 0x00};
-            bytes_push(bytes, buf, 8);
-            count -= 8;
-            continue;
-        }
-        return;
+        size_t len = count < 9 ? count : 9;
+        memcpy(*cur, enc_nops[len], len);
+        *cur += len;
+        count -= len;
     }
 }
 
+static inline void enc_emit_nops(byte_buffer * bytes, int count)
+{
+    assert(count <= 15);
+    if (count <= 0)
+        return;
+    bytes_reserve(bytes, count);
+    uint8_t * cur = bytes->data + bytes->len;
+    enc_encode_nops(&cur, count);
+    bytes->len += count;
+}
+
 #undef FE_ISMEM
 #undef FE_ISREG
 #undef FE_ISREG
@@ -0,0 +1,192 @@
+#ifndef BBAE_ISEL_PATTERNS
+#define BBAE_ISEL_PATTERNS
+
+// Tables of how arithmetic statements (`out = op a b`) turn into x86 instructions. Register allocation,
+// constant legalization, memory operand folding (isel_x86.h) and emission all look these up, so a new lowering of one of
+// these operations only needs a new row or flag here.
+// Every pattern in isel_patterns has a two-operand form (`inst out, b`, after `a` is copied into `out`), and some have a
+// non-destructive three-operand form (`inst3 out, a, b`) that's used when the CPU supports it (see cpu_x86.h).
+
+#include "emitter_x86.h"
+#include "cpu_x86.h"
+#include "../compiler_common.h"
+
+#define ISEL_COMMUTATIVE 1 // a and b can be swapped
+#define ISEL_IMM_A 2 // a can be an immediate
+#define ISEL_IMM_B 4 // b can be an immediate
+#define ISEL_LOAD_OP 8 // b can be read straight from memory: `inst out, [mem]`
+#define ISEL_OP_STORE 16 // a load of a, this, and a store of the result to the same address can be `inst [mem], b`
+#define ISEL_SHIFT 32 // b is a shift amount, which the two-operand form needs in CL unless it's an immediate
+
+enum {
+    ISEL_INT,
+    ISEL_F32,
+    ISEL_F64,
+};
+
+typedef struct _IselPattern {
+    const char * name;
+    uint8_t type_class;
+    int inst;
+    int inst3; // -1 if there's no three-operand form
+    uint8_t flags;
+} IselPattern;
+
+#define _ISEL_ALU (ISEL_COMMUTATIVE | ISEL_IMM_A | ISEL_IMM_B | ISEL_LOAD_OP | ISEL_OP_STORE)
+
+static const IselPattern isel_patterns[] = {
+    {"add", ISEL_INT, INST_ADD, -1, ISEL_COMMUTATIVE | ISEL_IMM_B | ISEL_LOAD_OP | ISEL_OP_STORE},
+    {"sub", ISEL_INT, INST_SUB, -1, ISEL_IMM_B | ISEL_LOAD_OP | ISEL_OP_STORE},
+    {"mul", ISEL_INT, INST_IMUL, -1, ISEL_COMMUTATIVE | ISEL_LOAD_OP},
+    {"imul", ISEL_INT, INST_IMUL, -1, ISEL_COMMUTATIVE | ISEL_LOAD_OP},
+    {"and", ISEL_INT, INST_AND, -1, _ISEL_ALU},
+    {"or", ISEL_INT, INST_OR, -1, _ISEL_ALU},
+    {"xor", ISEL_INT, INST_XOR, -1, _ISEL_ALU},
+    
+    {"shl", ISEL_INT, INST_SHL, INST_SHLX, ISEL_IMM_A | ISEL_IMM_B | ISEL_SHIFT},
+    {"shr", ISEL_INT, INST_SHR, INST_SHRX, ISEL_IMM_A | ISEL_IMM_B | ISEL_SHIFT},
+    {"sar", ISEL_INT, INST_SAR, INST_SARX, ISEL_IMM_A | ISEL_IMM_B | ISEL_SHIFT},
+    {"shr_unsafe", ISEL_INT, INST_SHR, INST_SHRX, ISEL_IMM_A | ISEL_IMM_B | ISEL_SHIFT},
+    {"sar_unsafe", ISEL_INT, INST_SAR, INST_SARX, ISEL_IMM_A | ISEL_IMM_B | ISEL_SHIFT},
+    
+    {"fadd", ISEL_F32, INST_ADDSS, INST_VADDSS, ISEL_COMMUTATIVE | ISEL_LOAD_OP},
+    {"fadd", ISEL_F64, INST_ADDSD, INST_VADDSD, ISEL_COMMUTATIVE | ISEL_LOAD_OP},
+    {"fsub", ISEL_F32, INST_SUBSS, INST_VSUBSS, ISEL_LOAD_OP},
+    {"fsub", ISEL_F64, INST_SUBSD, INST_VSUBSD, ISEL_LOAD_OP},
+    {"fmul", ISEL_F32, INST_MULSS, INST_VMULSS, ISEL_COMMUTATIVE | ISEL_LOAD_OP},
+    {"fmul", ISEL_F64, INST_MULSD, INST_VMULSD, ISEL_COMMUTATIVE | ISEL_LOAD_OP},
+    {"fdiv", ISEL_F32, INST_DIVSS, INST_VDIVSS, ISEL_LOAD_OP},
+    {"fdiv", ISEL_F64, INST_DIVSD, INST_VDIVSD, ISEL_LOAD_OP},
+    // xorps reads 16 aligned bytes from memory, so loads can't be folded into it
+    {"fxor", ISEL_F32, INST_XORPS, INST_VXORPS, ISEL_COMMUTATIVE},
+    {"fxor", ISEL_F64, INST_XORPS, INST_VXORPS, ISEL_COMMUTATIVE},
+};
+
+#undef _ISEL_ALU
+
+static const IselPattern * isel_pattern_find_name(const char * name, uint8_t type_class)
+{
+    for (size_t i = 0; i < sizeof(isel_patterns) / sizeof(IselPattern); i++)
+    {
+        if (isel_patterns[i].type_class == type_class && strcmp(isel_patterns[i].name, name) == 0)
+            return &isel_patterns[i];
+    }
+    return 0;
+}
+
+// statements that don't have an output yet (during construction) match on their name alone
+static const IselPattern * isel_pattern_find(Statement * statement)
+{
+    if (!statement->output)
+    {
+        const IselPattern * ret = isel_pattern_find_name(statement->statement_name, ISEL_INT);
+        if (!ret)
+            ret = isel_pattern_find_name(statement->statement_name, ISEL_F64);
+        return ret;
+    }
+    uint8_t type_class = ISEL_INT;
+    if (statement->output->type.variant == TYPE_F32)
+        type_class = ISEL_F32;
+    else if (statement->output->type.variant == TYPE_F64)
+        type_class = ISEL_F64;
+    return isel_pattern_find_name(statement->statement_name, type_class);
+}
+
+// whether isel_fold_memory_operands has turned b into a memory operand, in which case the statement's operands are
+// `a base disp [index scale]`, like those of a folded load
+static uint8_t isel_statement_reads_memory(Statement * statement)
+{
+    return array_len(statement->args, Operand) > 2 && isel_pattern_find(statement) != 0;
+}
+
+// whether the statement gets emitted in its non-destructive three-operand form, which can write its output to any
+// register, including the ones its operands are in
+static uint8_t isel_uses_three_operand_form(Statement * statement)
+{
+    const IselPattern * pattern = isel_pattern_find(statement);
+    if (!pattern || pattern->inst3 < 0 || !statement->output || array_len(statement->args, Operand) < 2 ||
+        statement->args[0].variant != OP_KIND_VALUE || statement->args[1].variant != OP_KIND_VALUE ||
+        statement->args[0].value->variant == VALUE_CONST || statement->args[1].value->variant == VALUE_CONST)
+        return 0;
+    
+    X86Features features = x86_features_get();
+    if (pattern->type_class != ISEL_INT)
+        return features.avx;
+    // shlx and co. only come in 32-bit and 64-bit forms, and narrower right shifts would need their input extended
+    size_t size = type_size(statement->output->type);
+    return features.bmi2 && (size == 4 || size == 8) && !isel_statement_reads_memory(statement);
+}
+
+// Table of the statements that turn into x86 instructions with fixed register operands: div and idiv divide RDX:RAX (AX
+// for 8-bit ones) and leave the quotient in RAX and the remainder in RDX (AH for 8-bit ones), and one-operand mul and
+// imul leave the high half of the product in RDX. Register allocation, constant legalization, scheduling, constant
+// division lowering (isel_x86.h) and emission all look these up.
+
+enum {
+    ISEL_FIXED_DIV,
+    ISEL_FIXED_MULHI, // only created by isel_lower_const_division
+};
+
+typedef struct _IselFixedPattern {
+    const char * name;
+    uint8_t kind;
+    uint8_t is_signed;
+    uint8_t is_rem; // the output is the remainder instead of the quotient
+    uint8_t is_unsafe; // division by zero is undefined, so there's no guard for it
+    uint8_t flags; // only ISEL_IMM_A and ISEL_IMM_B
+} IselFixedPattern;
+
+static const IselFixedPattern isel_fixed_patterns[] = {
+    {"div", ISEL_FIXED_DIV, 0, 0, 0, 0},
+    {"idiv", ISEL_FIXED_DIV, 1, 0, 0, 0},
+    {"rem", ISEL_FIXED_DIV, 0, 1, 0, 0},
+    {"irem", ISEL_FIXED_DIV, 1, 1, 0, 0},
+    {"div_unsafe", ISEL_FIXED_DIV, 0, 0, 1, 0},
+    {"idiv_unsafe", ISEL_FIXED_DIV, 1, 0, 1, 0},
+    {"rem_unsafe", ISEL_FIXED_DIV, 0, 1, 1, 0},
+    {"irem_unsafe", ISEL_FIXED_DIV, 1, 1, 1, 0},
+    
+    {"mulhi", ISEL_FIXED_MULHI, 0, 0, 0, ISEL_IMM_A | ISEL_IMM_B},
+    {"imulhi", ISEL_FIXED_MULHI, 1, 0, 0, ISEL_IMM_A | ISEL_IMM_B},
+};
+
+static const IselFixedPattern * isel_fixed_pattern_find(const char * name)
+{
+    for (size_t i = 0; i < sizeof(isel_fixed_patterns) / sizeof(IselFixedPattern); i++)
+    {
+        if (strcmp(isel_fixed_patterns[i].name, name) == 0)
+            return &isel_fixed_patterns[i];
+    }
+    return 0;
+}
+
+typedef struct _IselFixedRegs {
+    int output; // the register the output has to be in, or -1 if it can be in any of them
+    uint32_t clobbers; // mask of the registers that get overwritten
+} IselFixedRegs;
+
+// the registers a fixed-register statement with an output of the given size needs
+static IselFixedRegs isel_fixed_registers(const IselFixedPattern * pattern, size_t size)
+{
+    IselFixedRegs ret = {-1, 0};
+    if (pattern->kind == ISEL_FIXED_MULHI)
+    {
+        // narrower products fit in 64 bits, so they use a normal imul and a shift instead
+        if (size == 8)
+        {
+            ret.output = REG_RDX;
+            ret.clobbers = (1 << REG_RAX) | (1 << REG_RDX);
+        }
+        return ret;
+    }
+    
+    // x86 8-bit div/idiv puts remainder in AH (upper 8 bits of 16-bit AX) instead of DL (lower 8 bits of 16-bit DX)
+    ret.output = (pattern->is_rem && size != 1) ? REG_RDX : REG_RAX;
+    ret.clobbers = 1 << REG_RAX;
+    // the division by zero guard of the safe forms needs RDX either way
+    if (size != 1 || !pattern->is_unsafe)
+        ret.clobbers |= 1 << REG_RDX;
+    return ret;
+}
+
+#endif // BBAE_ISEL_PATTERNS
@@ -0,0 +1,699 @@
+#ifndef BBAE_ISEL
+#define BBAE_ISEL
+
+// x86-specific IR rewrites that run right before register allocation, turning generic statements into shapes that map
+// onto fewer x86 instructions.
+
+#include "isel_patterns_x86.h"
+#include "../compiler_common.h"
+#include "../compiler_type_cloning.h"
+#include "../bbae_analysis.h"
+
+static uint8_t _isel_value_single_use(Value * value)
+{
+    return value->variant == VALUE_SSA && array_len(value->edges_out, Statement *) == 1;
+}
+static uint8_t _isel_const_int(Value * value, int64_t * out)
+{
+    // construction moves constants that can't be immediates into registers, so look through those movs
+    if (value->variant == VALUE_SSA && strcmp(value->ssa->statement_name, "mov") == 0)
+        value = value->ssa->args[0].value;
+    if (value->variant != VALUE_CONST || !(type_is_int(value->type) || type_is_ptr(value->type)))
+        return 0;
+    // sign-extend narrow constants
+    size_t bits = type_size(value->type) * 8;
+    uint64_t n = value->constant;
+    if (bits < 64)
+    {
+        uint64_t sign = (uint64_t)1 << (bits - 1);
+        n &= (sign << 1) - 1;
+        n = (n ^ sign) - sign;
+    }
+    *out = (int64_t)n;
+    return 1;
+}
+
+// matches `value = shl x k` (k < 4) or `value = mul x s` (s = 1, 2, 4, 8) with a 64-bit x
+static uint8_t _isel_match_scaled_index(Value * value, Value ** index, int64_t * scale)
+{
+    if (!_isel_value_single_use(value))
+        return 0;
+    Statement * statement = value->ssa;
+    int64_t n = 0;
+    if (array_len(statement->args, Operand) != 2 || !_isel_const_int(statement->args[1].value, &n))
+        return 0;
+    if (type_size(statement->args[0].value->type) != 8)
+        return 0;
+    if (strcmp(statement->statement_name, "shl") == 0 && n >= 0 && n < 4)
+        *scale = (int64_t)1 << n;
+    else if ((strcmp(statement->statement_name, "mul") == 0 || strcmp(statement->statement_name, "imul") == 0) &&
+             (n == 1 || n == 2 || n == 4 || n == 8))
+        *scale = n;
+    else
+        return 0;
+    *index = statement->args[0].value;
+    return 1;
+}
+
+// folds single-use address arithmetic (add/sub of constants, add of an index, shl/mul scaling of that index, and stack
+// slot addresses) into the memory operand of the load or store that uses it
+// folded loads and stores get extra trailing operands: a raw integer displacement, and optionally an index value and a
+// raw integer scale. i.e. `load type base disp [index scale]` and `store base value disp [index scale]`
+static void isel_fold_addressing_modes(Program * program)
+{
+    for (size_t f = 0; f < array_len(program->functions, Function *); f++)
+    {
+        Function * func = program->functions[f];
+        for (size_t b = 0; b < array_len(func->blocks, Block *); b++)
+        {
+            Block * block = func->blocks[b];
+            Value ** touched = (Value **)zero_alloc(0);
+            
+            for (size_t i = 0; i < array_len(block->statements, Statement *); i++)
+            {
+                Statement * statement = block->statements[i];
+                size_t addr_index;
+                if (strcmp(statement->statement_name, "load") == 0)
+                    addr_index = 1;
+                else if (strcmp(statement->statement_name, "store") == 0)
+                    addr_index = 0;
+                else
+                    continue;
+                // already folded
+                if (array_len(statement->args, Operand) != 2)
+                    continue;
+                
+                Value * base = statement->args[addr_index].value;
+                Value * index = 0;
+                int64_t scale = 0;
+                int64_t disp = 0;
+                Statement ** folded = (Statement **)zero_alloc(0);
+                
+                while (_isel_value_single_use(base))
+                {
+                    Statement * def = base->ssa;
+                    int64_t n = 0;
+                    if (strcmp(def->statement_name, "mov") == 0 && def->args[0].value->variant == VALUE_STACKADDR)
+                    {
+                        array_push(folded, Statement *, def);
+                        base = def->args[0].value;
+                        break;
+                    }
+                    if (strcmp(def->statement_name, "add") != 0 && strcmp(def->statement_name, "sub") != 0)
+                        break;
+                    
+                    Value * left = def->args[0].value;
+                    Value * right = def->args[1].value;
+                    if (_isel_const_int(right, &n))
+                    {
+                        int64_t new_disp = strcmp(def->statement_name, "add") == 0 ? disp + n : disp - n;
+                        if (new_disp < -(int64_t)0x7FFFFFFF || new_disp > (int64_t)0x7FFFFFFF)
+                            break;
+                        disp = new_disp;
+                        array_push(folded, Statement *, def);
+                        base = left;
+                        continue;
+                    }
+                    if (strcmp(def->statement_name, "add") != 0 || index || right->variant == VALUE_CONST)
+                        break;
+                    if (type_size(left->type) != 8 || type_size(right->type) != 8)
+                        break;
+                    
+                    if (_isel_match_scaled_index(right, &index, &scale))
+                        array_push(folded, Statement *, right->ssa);
+                    else if (_isel_match_scaled_index(left, &index, &scale))
+                    {
+                        array_push(folded, Statement *, left->ssa);
+                        left = right;
+                    }
+                    else
+                    {
+                        index = right;
+                        scale = 1;
+                    }
+                    array_push(folded, Statement *, def);
+                    base = left;
+                }
+                
+                if (array_len(folded, Statement *) == 0)
+                    continue;
+                // constant indexes (e.g. from peeled loop iterations) belong in the displacement
+                int64_t n = 0;
+                if (index && _isel_const_int(index, &n))
+                {
+                    if (n < -(int64_t)0x7FFFFFFF / 8 || n > (int64_t)0x7FFFFFFF / 8 ||
+                        disp + n * scale < -(int64_t)0x7FFFFFFF || disp + n * scale > (int64_t)0x7FFFFFFF)
+                        continue;
+                    disp += n * scale;
+                    index = 0;
+                }
+                // absolute addresses aren't worth the trouble
+                if (base->variant == VALUE_CONST)
+                    continue;
+                
+                disconnect_statement_from_operand(statement, statement->args[addr_index], 1);
+                statement->args[addr_index] = new_op_val(base);
+                connect_statement_to_operand(statement, statement->args[addr_index]);
+                array_push(statement->args, Operand, new_op_rawint(disp));
+                array_push(touched, Value *, base);
+                if (index)
+                {
+                    array_push(statement->args, Operand, new_op_val(index));
+                    connect_statement_to_operand(statement, new_op_val(index));
+                    array_push(statement->args, Operand, new_op_rawint(scale));
+                    array_push(touched, Value *, index);
+                }
+                
+                for (size_t j = 0; j < array_len(folded, Statement *); j++)
+                {
+                    Statement * dead = folded[j];
+                    for (size_t n = 0; n < array_len(dead->args, Operand); n++)
+                    {
+                        Value * arg = dead->args[n].value;
+                        disconnect_statement_from_operand(dead, dead->args[n], 1);
+                        // constants that were only moved into registers for the folded statement die with it
+                        if (arg && arg->variant == VALUE_SSA && array_len(arg->edges_out, Statement *) == 0 &&
+                            strcmp(arg->ssa->statement_name, "mov") == 0 && arg->ssa->args[0].value->variant == VALUE_CONST &&
+                            ptr_array_find(folded, arg->ssa) == (size_t)-1)
+                            array_push(folded, Statement *, arg->ssa);
+                    }
+                    size_t dead_index = ptr_array_find(block->statements, dead);
+                    assert(dead_index != (size_t)-1);
+                    array_erase(block->statements, Statement *, dead_index);
+                }
+                i = ptr_array_find(block->statements, statement);
+            }
+            
+            // the uses we moved have to stay in statement order, because register allocation looks at the last one
+            for (size_t i = 0; i < array_len(block->statements, Statement *); i++)
+                block->statements[i]->temp = i;
+            for (size_t i = 0; i < array_len(touched, Value *); i++)
+                value_sort_edges_out(touched[i]);
+        }
+    }
+}
+
+// division by constants, lowered to multiplication by a fixed-point reciprocal ("magic number"); see Hacker's Delight,
+// chapter 10. all the arithmetic here is done modulo 2^bits, in uint64_ts
+typedef struct _IselMagic {
+    uint64_t m;
+    int shift;
+    uint8_t add; // unsigned only: the real magic number is m + 2^bits
+} IselMagic;
+
+static uint64_t _isel_bits_mask(int bits)
+{
+    return bits == 64 ? ~(uint64_t)0 : (((uint64_t)1 << bits) - 1);
+}
+
+// d must not be 0, 1, or a power of two
+static IselMagic _isel_magic_unsigned(uint64_t d, int bits)
+{
+    uint64_t mask = _isel_bits_mask(bits);
+    uint64_t hi = (uint64_t)1 << (bits - 1);
+    IselMagic ret = {0, 0, 0};
+    
+    uint64_t nc = mask - ((mask - d + 1) & mask) % d;
+    int p = bits - 1;
+    uint64_t q1 = hi / nc;
+    uint64_t r1 = hi - q1 * nc;
+    uint64_t q2 = (hi - 1) / d;
+    uint64_t r2 = (hi - 1) - q2 * d;
+    uint64_t delta;
+    do
+    {
+        p += 1;
+        if (r1 >= nc - r1)
+        {
+            if (q1 >= hi - 1)
+                ret.add = 1;
+            q1 = (2 * q1 + 1) & mask;
+            r1 = (2 * r1 - nc) & mask;
+        }
+        else
+        {
+            q1 = (2 * q1) & mask;
+            r1 = (2 * r1) & mask;
+        }
+        if (r2 + 1 >= d - r2)
+        {
+            if (q2 >= hi - 1)
+                ret.add = 1;
+            q2 = (2 * q2 + 1) & mask;
+            r2 = (2 * r2 + 1 - d) & mask;
+        }
+        else
+        {
+            if (q2 >= hi)
+                ret.add = 1;
+            q2 = (2 * q2) & mask;
+            r2 = (2 * r2 + 1) & mask;
+        }
+        delta = d - 1 - r2;
+    } while (p < bits * 2 && (q1 < delta || (q1 == delta && r1 == 0)));
+    
+    ret.m = (q2 + 1) & mask;
+    ret.shift = p - bits;
+    return ret;
+}
+
+// the absolute value of d must not be 0, 1, or a power of two
+static IselMagic _isel_magic_signed(int64_t d, int bits)
+{
+    uint64_t mask = _isel_bits_mask(bits);
+    uint64_t hi = (uint64_t)1 << (bits - 1);
+    IselMagic ret = {0, 0, 0};
+    
+    uint64_t ad = (d < 0 ? (uint64_t)0 - (uint64_t)d : (uint64_t)d) & mask;
+    uint64_t t = hi + (d < 0 ? 1 : 0);
+    uint64_t anc = t - 1 - t % ad;
+    int p = bits - 1;
+    uint64_t q1 = hi / anc;
+    uint64_t r1 = hi - q1 * anc;
+    uint64_t q2 = hi / ad;
+    uint64_t r2 = hi - q2 * ad;
+    uint64_t delta;
+    do
+    {
+        p += 1;
+        q1 = (2 * q1) & mask;
+        r1 = (2 * r1) & mask;
+        if (r1 >= anc)
+        {
+            q1 = (q1 + 1) & mask;
+            r1 = (r1 - anc) & mask;
+        }
+        q2 = (2 * q2) & mask;
+        r2 = (2 * r2) & mask;
+        if (r2 >= ad)
+        {
+            q2 = (q2 + 1) & mask;
+            r2 = (r2 - ad) & mask;
+        }
+        delta = ad - r2;
+    } while (q1 < delta || (q1 == delta && r1 == 0));
+    
+    ret.m = (q2 + 1) & mask;
+    if (d < 0)
+        ret.m = ((uint64_t)0 - ret.m) & mask;
+    ret.shift = p - bits;
+    return ret;
+}
+
+// inserts `output = name a b` before the statement at *i, which is moved forward
+static Value * _isel_insert_op(Block * block, size_t * i, const char * name, Value * a, Value * b)
+{
+    Statement * statement = new_statement();
+    statement->block = block;
+    statement->output_name = make_temp_name();
+    statement->statement_name = strcpy_z(name);
+    statement->output = make_value(a->type);
+    statement->output->variant = VALUE_SSA;
+    statement->output->ssa = statement;
+    
+    array_push(statement->args, Operand, new_op_val(a));
+    connect_statement_to_operand(statement, statement->args[0]);
+    if (b)
+    {
+        array_push(statement->args, Operand, new_op_val(b));
+        connect_statement_to_operand(statement, statement->args[1]);
+    }
+    
+    array_insert(block->statements, Statement *, *i, statement);
+    *i += 1;
+    return statement->output;
+}
+
+// a constant of the given type, moved into a register first if it can't be used as an immediate
+static Value * _isel_const_operand(Block * block, size_t * i, Type type, uint64_t n, uint8_t allow_imm)
+{
+    Value * value = make_const_value(type.variant, n & _isel_bits_mask(type_size(type) * 8));
+    int64_t sext = 0;
+    _isel_const_int(value, &sext);
+    if (allow_imm && sext >= -(int64_t)0x80000000 && sext <= (int64_t)0x7FFFFFFF)
+        return value;
+    return _isel_insert_op(block, i, "mov", value, 0);
+}
+
+static Value * _isel_shift(Block * block, size_t * i, const char * name, Value * a, int amount)
+{
+    if (amount == 0)
+        return a;
+    return _isel_insert_op(block, i, name, a, _isel_const_operand(block, i, a->type, amount, 1));
+}
+
+static uint8_t _isel_is_pow2(uint64_t n)
+{
+    return n != 0 && (n & (n - 1)) == 0;
+}
+static int _isel_log2(uint64_t n)
+{
+    int ret = 0;
+    while (n >>= 1)
+        ret += 1;
+    return ret;
+}
+
+// builds the quotient of x and a non-zero constant d, in front of the statement at *i
+static Value * _isel_build_const_quotient(Block * block, size_t * i, Value * x, uint64_t d, uint8_t is_signed)
+{
+    Type type = x->type;
+    int bits = (int)type_size(type) * 8;
+    uint64_t mask = _isel_bits_mask(bits);
+    
+    if (!is_signed)
+    {
+        if (_isel_is_pow2(d))
+            return _isel_shift(block, i, "shr", x, _isel_log2(d));
+        
+        IselMagic magic = _isel_magic_unsigned(d, bits);
+        Value * q = _isel_insert_op(block, i, "mulhi", x, make_const_value(type.variant, magic.m));
+        if (!magic.add)
+            return _isel_shift(block, i, "shr", q, magic.shift);
+        // x + mulhi(x, m) can overflow, so average the two instead
+        Value * t = _isel_insert_op(block, i, "sub", x, q);
+        t = _isel_shift(block, i, "shr", t, 1);
+        t = _isel_insert_op(block, i, "add", t, q);
+        return _isel_shift(block, i, "shr", t, magic.shift - 1);
+    }
+    
+    uint64_t sign = (uint64_t)1 << (bits - 1);
+    int64_t sd = (int64_t)(((d & mask) ^ sign) - sign);
+    uint64_t ad = (sd < 0 ? (uint64_t)0 - (uint64_t)sd : (uint64_t)sd) & mask;
+    
+    Value * q;
+    if (ad == 1)
+        q = x;
+    else if (_isel_is_pow2(ad))
+    {
+        // shifting rounds towards negative infinity, so bias negative numbers by ad - 1 first
+        int k = _isel_log2(ad);
+        Value * bias = _isel_shift(block, i, "sar", x, k - 1);
+        bias = _isel_shift(block, i, "shr", bias, bits - k);
+        Value * t = _isel_insert_op(block, i, "add", x, bias);
+        q = _isel_shift(block, i, "sar", t, k);
+    }
+    else
+    {
+        IselMagic magic = _isel_magic_signed(sd, bits);
+        q = _isel_insert_op(block, i, "imulhi", x, make_const_value(type.variant, magic.m));
+        uint8_t m_negative = (magic.m & sign) != 0;
+        if (sd > 0 && m_negative)
+            q = _isel_insert_op(block, i, "add", q, x);
+        else if (sd < 0 && !m_negative)
+            q = _isel_insert_op(block, i, "sub", q, x);
+        q = _isel_shift(block, i, "sar", q, magic.shift);
+        // round towards zero
+        Value * t = _isel_shift(block, i, "shr", q, bits - 1);
+        return _isel_insert_op(block, i, "add", q, t);
+    }
+    if (sd < 0)
+        q = _isel_insert_op(block, i, "sub", _isel_const_operand(block, i, type, 0, 0), q);
+    return q;
+}
+
+// rewrites div, idiv, rem, and irem by non-zero constants into shifts, masks, and multiplications by magic numbers
+// this avoids both the slowness of hardware division and its RAX/RDX register constraints
+// 64-bit divisions still need the high half of a 64x64 multiply, which x86 only puts in RDX
+static void isel_lower_const_division(Program * program)
+{
+    for (size_t f = 0; f < array_len(program->functions, Function *); f++)
+    {
+        Function * func = program->functions[f];
+        for (size_t b = 0; b < array_len(func->blocks, Block *); b++)
+        {
+            Block * block = func->blocks[b];
+            Value ** touched = (Value **)zero_alloc(0);
+            
+            for (size_t i = 0; i < array_len(block->statements, Statement *); i++)
+            {
+                Statement * statement = block->statements[i];
+                const IselFixedPattern * fixed = isel_fixed_pattern_find(statement->statement_name);
+                if (!fixed || fixed->kind != ISEL_FIXED_DIV)
+                    continue;
+                uint8_t is_signed = fixed->is_signed;
+                uint8_t is_rem = fixed->is_rem;
+                
+                Value * x = statement->args[0].value;
+                Value * divisor = statement->args[1].value;
+                int64_t d = 0;
+                if (!_isel_const_int(divisor, &d) || d == 0 || x->variant == VALUE_CONST || !type_is_int(x->type))
+                    continue;
+                
+                Type type = x->type;
+                uint64_t mask = _isel_bits_mask((int)type_size(type) * 8);
+                uint64_t ud = (uint64_t)d & mask;
+                
+                Value * result;
+                if (!is_rem)
+                    result = _isel_build_const_quotient(block, &i, x, ud, is_signed);
+                else if (!is_signed && _isel_is_pow2(ud))
+                    result = _isel_insert_op(block, &i, "and", x, _isel_const_operand(block, &i, type, ud - 1, 1));
+                else
+                {
+                    // x - x / d * d
+                    Value * q = _isel_build_const_quotient(block, &i, x, ud, is_signed);
+                    Value * p = _isel_insert_op(block, &i, "mul", q, _isel_const_operand(block, &i, type, ud, 0));
+                    result = _isel_insert_op(block, &i, "sub", x, p);
+                }
+                
+                // the original statement becomes a copy of the result, which register allocation makes free
+                for (size_t n = 0; n < array_len(statement->args, Operand); n++)
+                    disconnect_statement_from_operand(statement, statement->args[n], 1);
+                statement->args = (Operand *)zero_alloc(0);
+                statement->statement_name = strcpy_z("mov");
+                array_push(statement->args, Operand, new_op_val(result));
+                connect_statement_to_operand(statement, statement->args[0]);
+                array_push(touched, Value *, x);
+                
+                // the divisor might have been moved into a register just for this statement
+                if (divisor->variant == VALUE_SSA && array_len(divisor->edges_out, Statement *) == 0 &&
+                    strcmp(divisor->ssa->statement_name, "mov") == 0)
+                {
+                    Statement * dead = divisor->ssa;
+                    disconnect_statement_from_operand(dead, dead->args[0], 1);
+                    size_t dead_index = ptr_array_find(block->statements, dead);
+                    assert(dead_index != (size_t)-1);
+                    array_erase(block->statements, Statement *, dead_index);
+                    i = ptr_array_find(block->statements, statement);
+                }
+            }
+            
+            for (size_t i = 0; i < array_len(block->statements, Statement *); i++)
+                block->statements[i]->temp = i;
+            for (size_t i = 0; i < array_len(touched, Value *); i++)
+                value_sort_edges_out(touched[i]);
+        }
+    }
+}
+
+static void do_instruction_selection(Program * program)
+{
+    isel_lower_const_division(program);
+    isel_fold_addressing_modes(program);
+}
+
+// copies the address operands of a load (starting at its base) or a store onto the end of another statement, with a
+// displacement even if there isn't one, so that the statement can be told apart from one that doesn't access memory
+static void _isel_append_address(Statement * statement, Statement * access, size_t addr_index, Value *** touched)
+{
+    array_push(statement->args, Operand, access->args[addr_index]);
+    connect_statement_to_operand(statement, access->args[addr_index]);
+    array_push(*touched, Value *, access->args[addr_index].value);
+    if (array_len(access->args, Operand) > addr_index + 1)
+    {
+        for (size_t n = addr_index + 1; n < array_len(access->args, Operand); n++)
+        {
+            array_push(statement->args, Operand, access->args[n]);
+            if (access->args[n].variant == OP_KIND_VALUE)
+            {
+                connect_statement_to_operand(statement, access->args[n]);
+                array_push(*touched, Value *, access->args[n].value);
+            }
+        }
+    }
+    else
+        array_push(statement->args, Operand, new_op_rawint(0));
+}
+
+// whether a load (address at index 1) and a store (address at index 0) access exactly the same address
+static uint8_t _isel_same_address(Statement * load, Statement * store)
+{
+    size_t load_extra = array_len(load->args, Operand) - 2;
+    size_t store_extra = array_len(store->args, Operand) - 2;
+    if (load->args[1].value != store->args[0].value)
+        return 0;
+    int64_t load_disp = load_extra > 0 ? (int64_t)load->args[2].rawint : 0;
+    int64_t store_disp = store_extra > 0 ? (int64_t)store->args[2].rawint : 0;
+    if (load_disp != store_disp)
+        return 0;
+    if ((load_extra > 1) != (store_extra > 1))
+        return 0;
+    return load_extra <= 1 || (load->args[3].value == store->args[3].value && load->args[4].rawint == store->args[4].rawint);
+}
+
+// a single-use load in the same block, that nothing between it and the statement at index `until` might write to
+// (scheduling hoists loads above stores that can't alias them, so those don't get in the way)
+static Statement * _isel_foldable_load(Block * block, Value * value, size_t until, size_t size)
+{
+    if (!_isel_value_single_use(value) || strcmp(value->ssa->statement_name, "load") != 0)
+        return 0;
+    Statement * load = value->ssa;
+    size_t start = ptr_array_find(block->statements, load);
+    if (start == (size_t)-1 || start > until || type_size(load->output->type) != size ||
+        load->args[1].value->variant == VALUE_CONST)
+        return 0;
+    MemLoc loc = memloc_of_statement(load);
+    for (size_t j = start + 1; j < until; j++)
+    {
+        Statement * statement = block->statements[j];
+        if (strcmp(statement->statement_name, "store") == 0)
+        {
+            if (memlocs_may_alias(memloc_of_statement(statement), loc))
+                return 0;
+        }
+        else if (str_begins_with(statement->statement_name, "store_"))
+        {
+            // already fused, always with a displacement
+            MemLoc written = memloc_of_folded_address(statement->args[0].value, statement->args, type_size(statement->args[1].value->type));
+            if (memlocs_may_alias(written, loc))
+                return 0;
+        }
+        else if (statement_has_side_effects(statement))
+            return 0;
+    }
+    return load;
+}
+
+static void _isel_remove_statement(Block * block, Statement * statement)
+{
+    for (size_t n = 0; n < array_len(statement->args, Operand); n++)
+        disconnect_statement_from_operand(statement, statement->args[n], 1);
+    size_t index = ptr_array_find(block->statements, statement);
+    assert(index != (size_t)-1);
+    array_erase(block->statements, Statement *, index);
+}
+
+// folds single-use loads into the arithmetic that uses them, using the pattern table:
+// - load-op: `v = load T addr; out = op a v` becomes `out = op a addr...`, emitted as `op out, [addr]`
+// - op-store: `v = load T addr; w = op v b; store addr w` becomes `store_op addr b disp [index scale]`, emitted as
+//   `op [addr], b`
+// (compare-branch pairs are fused during emission, which knows whether anything in between clobbers the flags.)
+// this runs after scheduling, which only knows how to order plain loads and stores, and only folds loads that nothing
+// between them and their use could have written to. narrow integer operations aren't worth the trouble
+static void isel_fold_memory_operands(Program * program)
+{
+    for (size_t f = 0; f < array_len(program->functions, Function *); f++)
+    {
+        Function * func = program->functions[f];
+        for (size_t b = 0; b < array_len(func->blocks, Block *); b++)
+        {
+            Block * block = func->blocks[b];
+            Value ** touched = (Value **)zero_alloc(0);
+            
+            for (size_t i = 0; i < array_len(block->statements, Statement *); i++)
+            {
+                Statement * statement = block->statements[i];
+                const IselPattern * pattern = isel_pattern_find(statement);
+                if (!pattern || !statement->output || array_len(statement->args, Operand) != 2 ||
+                    statement->args[0].variant != OP_KIND_VALUE || statement->args[1].variant != OP_KIND_VALUE)
+                    continue;
+                size_t size = type_size(statement->output->type);
+                if (pattern->type_class == ISEL_INT && size != 4 && size != 8)
+                    continue;
+                
+                // op-store
+                Statement * store = _isel_value_single_use(statement->output) ? statement->output->edges_out[0] : 0;
+                size_t store_index = store ? ptr_array_find(block->statements, store) : (size_t)-1;
+                Statement * load = 0;
+                Value * other = 0;
+                if ((pattern->flags & ISEL_OP_STORE) && store_index != (size_t)-1 && strcmp(store->statement_name, "store") == 0 &&
+                    store->args[1].value == statement->output && store->args[0].value != statement->output)
+                {
+                    size_t sides = (pattern->flags & ISEL_COMMUTATIVE) ? 2 : 1;
+                    for (size_t side = 0; side < sides && !load; side++)
+                    {
+                        load = _isel_foldable_load(block, statement->args[side].value, store_index, size);
+                        if (load && !_isel_same_address(load, store))
+                            load = 0;
+                        other = statement->args[1 - side].value;
+                    }
+                    int64_t n = 0;
+                    // immediates are sign-extended from 32 bits
+                    if (load && other->variant == VALUE_CONST && _isel_const_int(other, &n) &&
+                        (n < -(int64_t)0x80000000 || n > (int64_t)0x7FFFFFFF))
+                        load = 0;
+                    if (load && other != load->output)
+                    {
+                        Statement * fused = new_statement();
+                        fused->statement_name = string_concat("store_", pattern->name);
+                        fused->block = block;
+                        array_push(fused->args, Operand, store->args[0]);
+                        connect_statement_to_operand(fused, store->args[0]);
+                        array_push(fused->args, Operand, new_op_val(other));
+                        connect_statement_to_operand(fused, fused->args[1]);
+                        if (array_len(store->args, Operand) > 2)
+                        {
+                            for (size_t a = 2; a < array_len(store->args, Operand); a++)
+                            {
+                                array_push(fused->args, Operand, store->args[a]);
+                                if (store->args[a].variant == OP_KIND_VALUE)
+                                    connect_statement_to_operand(fused, store->args[a]);
+                            }
+                        }
+                        else
+                            array_push(fused->args, Operand, new_op_rawint(0));
+                        for (size_t a = 0; a < array_len(fused->args, Operand); a++)
+                        {
+                            if (fused->args[a].variant == OP_KIND_VALUE)
+                                array_push(touched, Value *, fused->args[a].value);
+                        }
+                        
+                        block->statements[store_index] = fused;
+                        for (size_t a = 0; a < array_len(store->args, Operand); a++)
+                            disconnect_statement_from_operand(store, store->args[a], 1);
+                        // carry on from whatever came after this statement (the load was before it)
+                        Statement * next = block->statements[i + 1];
+                        _isel_remove_statement(block, statement);
+                        _isel_remove_statement(block, load);
+                        i = ptr_array_find(block->statements, next) - 1;
+                        continue;
+                    }
+                }
+                
+                // load-op, with the load as the second operand
+                if (!(pattern->flags & ISEL_LOAD_OP))
+                    continue;
+                load = _isel_foldable_load(block, statement->args[1].value, i, size);
+                if (!load && (pattern->flags & ISEL_COMMUTATIVE) &&
+                    (load = _isel_foldable_load(block, statement->args[0].value, i, size)))
+                {
+                    Operand temp = statement->args[0];
+                    statement->args[0] = statement->args[1];
+                    statement->args[1] = temp;
+                }
+                if (!load || statement->args[0].value == load->output)
+                    continue;
+                
+                disconnect_statement_from_operand(statement, statement->args[1], 1);
+                array_erase(statement->args, Operand, 1);
+                _isel_append_address(statement, load, 1, &touched);
+                _isel_remove_statement(block, load);
+                i = ptr_array_find(block->statements, statement);
+            }
+            
+            for (size_t i = 0; i < array_len(block->statements, Statement *); i++)
+                block->statements[i]->temp = i;
+            for (size_t i = 0; i < array_len(touched, Value *); i++)
+                value_sort_edges_out(touched[i]);
+        }
+    }
+}
+
+// instruction selection that has to wait until the statements are in their final order
+static void do_late_instruction_selection(Program * program)
+{
+    isel_fold_memory_operands(program);
+}
+
+#endif // BBAE_ISEL
@@ -0,0 +1,336 @@
+#ifndef BBAE_MINST
+#define BBAE_MINST
+
+// Lightweight machine instruction list.
+// compile_file builds one of these per function instead of encoding instructions directly, so that the peephole
+// optimizer (peephole_x86.h) can rewrite them before their sizes and jump offsets are known.
+
+#include "emitter_x86.h"
+#include "../compiler_common.h"
+#include "../relocation_helpers.h"
+
+enum MInstKind {
+    MINST_INST, // ordinary instruction
+    MINST_JUMP, // jmp or jcc to a label in the same function
+    MINST_LABEL, // jump target; not an instruction
+};
+
+enum MInstReloc {
+    MINST_RELOC_NONE,
+    MINST_RELOC_STATIC, // the last 4 bytes of the instruction are a rip-relative static address
+    MINST_RELOC_SYMBOL, // the last 4 bytes of the instruction are a rip-relative symbol address
+};
+
+typedef struct _MInst {
+    uint8_t kind;
+    int name; // enum InstName
+    EncOperand ops[4];
+    int op_count;
+    const char * label; // jump target, label name, or relocation target
+    uint8_t reloc;
+    uint8_t align; // labels only: pad with NOPs up to a multiple of this, if it takes at most max_padding bytes
+    uint8_t max_padding;
+} MInst;
+
+static inline void minst_emit_n(MInst ** insts, int name, EncOperand * ops, int n)
+{
+    assert(n <= 4);
+    MInst inst;
+    memset(&inst, 0, sizeof(MInst));
+    inst.kind = MINST_INST;
+    inst.name = name;
+    inst.op_count = n;
+    for (int i = 0; i < n; i++)
+        inst.ops[i] = ops[i];
+    array_push(*insts, MInst, inst);
+}
+static inline void minst_emit_3(MInst ** insts, int name, EncOperand op1, EncOperand op2, EncOperand op3)
+{
+    EncOperand ops[] = {op1, op2, op3};
+    minst_emit_n(insts, name, ops, 3);
+}
+static inline void minst_emit_2(MInst ** insts, int name, EncOperand op1, EncOperand op2)
+{
+    EncOperand ops[] = {op1, op2};
+    minst_emit_n(insts, name, ops, 2);
+}
+static inline void minst_emit_1(MInst ** insts, int name, EncOperand op1)
+{
+    EncOperand ops[] = {op1};
+    minst_emit_n(insts, name, ops, 1);
+}
+static inline void minst_emit_0(MInst ** insts, int name)
+{
+    minst_emit_n(insts, name, 0, 0);
+}
+
+// name is INST_JMP or one of the INST_J<cc>s
+static inline void minst_emit_jump(MInst ** insts, int name, const char * label)
+{
+    MInst inst;
+    memset(&inst, 0, sizeof(MInst));
+    inst.kind = MINST_JUMP;
+    inst.name = name;
+    inst.label = label;
+    array_push(*insts, MInst, inst);
+}
+
+static inline void minst_label(MInst ** insts, const char * label)
+{
+    MInst inst;
+    memset(&inst, 0, sizeof(MInst));
+    inst.kind = MINST_LABEL;
+    inst.label = label;
+    array_push(*insts, MInst, inst);
+}
+
+// align has to be a power of two
+static inline void minst_label_aligned(MInst ** insts, const char * label, uint8_t align, uint8_t max_padding)
+{
+    assert(align && (align & (align - 1)) == 0);
+    minst_label(insts, label);
+    (*insts)[array_len(*insts, MInst) - 1].align = align;
+    (*insts)[array_len(*insts, MInst) - 1].max_padding = max_padding;
+}
+
+// attaches a relocation to the most recently emitted instruction
+static inline void minst_set_reloc(MInst ** insts, uint8_t reloc, const char * name)
+{
+    MInst * inst = &(*insts)[array_len(*insts, MInst) - 1];
+    assert(inst->kind == MINST_INST);
+    inst->reloc = reloc;
+    inst->label = name;
+}
+
+// a label, during branch relaxation
+typedef struct _MInstLabel {
+    const char * name;
+    size_t inst; // index in the instruction list
+    size_t packed; // where it would go if every jump and padding were left out of the code
+    size_t loc; // where it goes with the sizes picked so far
+} MInstLabel;
+
+// FNV-1a
+static uint64_t _minst_hash_label(const char * name)
+{
+    uint64_t hash = 0xCBF29CE484222325;
+    while (*name)
+        hash = (hash ^ (uint8_t)*name++) * 0x100000001B3;
+    return hash;
+}
+
+// labels are looked up through an open addressing hash table with a power-of-two size, holding label indexes plus one
+// (zero for empty), so that jumps can find theirs without comparing against every label in the function
+static size_t _minst_find_label(size_t * table, size_t table_mask, MInstLabel * labels, const char * name)
+{
+    for (size_t slot = _minst_hash_label(name) & table_mask; table[slot]; slot = (slot + 1) & table_mask)
+    {
+        const char * label = labels[table[slot] - 1].name;
+        if (label == name || strcmp(label, name) == 0)
+            return table[slot] - 1;
+    }
+    printf("failed to find label with name %s\n", name);
+    assert(0);
+    return 0;
+}
+
+// a jump, or the padding in front of an aligned label, during branch relaxation
+typedef struct _MInstBranch {
+    size_t inst; // index in the instruction list
+    size_t packed; // where it would go if every jump and padding were left out of the code
+    size_t loc; // where it goes with the sizes picked so far
+    size_t size; // with the sizes picked so far
+    size_t target; // index in the label list
+    uint8_t is_long; // rel32 instead of rel8
+} MInstBranch;
+
+static size_t _minst_branch_size(MInstBranch * branch, MInst * inst)
+{
+    if (inst->kind == MINST_LABEL)
+    {
+        size_t padding = (inst->align - branch->loc % inst->align) % inst->align;
+        return padding <= inst->max_padding ? padding : 0;
+    }
+    if (!branch->is_long)
+        return 2;
+    return inst->name == INST_JMP ? 5 : 6;
+}
+
+// an instruction with a relocation on its last four bytes, during branch relaxation
+typedef struct _MInstRelocPos {
+    size_t inst;
+    size_t packed_end;
+} MInstRelocPos;
+
+// encodes the instruction list into `code`, and resolves its jumps
+// static and symbol relocations are registered with relocation_helpers.h, to be applied once the whole file is done
+// jumps start out as rel8 and only get widened to rel32 if their target is too far away. widening a jump moves
+// everything after it, which can push other jumps out of range, so this repeats until every jump fits. jumps only ever
+// get wider, so it always settles, usually in two or three rounds
+// to keep the rounds cheap, every other instruction is encoded once, straight into the buffer, with the jumps left out;
+// the code then gets spread apart to make room for them, and they get encoded last
+// the padding in front of aligned labels gets worked out along with the jumps, since it depends on where they end up.
+// it can shrink as jumps get wider, but that only ever brings jumps closer to their targets
+static void minst_encode(byte_buffer * code, MInst * insts)
+{
+    size_t inst_count = array_len(insts, MInst);
+    size_t label_count = 0;
+    size_t branch_count = 0;
+    size_t reloc_count = 0;
+    size_t max_padding = 0;
+    for (size_t i = 0; i < inst_count; i++)
+    {
+        label_count += insts[i].kind == MINST_LABEL;
+        branch_count += insts[i].kind == MINST_JUMP || (insts[i].kind == MINST_LABEL && insts[i].align);
+        reloc_count += insts[i].kind == MINST_INST && insts[i].reloc != MINST_RELOC_NONE;
+        max_padding += insts[i].kind == MINST_LABEL ? insts[i].max_padding : 0;
+    }
+    size_t table_size = 1;
+    while (table_size < label_count * 2)
+        table_size <<= 1;
+    // scratch space that's gone by the time this returns, so it comes from malloc, which can hand the same memory out
+    // again for the next function, instead of zero_alloc, which would need fresh memory every time
+    uint8_t * scratch = (uint8_t *)malloc(sizeof(MInstLabel) * label_count + sizeof(size_t) * table_size +
+                                          sizeof(MInstBranch) * branch_count + sizeof(MInstRelocPos) * reloc_count);
+    assert(scratch);
+    MInstLabel * labels = (MInstLabel *)scratch;
+    size_t * table = (size_t *)(labels + label_count);
+    MInstBranch * branches = (MInstBranch *)(table + table_size);
+    MInstRelocPos * relocs = (MInstRelocPos *)(branches + branch_count);
+    memset(table, 0, sizeof(size_t) * table_size);
+    
+    // enough room for every instruction to be as long as possible
+    bytes_reserve(code, (inst_count - label_count) * ENC_MAX_INST_LEN + max_padding);
+    label_count = 0;
+    branch_count = 0;
+    reloc_count = 0;
+    uint8_t * start = code->data;
+    uint8_t * cur = code->data + code->len;
+    
+    for (size_t i = 0; i < inst_count; i++)
+    {
+        MInst * inst = &insts[i];
+        if (inst->kind == MINST_LABEL)
+        {
+            if (inst->align)
+            {
+                MInstBranch padding;
+                memset(&padding, 0, sizeof(MInstBranch));
+                padding.inst = i;
+                padding.packed = cur - start;
+                branches[branch_count++] = padding;
+            }
+            MInstLabel label = {inst->label, i, (size_t)(cur - start), 0};
+            size_t slot = _minst_hash_label(label.name) & (table_size - 1);
+            while (table[slot])
+                slot = (slot + 1) & (table_size - 1);
+            table[slot] = label_count + 1;
+            labels[label_count++] = label;
+        }
+        else if (inst->kind == MINST_JUMP)
+        {
+            MInstBranch branch;
+            memset(&branch, 0, sizeof(MInstBranch));
+            branch.inst = i;
+            branch.packed = cur - start;
+            branches[branch_count++] = branch;
+        }
+        else
+        {
+            int failed = enc_encode_n(&cur, inst->name, inst->ops, inst->op_count);
+            assert(((void)"failed to encode instruction", !failed));
+            (void)failed;
+            if (inst->reloc != MINST_RELOC_NONE)
+            {
+                MInstRelocPos reloc = {i, (size_t)(cur - start)};
+                relocs[reloc_count++] = reloc;
+            }
+        }
+    }
+    size_t packed_end = cur - start;
+    
+    for (size_t b = 0; b < branch_count; b++)
+    {
+        if (insts[branches[b].inst].kind == MINST_JUMP)
+            branches[b].target = _minst_find_label(table, table_size - 1, labels, insts[branches[b].inst].label);
+    }
+    
+    uint8_t changed = 1;
+    size_t growth = 0;
+    while (changed)
+    {
+        changed = 0;
+        
+        // everything moves forward by the size of the jumps and padding before it
+        growth = 0;
+        size_t l = 0;
+        for (size_t b = 0; b < branch_count; b++)
+        {
+            for (; l < label_count && labels[l].inst < branches[b].inst; l++)
+                labels[l].loc = labels[l].packed + growth;
+            branches[b].loc = branches[b].packed + growth;
+            branches[b].size = _minst_branch_size(&branches[b], &insts[branches[b].inst]);
+            growth += branches[b].size;
+        }
+        for (; l < label_count; l++)
+            labels[l].loc = labels[l].packed + growth;
+        
+        for (size_t b = 0; b < branch_count; b++)
+        {
+            if (branches[b].is_long || insts[branches[b].inst].kind != MINST_JUMP)
+                continue;
+            int64_t diff = (int64_t)labels[branches[b].target].loc - (int64_t)(branches[b].loc + 2);
+            if (diff < -128 || diff > 127)
+            {
+                branches[b].is_long = 1;
+                changed = 1;
+            }
+        }
+    }
+    
+    // spread the code apart, starting from the end so that nothing gets overwritten before it's moved
+    size_t segment_end = packed_end;
+    for (size_t b = branch_count; b > 0; b--)
+    {
+        MInstBranch * branch = &branches[b - 1];
+        size_t to = branch->loc + branch->size;
+        memmove(start + to, start + branch->packed, segment_end - branch->packed);
+        segment_end = branch->packed;
+    }
+    code->len = packed_end + growth;
+    assert(code->len <= code->cap);
+    
+    for (size_t b = 0; b < branch_count; b++)
+    {
+        MInstBranch * branch = &branches[b];
+        cur = start + branch->loc;
+        if (insts[branch->inst].kind == MINST_LABEL)
+        {
+            enc_encode_nops(&cur, branch->size);
+            continue;
+        }
+        EncOperand target = enc_imm(labels[branch->target].loc - branch->loc, 4);
+        int failed = enc_encode_jump(&cur, insts[branch->inst].name, target, branch->is_long);
+        assert(((void)"failed to encode jump", !failed));
+        assert(cur == start + branch->loc + branch->size);
+        (void)failed;
+    }
+    
+    size_t b = 0;
+    growth = 0;
+    for (size_t r = 0; r < reloc_count; r++)
+    {
+        for (; b < branch_count && branches[b].inst < relocs[r].inst; b++)
+            growth += branches[b].size;
+        MInst * inst = &insts[relocs[r].inst];
+        size_t loc = relocs[r].packed_end + growth - 4;
+        if (inst->reloc == MINST_RELOC_STATIC)
+            add_static_relocation(loc, inst->label, 4);
+        else
+            add_symbol_relocation(loc, inst->label, 4);
+    }
+    
+    free(scratch);
+}
+
+#endif // BBAE_MINST
@@ -0,0 +1,256 @@
+#ifndef BBAE_PEEPHOLE
+#define BBAE_PEEPHOLE
+
+// Peephole optimizer for the machine instruction lists built by compile_file.
+// Rules are tried at every instruction until none of them apply anymore. Each rule counts how often it fired.
+
+#include "minst_x86.h"
+
+static inline uint8_t _pop_is_reg(EncOperand op)
+{
+    return !op.is_imm && !(op.op & INT64_MIN);
+}
+static inline uint8_t _pop_is_gpr(EncOperand op)
+{
+    return _pop_is_reg(op) && op.op >= FE_AX && op.op <= FE_R15;
+}
+static inline uint8_t _pop_is_xmm(EncOperand op)
+{
+    return _pop_is_reg(op) && op.op >= FE_XMM0 && op.op <= FE_XMM15;
+}
+static inline uint8_t _pop_is_imm(EncOperand op, int64_t imm)
+{
+    return op.is_imm && (int64_t)op.op == imm;
+}
+static inline enum Register _pop_to_register(EncOperand op)
+{
+    assert(_pop_is_gpr(op));
+    return (enum Register)(op.op - FE_AX);
+}
+static inline uint8_t _minst_is(MInst * inst, int name, int op_count)
+{
+    return inst->kind == MINST_INST && inst->name == name && inst->op_count == op_count && inst->reloc == MINST_RELOC_NONE;
+}
+
+static uint8_t _minst_reads_flags(MInst * inst)
+{
+    if (inst->kind == MINST_JUMP)
+        return inst->name != INST_JMP;
+    if (inst->kind != MINST_INST)
+        return 0;
+    return (inst->name >= INST_CMOVO && inst->name <= INST_CMOVNLE) ||
+           (inst->name >= INST_SETO && inst->name <= INST_SETNLE);
+}
+static uint8_t _minst_writes_flags(MInst * inst)
+{
+    if (inst->kind != MINST_INST)
+        return 0;
+    switch (inst->name)
+    {
+    case INST_ADD: case INST_SUB: case INST_AND: case INST_OR: case INST_XOR:
+    case INST_CMP: case INST_TEST: case INST_NEG: case INST_INC: case INST_DEC:
+    case INST_IMUL: case INST_MUL: case INST_DIV: case INST_IDIV:
+    case INST_BT: case INST_BTC: case INST_BTR: case INST_BTS:
+    case INST_UCOMISD: case INST_UCOMISS:
+        return 1;
+    // a shift by cl might be a shift by zero, which leaves the flags alone
+    case INST_SHL: case INST_SHR: case INST_SAR:
+        return inst->ops[1].is_imm && inst->ops[1].op != 0;
+    default:
+        return 0;
+    }
+}
+
+// whether anything after insts[i] might read the flags that are current right after it
+// code generation never carries flags across labels, calls, or function exits
+static uint8_t _minst_flags_live_after(MInst * insts, size_t i)
+{
+    for (size_t j = i + 1; j < array_len(insts, MInst); j++)
+    {
+        MInst * inst = &insts[j];
+        if (_minst_reads_flags(inst))
+            return 1;
+        if (_minst_writes_flags(inst))
+            return 0;
+        if (inst->kind == MINST_LABEL || inst->kind == MINST_JUMP)
+            return 0;
+        if (inst->kind == MINST_INST && (inst->name == INST_CALL || inst->name == INST_RET))
+            return 0;
+    }
+    return 0;
+}
+
+// mov x, x (and the sse equivalents), or mov a, b; mov b, a
+static uint8_t _peephole_redundant_mov(MInst ** insts, size_t i)
+{
+    MInst * inst = &(*insts)[i];
+    if ((_minst_is(inst, INST_MOV, 2) && memcmp(&inst->ops[0], &inst->ops[1], sizeof(EncOperand)) == 0) ||
+        ((_minst_is(inst, INST_MOVAPS, 2) || _minst_is(inst, INST_MOVAPD, 2) || _minst_is(inst, INST_MOVQ, 2)) &&
+         _pop_is_xmm(inst->ops[0]) && encops_equal(inst->ops[0], inst->ops[1])))
+    {
+        array_erase(*insts, MInst, i);
+        return 1;
+    }
+    if (i > 0)
+    {
+        MInst * prev = &(*insts)[i - 1];
+        // 32-bit movs zero-extend, so only 64-bit ones are exact copies
+        if (_minst_is(prev, INST_MOV, 2) && _minst_is(inst, INST_MOV, 2) &&
+            _pop_is_gpr(prev->ops[0]) && _pop_is_gpr(prev->ops[1]) && prev->ops[0].size == 8 && prev->ops[1].size == 8 &&
+            encops_equal(prev->ops[0], inst->ops[1]) && encops_equal(prev->ops[1], inst->ops[0]))
+        {
+            array_erase(*insts, MInst, i);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// mov a, b; add a, c/imm -> lea a, [b + c/imm] (likewise for sub with an immediate)
+static uint8_t _peephole_mov_add_to_lea(MInst ** insts, size_t i)
+{
+    if (i + 1 >= array_len(*insts, MInst))
+        return 0;
+    MInst * mov = &(*insts)[i];
+    MInst * op = &(*insts)[i + 1];
+    if (!_minst_is(mov, INST_MOV, 2) || !(_minst_is(op, INST_ADD, 2) || _minst_is(op, INST_SUB, 2)))
+        return 0;
+
+    EncOperand dst = mov->ops[0];
+    EncOperand src = mov->ops[1];
+    if (!_pop_is_gpr(dst) || !_pop_is_gpr(src) || encops_equal(dst, src))
+        return 0;
+    if ((dst.size != 4 && dst.size != 8) || src.size != dst.size || !encops_equal(op->ops[0], dst))
+        return 0;
+    if (_minst_flags_live_after(*insts, i + 1))
+        return 0;
+
+    enum Register base = _pop_to_register(src);
+    enum Register index = REG_NONE;
+    int64_t offset = 0;
+    EncOperand other = op->ops[1];
+    if (other.is_imm)
+    {
+        offset = (int64_t)other.op;
+        if (op->name == INST_SUB)
+            offset = -offset;
+        if (offset < -(int64_t)0x7FFFFFFF || offset > (int64_t)0x7FFFFFFF)
+            return 0;
+    }
+    else if (op->name == INST_ADD && _pop_is_gpr(other) && other.size == dst.size)
+    {
+        // add a, a after the mov means b + b
+        index = encops_equal(other, dst) ? base : _pop_to_register(other);
+        if (index == REG_RSP)
+        {
+            if (base == REG_RSP)
+                return 0;
+            index = base;
+            base = REG_RSP;
+        }
+    }
+    else
+        return 0;
+
+    mov->name = INST_LEA;
+    mov->ops[1] = enc_mem_full(base, index, index == REG_NONE ? 0 : 1, offset, 8);
+    array_erase(*insts, MInst, i + 1);
+    return 1;
+}
+
+// mov r, 0 -> xor r32, r32
+static uint8_t _peephole_zero_idiom(MInst ** insts, size_t i)
+{
+    MInst * inst = &(*insts)[i];
+    if (!_minst_is(inst, INST_MOV, 2) || !_pop_is_gpr(inst->ops[0]) || !_pop_is_imm(inst->ops[1], 0))
+        return 0;
+    if (inst->ops[0].size != 4 && inst->ops[0].size != 8)
+        return 0;
+    if (_minst_flags_live_after(*insts, i))
+        return 0;
+
+    EncOperand reg = enc_reg(_pop_to_register(inst->ops[0]), 4);
+    inst->name = INST_XOR;
+    inst->ops[0] = reg;
+    inst->ops[1] = reg;
+    return 1;
+}
+
+// cmp r, 0 -> test r, r
+static uint8_t _peephole_cmp_zero_to_test(MInst ** insts, size_t i)
+{
+    MInst * inst = &(*insts)[i];
+    if (!_minst_is(inst, INST_CMP, 2) || !_pop_is_gpr(inst->ops[0]) || !_pop_is_imm(inst->ops[1], 0))
+        return 0;
+    inst->name = INST_TEST;
+    inst->ops[1] = inst->ops[0];
+    return 1;
+}
+
+// and/or/xor r, x; test r, r -> and/or/xor r, x
+// the logic ops set every flag exactly the way the test would
+static uint8_t _peephole_redundant_test(MInst ** insts, size_t i)
+{
+    if (i == 0)
+        return 0;
+    MInst * prev = &(*insts)[i - 1];
+    MInst * inst = &(*insts)[i];
+    if (!_minst_is(inst, INST_TEST, 2) || !_pop_is_gpr(inst->ops[0]) || !encops_equal(inst->ops[0], inst->ops[1]))
+        return 0;
+    if (!(_minst_is(prev, INST_AND, 2) || _minst_is(prev, INST_OR, 2) || _minst_is(prev, INST_XOR, 2)))
+        return 0;
+    if (!encops_equal(prev->ops[0], inst->ops[0]) || prev->ops[0].size != inst->ops[0].size)
+        return 0;
+    array_erase(*insts, MInst, i);
+    return 1;
+}
+
+typedef struct _PeepholeRule {
+    const char * name;
+    // tries to apply the rule at the given instruction, returning 1 if anything changed
+    uint8_t (*apply)(MInst ** insts, size_t i);
+    uint64_t hits;
+} PeepholeRule;
+
+static PeepholeRule peephole_rules[] = {
+    {"redundant_mov", _peephole_redundant_mov, 0},
+    {"mov_add_to_lea", _peephole_mov_add_to_lea, 0},
+    {"zero_idiom", _peephole_zero_idiom, 0},
+    {"cmp_zero_to_test", _peephole_cmp_zero_to_test, 0},
+    {"redundant_test", _peephole_redundant_test, 0},
+};
+
+static void peephole_optimize(MInst ** insts)
+{
+    uint8_t changed = 1;
+    while (changed)
+    {
+        changed = 0;
+        for (size_t i = 0; i < array_len(*insts, MInst); i++)
+        {
+            for (size_t r = 0; r < sizeof(peephole_rules) / sizeof(PeepholeRule); r++)
+            {
+                if (i < array_len(*insts, MInst) && peephole_rules[r].apply(insts, i))
+                {
+                    peephole_rules[r].hits += 1;
+                    changed = 1;
+                }
+            }
+        }
+    }
+}
+
+// the hit counts are per program, so compile_file clears them before it starts
+static void reset_peephole_stats(void)
+{
+    for (size_t r = 0; r < sizeof(peephole_rules) / sizeof(PeepholeRule); r++)
+        peephole_rules[r].hits = 0;
+}
+
+static void print_peephole_stats(void)
+{
+    for (size_t r = 0; r < sizeof(peephole_rules) / sizeof(PeepholeRule); r++)
+        printf("peephole %s: %zu\n", peephole_rules[r].name, (size_t)peephole_rules[r].hits);
+}
+
+#endif // BBAE_PEEPHOLE
@@ -0,0 +1,207 @@
+#ifndef BBAE_REGALLOC_VERIFY
+#define BBAE_REGALLOC_VERIFY
+
+// Register allocation verifier, for builds with BBAE_VERIFY_REGALLOC defined. Runs right after do_regalloc and steps
+// through each block with an abstract register file, holding which value each register contains at that point:
+// - block args (function args for the entry block) start out in their registers
+// - every operand has to be in the register the emitter is going to read it from
+// - statements write their output register and wipe the registers they clobber (calls wipe every caller-saved one)
+// - spill slots have to be stored to before they're reloaded from
+// - nothing may be put in a register that the emitter reserves for itself, and everything that is has to be recorded
+//   in written_registers, or it won't be saved if it's callee-saved
+// - block args and call args are moved into place by one parallel copy each, so their registers have to be distinct
+// Every problem gets printed before the verifier fails.
+
+#include "regalloc_x86.h"
+
+// registers that emission uses for itself, and that values must never be allocated to
+static uint64_t regalloc_verify_reserved_mask(void)
+{
+    return ((uint64_t)1 << _ABI_RSP) | ((uint64_t)1 << _ABI_RBP) | ((uint64_t)1 << _ABI_R11) | ((uint64_t)1 << _ABI_XMM5);
+}
+
+static size_t _regalloc_verify_report(Function * func, Block * block, Statement * statement, const char * problem, Value * value)
+{
+    const char * value_name = "";
+    if (value && value->variant == VALUE_ARG)
+        value_name = value->arg;
+    else if (value && value->variant == VALUE_SSA)
+        value_name = value->ssa->output_name;
+    printf("regalloc verifier: %s (%s) in %s, block %s, at %s\n", problem, value_name, func->name, block->name,
+           statement ? statement->statement_name : "block entry");
+    return 1;
+}
+
+// checks that a value is somewhere that the allocator is allowed to put values, and returns the number of problems
+static size_t _regalloc_verify_placement(Function * func, Block * block, Statement * statement, Value * value, uint8_t check_written)
+{
+    if (!value->regalloced)
+        return _regalloc_verify_report(func, block, statement, "value never got a register", value);
+    if ((int64_t)value->regalloc < 0 || value->regalloc >= 32)
+        return _regalloc_verify_report(func, block, statement, "value isn't in a register", value);
+    if ((regalloc_verify_reserved_mask() >> value->regalloc) & 1)
+        return _regalloc_verify_report(func, block, statement, "value is in a reserved register", value);
+    if ((value->regalloc >= _ABI_XMM0) != !type_is_intreg(value->type))
+        return _regalloc_verify_report(func, block, statement, "value is in the wrong kind of register", value);
+    if (check_written && !func->written_registers[value->regalloc])
+        return _regalloc_verify_report(func, block, statement, "value's register is missing from written_registers", value);
+    return 0;
+}
+
+// checks that the given registers (one per value) are all different, for parallel copies
+static size_t _regalloc_verify_distinct(Function * func, Block * block, Statement * statement, Value ** values, int64_t * regs, size_t count)
+{
+    size_t problems = 0;
+    for (size_t i = 0; i < count; i++)
+    {
+        for (size_t j = 0; j < i; j++)
+        {
+            if (regs[i] >= 0 && regs[i] == regs[j])
+                problems += _regalloc_verify_report(func, block, statement, "two values moved into the same register", values[i]);
+        }
+    }
+    return problems;
+}
+
+static size_t regalloc_verify_block(Function * func, Block * block)
+{
+    size_t problems = 0;
+    Value * regs[32];
+    memset(regs, 0, sizeof(regs));
+    
+    // spill slots that have been stored to so far in this block
+    Value ** stored_slots = (Value **)zero_alloc(0);
+    
+    Value ** args = block == func->entry_block ? func->args : block->args;
+    for (size_t i = 0; i < array_len(args, Value *); i++)
+    {
+        Value * arg = args[i];
+        // function args that nothing uses don't need to be anywhere
+        if (block == func->entry_block && !arg->regalloced && array_len(arg->edges_out, Statement *) == 0)
+            continue;
+        size_t arg_problems = _regalloc_verify_placement(func, block, 0, arg, block != func->entry_block);
+        problems += arg_problems;
+        if (arg_problems)
+            continue;
+        if (regs[arg->regalloc])
+            problems += _regalloc_verify_report(func, block, 0, "two block args share a register", arg);
+        regs[arg->regalloc] = arg;
+    }
+    
+    for (size_t i = 0; i < array_len(block->statements, Statement *); i++)
+    {
+        Statement * statement = block->statements[i];
+        const char * name = statement->statement_name;
+        
+        for (size_t a = 0; a < array_len(statement->args, Operand); a++)
+        {
+            Operand op = statement->args[a];
+            if (op.variant != OP_KIND_VALUE || !op.value)
+                continue;
+            Value * value = op.value;
+            if (value->variant == VALUE_CONST)
+                continue;
+            if (value->variant == VALUE_STACKADDR)
+            {
+                if (ptr_array_find(func->stack_slots, value) == (size_t)-1)
+                    problems += _regalloc_verify_report(func, block, statement, "stack slot doesn't belong to the function", value);
+                continue;
+            }
+            size_t value_problems = _regalloc_verify_placement(func, block, statement, value, 0);
+            problems += value_problems;
+            if (!value_problems && regs[value->regalloc] != value)
+                problems += _regalloc_verify_report(func, block, statement, "operand isn't in its register anymore", value);
+        }
+        
+        // reloads
+        if (strcmp(name, "load") == 0 && array_len(statement->args, Operand) == 2)
+        {
+            Value * address = statement->args[1].value;
+            if (address->variant == VALUE_STACKADDR && address->slotinfo->is_spill &&
+                ptr_array_find(stored_slots, address) == (size_t)-1)
+                problems += _regalloc_verify_report(func, block, statement, "spill slot reloaded before it was stored to", statement->output);
+        }
+        if (strcmp(name, "store") == 0 && statement->args[0].value->variant == VALUE_STACKADDR &&
+            statement->args[0].value->slotinfo->is_spill)
+            array_push(stored_slots, Value *, statement->args[0].value);
+        
+        // block args of the targets and call args each get filled in by one parallel copy
+        if (strcmp(name, "goto") == 0 || strcmp(name, "if") == 0)
+        {
+            size_t start = strcmp(name, "goto") == 0 ? 0 : 1;
+            size_t arg_count = array_len(statement->args, Operand);
+            while (start < arg_count)
+            {
+                Block * target = find_block(func, statement->args[start].text);
+                assert(target);
+                size_t count = array_len(target->args, Value *);
+                int64_t * target_regs = (int64_t *)zero_alloc(sizeof(int64_t) * (count + 1));
+                for (size_t j = 0; j < count; j++)
+                {
+                    target_regs[j] = -1;
+                    if (_regalloc_verify_placement(func, target, 0, target->args[j], 1) == 0)
+                        target_regs[j] = target->args[j]->regalloc;
+                }
+                problems += _regalloc_verify_distinct(func, block, statement, target->args, target_regs, count);
+                // the else branch starts after the separator that follows the args of the first one
+                start += count + 2;
+            }
+        }
+        if (strcmp(name, "call") == 0 || strcmp(name, "call_eval") == 0)
+        {
+            size_t count = array_len(statement->args, Operand);
+            Value ** call_args = (Value **)zero_alloc(sizeof(Value *) * count);
+            int64_t * call_regs = (int64_t *)zero_alloc(sizeof(int64_t) * count);
+            abi_reset_state();
+            for (size_t a = 1; a < count; a++)
+            {
+                call_args[a] = statement->args[a].value;
+                call_regs[a] = abi_get_next_arg_basic(type_is_float(call_args[a]->type));
+                if (call_regs[a] < 0)
+                    problems += _regalloc_verify_report(func, block, statement, "call arg doesn't fit in a register", call_args[a]);
+            }
+            problems += _regalloc_verify_distinct(func, block, statement, call_args + 1, call_regs + 1, count - 1);
+        }
+        
+        RegAllocRules rules = regalloc_rule_determiner(statement);
+        if (rules.is_special)
+        {
+            for (size_t r = 0; r < 32; r++)
+            {
+                if ((rules.clobbered_registers >> r) & 1)
+                    regs[r] = 0;
+            }
+        }
+        
+        Value * output = statement->output;
+        if (output)
+        {
+            size_t output_problems = _regalloc_verify_placement(func, block, statement, output, 1);
+            problems += output_problems;
+            if (!output_problems)
+            {
+                if (rules.is_special && !((rules.allowed_output_registers >> output->regalloc) & 1))
+                    problems += _regalloc_verify_report(func, block, statement, "output is in a register the instruction can't write", output);
+                regs[output->regalloc] = output;
+            }
+        }
+    }
+    
+    return problems;
+}
+
+static void verify_regalloc(Program * program)
+{
+    size_t problems = 0;
+    for (size_t f = 0; f < array_len(program->functions, Function *); f++)
+    {
+        Function * func = program->functions[f];
+        for (size_t b = 0; b < array_len(func->blocks, Block *); b++)
+            problems += regalloc_verify_block(func, func->blocks[b]);
+    }
+    if (problems)
+        printf("regalloc verifier: %zu problems\n", problems);
+    assert(((void)"register allocation failed verification", problems == 0));
+}
+
+#endif // BBAE_REGALLOC_VERIFY
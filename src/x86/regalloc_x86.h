@@ -8,8 +8,10 @@
 #include <assert.h>
 
 #include "abi_x86.h"
+#include "isel_patterns_x86.h"
 #include "../memory.h"
 #include "../compiler_common.h"
+#include "../bbae_analysis.h"
 
 #define BBAE_REGISTER_CAPACITY (16)
 #ifdef BBAE_DEBUG_SPILLS
@@ -18,31 +20,80 @@
 #define BBAE_REGISTER_COUNT (16)
 #endif
 
-static int64_t first_empty(Value ** array, size_t len, uint64_t allow_mask, uint8_t does_calls, uint8_t is_float)
+// how a value relates to the calls in its block, for choosing between caller-saved and callee-saved registers
+enum {
+    CALLS_NOT_CROSSED, // wants a caller-saved register, which it's free to clobber
+    CALLS_CROSSED_RARELY, // spilling around the calls is cheaper than saving another callee-saved register
+    CALLS_CROSSED, // worth a callee-saved register of its own
+};
+
+// picks a free register out of allow_mask, in order of what it would cost given how the value crosses calls
+// callee-saved registers that the function already saves cost nothing extra, so they come first for any value that
+// lives across a call
+static int64_t first_empty(Function * func, Value ** array, size_t len, uint64_t allow_mask, uint8_t crossing, uint8_t is_float)
 {
-    // prefer non-callee-saved registers if the function we're in doesn't do any calls
-    if (!does_calls)
+    uint64_t clobber_mask = abi_get_clobber_mask();
+    uint64_t saved_mask = 0;
+    for (size_t i = 0; i < 32; i++)
     {
-        uint64_t clobber_mask = abi_get_clobber_mask();
-        if (is_float)
-            clobber_mask >>= 16;
-        
-        int64_t found = first_empty(array, len, allow_mask & clobber_mask, 1, is_float);
-        if (found >= 0)
-            return found;
+        if (func->written_registers[i] && !((clobber_mask >> i) & 1))
+            saved_mask |= (uint64_t)1 << i;
     }
-    int64_t found = -1;
-    for (size_t n = 0; n < len; n++)
+    if (is_float)
     {
-        if (!((allow_mask >> n) & 1))
-            continue;
-        if (!array[n])
+        clobber_mask >>= 16;
+        saved_mask >>= 16;
+    }
+    
+    uint64_t tiers[3] = {clobber_mask, saved_mask, ~(uint64_t)0};
+    if (crossing == CALLS_CROSSED_RARELY)
+    {
+        tiers[0] = saved_mask;
+        tiers[1] = clobber_mask;
+    }
+    else if (crossing == CALLS_CROSSED)
+    {
+        tiers[0] = saved_mask;
+        tiers[1] = ~clobber_mask;
+    }
+    
+    for (size_t t = 0; t < 3; t++)
+    {
+        for (size_t n = 0; n < len; n++)
         {
-            found = n;
-            break;
+            if (!((allow_mask >> n) & 1) || !((tiers[t] >> n) & 1))
+                continue;
+            if (!array[n])
+                return n;
         }
     }
-    return found;
+    return -1;
+}
+
+// whether the value lives across any calls from from_num up to its last use in the block, and how often
+static uint8_t value_call_crossing(Function * func, Block * block, Value * value, uint64_t from_num)
+{
+    uint64_t last_use = 0;
+    for (size_t i = 0; i < array_len(value->edges_out, Statement *); i++)
+    {
+        Statement * use = value->edges_out[i];
+        if (use->block == block && use->num > last_use)
+            last_use = use->num;
+    }
+    uint64_t crossed = 0;
+    for (size_t i = 0; i < array_len(block->statements, Statement *); i++)
+    {
+        Statement * statement = block->statements[i];
+        if (statement->num >= from_num && statement->num < last_use &&
+            (strcmp(statement->statement_name, "call") == 0 || strcmp(statement->statement_name, "call_eval") == 0))
+            crossed += 1;
+    }
+    if (!crossed)
+        return CALLS_NOT_CROSSED;
+    // a call clobbering the value costs a spill and a reload each time the block runs, while a new callee-saved
+    // register costs a save and a restore each time the function runs
+    uint64_t entry_weight = func->entry_block->weight ? func->entry_block->weight : 1;
+    return block->weight * crossed >= entry_weight ? CALLS_CROSSED : CALLS_CROSSED_RARELY;
 }
 
 // true if the type can be stored in an integer register
@@ -88,43 +139,26 @@ RegAllocRules regalloc_rule_determiner(Statement * statement)
     
     ret.allowed_output_registers = 0xFFFFFFFF;
     
-    if (strcmp(statement->statement_name, "div") == 0 ||
-        strcmp(statement->statement_name, "idiv") == 0)
-    {
-        ret.is_special = 1;
-        ret.allowed_output_registers = (1 << _ABI_RAX);
-        ret.clobbered_registers |= (1 << _ABI_RAX);
-        // x86 8-bit div/idiv puts remainder in AH (upper 8 bits of 16-bit AX) instead of DL (lower 8 bits of 16-bit DX)
-        if (statement->output->type.variant != TYPE_I8)
-            ret.clobbered_registers |= (1 << _ABI_RDX);
-    }
-    else if (strcmp(statement->statement_name, "rem") == 0 ||
-             strcmp(statement->statement_name, "irem") == 0)
+    const IselFixedPattern * fixed = isel_fixed_pattern_find(statement->statement_name);
+    if (fixed)
     {
-        ret.is_special = 1;
-        // x86 8-bit div/idiv puts remainder in AH (upper 8 bits of 16-bit AX) instead of DL (lower 8 bits of 16-bit DX)
-        if (statement->output->type.variant != TYPE_I8)
-        {
-            ret.allowed_output_registers = (1 << _ABI_RDX);
-            ret.clobbered_registers |= (1 << _ABI_RAX);
-            ret.clobbered_registers |= (1 << _ABI_RDX);
-        }
-        else
+        IselFixedRegs regs = isel_fixed_registers(fixed, type_size(statement->output->type));
+        if (regs.output >= 0)
         {
-            ret.allowed_output_registers = (1 << _ABI_RAX);
-            ret.clobbered_registers |= (1 << _ABI_RAX);
+            ret.is_special = 1;
+            ret.allowed_output_registers = (1 << regs.output);
+            ret.clobbered_registers |= regs.clobbers;
         }
     }
-    else if (strcmp(statement->statement_name, "shl") == 0 ||
-             strcmp(statement->statement_name, "shr") == 0 ||
-             strcmp(statement->statement_name, "sar") == 0 ||
-             strcmp(statement->statement_name, "shr_unsafe") == 0 ||
-             strcmp(statement->statement_name, "sar_unsafe") == 0)
+    else if (isel_pattern_find(statement) && (isel_pattern_find(statement)->flags & ISEL_SHIFT))
     {
-        if (statement->args[0].value->variant != VALUE_CONST)
+        // only shifts by a variable amount need CL, and BMI2 shifts don't need it at all
+        if (statement->args[1].value->variant != VALUE_CONST && !isel_uses_three_operand_form(statement))
         {
             ret.is_special = 1;
             ret.clobbered_registers |= (1 << _ABI_RCX);
+            // the shift amount gets moved into CL after the output is written
+            ret.allowed_output_registers &= ~(1 << _ABI_RCX);
         }
     }
     else if (strcmp(statement->statement_name, "call") == 0 ||
@@ -145,6 +179,66 @@ RegAllocRules regalloc_rule_determiner(Statement * statement)
     return ret;
 }
 
+// whether anything other than the given value has been in the given register between its definition and the
+// statement at index `until`. fast spills retroactively move values, so this must not be the case for them
+static uint8_t reg_taken_since_definition(Function * func, Block * block, Value * value, int64_t reg, size_t until)
+{
+    size_t start = 0;
+    if (value->variant == VALUE_SSA)
+    {
+        start = ptr_array_find(block->statements, value->ssa);
+        assert(start != (size_t)-1);
+    }
+    else
+    {
+        Value ** args = block == func->entry_block ? func->args : block->args;
+        for (size_t j = 0; j < array_len(args, Value *); j++)
+        {
+            if (args[j] != value && args[j]->regalloced && (int64_t)args[j]->regalloc == reg)
+                return 1;
+        }
+    }
+    for (size_t j = start; j <= until && j < array_len(block->statements, Statement *); j++)
+    {
+        Statement * statement = block->statements[j];
+        Value * output = statement->output;
+        if (output && output != value && output->regalloced && (int64_t)output->regalloc == reg)
+            return 1;
+        // values from before the definition that were still being used after it, and have died since
+        if (j == start)
+            continue;
+        for (size_t a = 0; a < array_len(statement->args, Operand); a++)
+        {
+            Value * arg = statement->args[a].value;
+            if (statement->args[a].variant == OP_KIND_VALUE && arg && arg != value && arg->variant != VALUE_CONST &&
+                arg->regalloced && (int64_t)arg->regalloc == reg)
+                return 1;
+        }
+    }
+    return 0;
+}
+
+// whether a statement can be repeated right before a later use instead of keeping its output around. this costs the
+// same as reloading a spill, but doesn't need the store
+static uint8_t statement_is_rematerializable(Statement * statement)
+{
+    if (strcmp(statement->statement_name, "symbol_lookup") == 0 ||
+        strcmp(statement->statement_name, "symbol_lookup_unsized") == 0)
+        return 1;
+    if (strcmp(statement->statement_name, "mov") == 0)
+    {
+        Value * value = statement->args[0].value;
+        return value && (value->variant == VALUE_CONST || value->variant == VALUE_STACKADDR);
+    }
+    // spill slots are only written once, so reloading from one again always gives the same value
+    if (strcmp(statement->statement_name, "load") == 0 && array_len(statement->args, Operand) == 2)
+    {
+        Value * address = statement->args[1].value;
+        return address && address->variant == VALUE_STACKADDR && address->slotinfo->is_spill;
+    }
+    return 0;
+}
+
 // returns statement pointer on non-fast spill
 // returns null on fast spill (regalloc changed, no instructions emitted) (yes this happens)
 static Statement * do_spill(Function * func, Block * block, Statement * on_behalf_of, Value ** reg_int_alloced, Value ** reg_float_alloced, Value * spillee, int64_t to_spill_reg, uint64_t to_spill_num, uint64_t allowed_mask, size_t * i)
@@ -166,20 +260,49 @@ static Statement * do_spill(Function * func, Block * block, Statement * on_behal
     assert((int64_t)spillee->regalloc >= 0);
     assert(!spillee->spilled);
     
+    // the spill goes right before on_behalf_of, so the registers of its operands aren't free yet, even if this is
+    // their last use
+    for (size_t j = 0; j < array_len(on_behalf_of->args, Operand); j++)
+    {
+        Value * arg = on_behalf_of->args[j].value;
+        if (arg && arg->variant != VALUE_CONST && arg->regalloced)
+            allowed_mask &= ~((uint64_t)1 << arg->regalloc);
+    }
+    
     // first use is after current statement
     int64_t temp = -1;
+    uint8_t crossing = value_call_crossing(func, block, spillee, on_behalf_of->num);
     if (spillee->regalloc <= _ABI_R15)
-        temp = first_empty(reg_int_alloced, BBAE_REGISTER_COUNT, allowed_mask, func->performs_calls, 0);
+        temp = first_empty(func, reg_int_alloced, BBAE_REGISTER_COUNT, allowed_mask, crossing, 0);
     else
     {
-        temp = first_empty(reg_float_alloced, BBAE_REGISTER_COUNT, allowed_mask >> 16, func->performs_calls, 1);
+        temp = first_empty(func, reg_float_alloced, BBAE_REGISTER_COUNT, allowed_mask >> 16, crossing, 1);
         if (temp >= 0)
             temp += _ABI_XMM0;
     }
+    // moving into the register that function-wide allocation picked saves a move when the value is passed on
+    if (temp >= 0 && spillee->regalloc_hinted && ((allowed_mask >> spillee->regalloc_hint) & 1))
+    {
+        int64_t hint = spillee->regalloc_hint;
+        if ((hint >= _ABI_XMM0) == (temp >= _ABI_XMM0) &&
+            !(hint >= _ABI_XMM0 ? reg_float_alloced[hint - _ABI_XMM0] : reg_int_alloced[hint]))
+            temp = hint;
+    }
+    
+    uint8_t rematerializable = spillee->variant == VALUE_SSA && statement_is_rematerializable(spillee->ssa);
     
     if (temp >= 0)
     {
-        if (array_len(spillee->edges_out, Statement *) > 0 && spillee->edges_out[0]->num > block->statements[*i]->num)
+        // fast spills retroactively change which register the value was defined in, which only works if its
+        // definition can write to that register
+        uint8_t definition_allows_temp = 1;
+        if (spillee->variant == VALUE_SSA)
+        {
+            RegAllocRules def_rules = regalloc_rule_determiner(spillee->ssa);
+            definition_allows_temp = !def_rules.is_special || ((def_rules.allowed_output_registers >> temp) & 1);
+        }
+        if (array_len(spillee->edges_out, Statement *) > 0 && spillee->edges_out[0]->num > block->statements[*i]->num &&
+            definition_allows_temp && !reg_taken_since_definition(func, block, spillee, temp, *i))
         {
             // FIXME
             //if (!spillee->arg)
@@ -196,7 +319,7 @@ static Statement * do_spill(Function * func, Block * block, Statement * on_behal
             //else
             //    printf("can't fast-spill %s because it's an arg\n", spillee->arg);
         }
-        else
+        else if (!rematerializable)
         {
             //printf("can't fast-spill %s because it has earlier users\n", spillee->arg ? spillee->arg : spillee->ssa->output_name);
             // FIXME: support MOV-spilling. needs to rewrite other descendants.
@@ -209,6 +332,8 @@ static Statement * do_spill(Function * func, Block * block, Statement * on_behal
             spill->output->regalloced = 1;
             spill->output->regalloc = temp;
             spill->output->ssa = spill;
+            spill->output->regalloc_hinted = spillee->regalloc_hinted;
+            spill->output->regalloc_hint = spillee->regalloc_hint;
             
             if (temp >= _ABI_XMM0)
                 reg_float_alloced[temp - _ABI_XMM0] = spill->output;
@@ -243,8 +368,55 @@ static Statement * do_spill(Function * func, Block * block, Statement * on_behal
     //else
     //    printf("can't fast-spill %s because a suitable register was not found. allowed mask: %08zX\n", spillee->arg ? spillee->arg : spillee->ssa->output_name, allowed_mask);
     
+    // redo the definition right before the next use, leaving the register free in between
+    if (rematerializable)
+    {
+        Statement * remat = 0;
+        for (size_t j = 0; j < array_len(spillee->edges_out, Statement *); j++)
+        {
+            Statement * st = spillee->edges_out[j];
+            if (st->num < to_spill_num)
+                continue;
+            if (!remat)
+            {
+                ptrdiff_t inst_index = ptr_array_find(block->statements, st);
+                assert(inst_index > (ptrdiff_t)*i);
+                
+                remat = new_statement();
+                remat->output_name = make_temp_name();
+                remat->statement_name = strcpy_z(spillee->ssa->statement_name);
+                remat->output = make_value(spillee->type);
+                remat->output->variant = VALUE_SSA;
+                remat->output->ssa = remat;
+                remat->output->regalloc_hinted = spillee->regalloc_hinted;
+                remat->output->regalloc_hint = spillee->regalloc_hint;
+                remat->num = st->num - 1;
+                remat->block = block;
+                for (size_t a = 0; a < array_len(spillee->ssa->args, Operand); a++)
+                {
+                    Operand op = spillee->ssa->args[a];
+                    array_push(remat->args, Operand, op);
+                    if (op.variant == OP_KIND_VALUE && op.value && op.value->variant != VALUE_CONST)
+                        connect_statement_to_operand(remat, op);
+                }
+                array_insert(block->statements, Statement *, inst_index, remat);
+            }
+            
+            Operand temp_op = new_op_val(spillee);
+            ptrdiff_t in_arg_index = array_find(st->args, Operand, temp_op);
+            assert(in_arg_index > -1);
+            st->args[in_arg_index] = new_op_val(remat->output);
+            
+            array_push(remat->output->edges_out, Statement *, st);
+            array_erase(spillee->edges_out, Statement *, j);
+            j -= 1;
+        }
+        return remat;
+    }
+    
     // spill statements don't need to be numbered because they're never an outward edge of an SSA value
     Value * spill_slot = add_stack_slot(func, make_temp_name(), type_size(spillee->type));
+    spill_slot->slotinfo->is_spill = 1;
     spillee->spilled = spill_slot->slotinfo;
     
     Statement * spill = new_statement();
@@ -281,6 +453,8 @@ static Statement * do_spill(Function * func, Block * block, Statement * on_behal
                 unspill->output = make_value(spillee->type);
                 unspill->output->variant = VALUE_SSA;
                 unspill->output->ssa = unspill;
+                unspill->output->regalloc_hinted = spillee->regalloc_hinted;
+                unspill->output->regalloc_hint = spillee->regalloc_hint;
                 unspill->num = st->num - 1;
                 
                 Operand op1 = new_op_type(spillee->type);
@@ -412,7 +586,16 @@ static void regalloc_block_args(Function * func, Block * block, Value ** reg_int
         int64_t where = 0;
         uint8_t where_found = 0;
         
-        for (size_t j = 0; j < array_len(block->edges_in, Statement *); j++)
+        if (value->regalloc_hinted)
+        {
+            where = value->regalloc_hint;
+            if (where >= _ABI_XMM0)
+                where_found = !reg_float_alloced[where - _ABI_XMM0];
+            else
+                where_found = !reg_int_alloced[where];
+        }
+        
+        for (size_t j = 0; !where_found && j < array_len(block->edges_in, Statement *); j++)
         {
             Statement * entry = block->edges_in[j];
             if (strcmp(entry->statement_name, "goto") == 0)
@@ -463,11 +646,12 @@ static void regalloc_block_args(Function * func, Block * block, Value ** reg_int
         
         if (!where_found)
         {
+            uint8_t crossing = value_call_crossing(func, block, value, 0);
             if (type_is_intreg(value->type))
-                where = first_empty(reg_int_alloced, BBAE_REGISTER_COUNT, 0xFFFF, func->performs_calls, 0);
+                where = first_empty(func, reg_int_alloced, BBAE_REGISTER_COUNT, 0xFFFF, crossing, 0);
             else if (type_is_float(value->type))
             {
-                where = first_empty(reg_float_alloced, BBAE_REGISTER_COUNT, 0xFFFF, func->performs_calls, 1);
+                where = first_empty(func, reg_float_alloced, BBAE_REGISTER_COUNT, 0xFFFF, crossing, 1);
                 if (where >= 0)
                     where += _ABI_XMM0;
             }
@@ -488,52 +672,47 @@ static void regalloc_block_args(Function * func, Block * block, Value ** reg_int
     }
 }
 
-static void expire_unused_regs(Value ** reg_int_alloced, Value ** reg_float_alloced)
+// frees the register of a value once every use of it has been allocated
+static void expire_value_reg(Value ** reg_int_alloced, Value ** reg_float_alloced, Value * value)
 {
 #ifndef BBAE_DEBUG_SPILLS
-    for (size_t n = 0; n < BBAE_REGISTER_COUNT; n++)
-    {
-        if (reg_int_alloced[n] && reg_int_alloced[n] != (Value *)-1)
-        {
-            Value * value = reg_int_alloced[n];
-            assert(value->alloced_use_count <= array_len(value->edges_out, Value *));
-            if (value->alloced_use_count == array_len(value->edges_out, Value *))
-            {
-                //printf("freeing int register %zu... %zu vs %zu\n", n, value->alloced_use_count, array_len(value->edges_out, Value *));
-                reg_int_alloced[n] = 0;
-            }
-        }
-        if (reg_float_alloced[n] && reg_float_alloced[n] != (Value *)-1)
-        {
-            Value * value = reg_float_alloced[n];
-            assert(value->alloced_use_count <= array_len(value->edges_out, Value *));
-            if (value->alloced_use_count == array_len(value->edges_out, Value *))
-            {
-                //printf("freeing float register %zu...\n", n);
-                reg_float_alloced[n] = 0;
-            }
-        }
-    }
+    if (!value || value->variant == VALUE_CONST || !value->regalloced || value->regalloc >= 32)
+        return;
+    assert(value->alloced_use_count <= array_len(value->edges_out, Value *));
+    if (value->alloced_use_count != array_len(value->edges_out, Value *))
+        return;
+    Value ** slot = value->regalloc >= _ABI_XMM0 ? &reg_float_alloced[value->regalloc - _ABI_XMM0] : &reg_int_alloced[value->regalloc];
+    if (*slot == value)
+        *slot = 0;
 #endif // BBAE_DEBUG_SPILLS
 }
 
-static uint8_t is_statement_commutative(Statement * statement)
+// values only stop being used when a statement uses them for the last time, so only its operands need checking,
+// plus its output in case nothing uses it at all
+static void expire_statement_regs(Value ** reg_int_alloced, Value ** reg_float_alloced, Statement * statement)
 {
-    if (strcmp(statement->statement_name, "add") == 0 ||
-        strcmp(statement->statement_name, "mul") == 0 ||
-        strcmp(statement->statement_name, "imul") == 0 ||
-        strcmp(statement->statement_name, "fadd") == 0 ||
-        strcmp(statement->statement_name, "fmul") == 0)
+    for (size_t j = 0; j < array_len(statement->args, Operand); j++)
     {
-        return 1;
+        if (statement->args[j].variant == OP_KIND_VALUE)
+            expire_value_reg(reg_int_alloced, reg_float_alloced, statement->args[j].value);
     }
-    return 0;
+    expire_value_reg(reg_int_alloced, reg_float_alloced, statement->output);
+}
+
+static uint8_t is_statement_commutative(Statement * statement)
+{
+    const IselPattern * pattern = isel_pattern_find(statement);
+    // b is a memory operand once a load has been folded into it
+    return pattern && (pattern->flags & ISEL_COMMUTATIVE) && !isel_statement_reads_memory(statement);
 }
 
 static uint8_t statement_ops_live_until_after_statement(Statement * statement)
 {
     if (strcmp(statement->statement_name, "call_eval") == 0)
         return 0;
+    // every operand is read before the output is written
+    if (isel_uses_three_operand_form(statement))
+        return 0;
     return 1;
 }
 
@@ -569,12 +748,19 @@ static void increment_operand_uses_impl(Statement * statement, size_t start, siz
     }
 }
 
+// conversions and loads have a type as their first operand, so their first value operand comes after it
+static size_t statement_first_value_operand(Statement * statement)
+{
+    return array_len(statement->args, Operand) > 0 && statement->args[0].variant == OP_KIND_TYPE;
+}
+
 static void increment_operand_uses_early(Statement * statement)
 {
     if (statement_ops_live_until_after_statement(statement))
     {
-        if (array_len(statement->args, Operand) > 0)
-            increment_operand_uses_impl(statement, 0, 1);
+        size_t first_value = statement_first_value_operand(statement);
+        if (array_len(statement->args, Operand) > first_value)
+            increment_operand_uses_impl(statement, 0, first_value + 1);
     }
     else
         increment_operand_uses_impl(statement, 0, array_len(statement->args, Operand));
@@ -583,7 +769,11 @@ static void increment_operand_uses_early(Statement * statement)
 static void increment_operand_uses_late(Statement * statement)
 {
     if (statement_ops_live_until_after_statement(statement))
-        increment_operand_uses_impl(statement, 1, array_len(statement->args, Operand));
+    {
+        size_t first_value = statement_first_value_operand(statement);
+        if (array_len(statement->args, Operand) > first_value)
+            increment_operand_uses_impl(statement, first_value + 1, array_len(statement->args, Operand));
+    }
 }
 
 static void do_regalloc_block(Function * func, Block * block)
@@ -598,6 +788,10 @@ static void do_regalloc_block(Function * func, Block * block)
     memset(reg_float_alloced, 0, BBAE_REGISTER_CAPACITY * sizeof(Value *));
     reg_float_alloced[_ABI_XMM5 - _ABI_XMM0] = (Value *)-1; // universal scratch register XMM5
     
+    // give statements numbers for spill heuristic and call crossing checks
+    for (size_t i = 0; i < array_len(block->statements, Statement *); i++)
+        block->statements[i]->num = i << 1;
+    
     if (block == func->entry_block)
     {
         // allocate function arguments
@@ -609,10 +803,20 @@ static void do_regalloc_block(Function * func, Block * block)
         regalloc_block_args(func, block, reg_int_alloced, reg_float_alloced);
     }
     
-    // give statements numbers for spill heuristic
+    uint64_t hinted_mask = 0;
     for (size_t i = 0; i < array_len(block->statements, Statement *); i++)
-        block->statements[i]->num = i << 1;
+    {
+        Value * output = block->statements[i]->output;
+        if (output && output->regalloc_hinted)
+            hinted_mask |= (uint64_t)1 << output->regalloc_hint;
+    }
+    
+    // arguments that nothing uses don't need their registers past the start of the block
+    Value ** args = block == func->entry_block ? func->args : block->args;
+    for (size_t i = 0; i < array_len(args, Value *); i++)
+        expire_value_reg(reg_int_alloced, reg_float_alloced, args[i]);
     
+    Statement * previous = 0;
     for (size_t i = 0; i < array_len(block->statements, Statement *); i++)
     {
         Statement * statement = block->statements[i];
@@ -620,12 +824,18 @@ static void do_regalloc_block(Function * func, Block * block)
         // tick the usage count of the statement's operands
         increment_operand_uses_early(statement);
         
-        // free no-longer-used registers, except for reserved ones (RSP, RBP, R11, XMM5)
-        expire_unused_regs(reg_int_alloced, reg_float_alloced);
+        // free registers whose values were just used for the last time, either here or late in the last statement
+        expire_statement_regs(reg_int_alloced, reg_float_alloced, statement);
+        if (previous)
+            expire_statement_regs(reg_int_alloced, reg_float_alloced, previous);
+        previous = statement;
         
         // skip this statement if it doesn't have an output to allocate
         if (!statement->output)
+        {
+            increment_operand_uses_late(statement);
             continue;
+        }
         //printf("--- regallocing statement %zu out of %zu (output name: %s)\n", i, array_len(block->statements, Statement *), statement->output_name);
         
         assert(!statement->output->regalloced);
@@ -642,10 +852,26 @@ static void do_regalloc_block(Function * func, Block * block)
         uint64_t allow_mask = is_special ? rules.allowed_output_registers : 0xFFFFFFFF;
         //printf("our mask: %zX\n", allow_mask);
         
+        size_t first_value = statement_first_value_operand(statement);
+        
+        // use the register that function-wide allocation picked, if it's free
+        if (statement->output->regalloc_hinted && ((allow_mask >> statement->output->regalloc_hint) & 1))
+        {
+            int64_t where = statement->output->regalloc_hint;
+            Value ** slot = where >= _ABI_XMM0 ? &reg_float_alloced[where - _ABI_XMM0] : &reg_int_alloced[where];
+            if (!*slot)
+            {
+                *slot = statement->output;
+                statement->output->regalloc = where;
+                statement->output->regalloced = 1;
+                goto early_continue;
+            }
+        }
+        
         // reuse an operand register if possible
-        for (size_t j = 0; j < array_len(statement->args, Operand); j++)
+        for (size_t j = first_value; j < array_len(statement->args, Operand); j++)
         {
-            if (j > 0 && !op_is_commutative)
+            if (j > first_value && !op_is_commutative && !isel_uses_three_operand_form(statement))
                 break;
             
             Value * arg = statement->args[j].value;
@@ -679,9 +905,16 @@ static void do_regalloc_block(Function * func, Block * block)
             continue;
         }
         
-        int64_t where;
+        // stay out of registers that are hinted for other values in this block, unless there's no other choice
+        int64_t where = -1;
+        uint8_t crossing = value_call_crossing(func, block, statement->output, statement->num + 1);
         if (is_int)
-            where = first_empty(reg_int_alloced, BBAE_REGISTER_COUNT, allow_mask, func->performs_calls, 0);
+        {
+            if (hinted_mask)
+                where = first_empty(func, reg_int_alloced, BBAE_REGISTER_COUNT, allow_mask & ~hinted_mask, crossing, 0);
+            if (where < 0)
+                where = first_empty(func, reg_int_alloced, BBAE_REGISTER_COUNT, allow_mask, crossing, 0);
+        }
         else
         {
             //puts("looking for float register...");
@@ -695,7 +928,10 @@ static void do_regalloc_block(Function * func, Block * block)
                 //Statement * s = v->ssa;
                 //printf("first... %s, %zu, %zu\n", s->output_name, array_len(v->edges_out, Statement *), v->alloced_use_count);
             }
-            where = first_empty(reg_float_alloced, BBAE_REGISTER_COUNT, allow_mask >> 16, func->performs_calls, 1);
+            if (hinted_mask)
+                where = first_empty(func, reg_float_alloced, BBAE_REGISTER_COUNT, (allow_mask & ~hinted_mask) >> 16, crossing, 1);
+            if (where < 0)
+                where = first_empty(func, reg_float_alloced, BBAE_REGISTER_COUNT, allow_mask >> 16, crossing, 1);
             if (where >= 0)
                 where += _ABI_XMM0;
         }
@@ -760,7 +996,7 @@ static void do_regalloc_block(Function * func, Block * block)
         
         // tick the usage count of the statement's operands
         increment_operand_uses_late(statement);
-            
+        
         // spill clobbered registers
         if (is_special && rules.clobbered_registers)
         {
@@ -818,6 +1054,325 @@ static void do_regalloc_block(Function * func, Block * block)
     }
 }
 
+#ifndef BBAE_REGALLOC_LOCAL
+// function-wide register assignment
+// values only cross block boundaries by being passed as block arguments, so the function-wide part of register
+// allocation is deciding which register each block argument and each value passed into one should live in.
+// each of these values has a live interval within its block, and they get coalesced into chains along the edges that
+// pass them, heaviest edges first (by estimated execution count, so loop back edges win), as long as no two values in a
+// chain would be live at the same time. chains are then given registers, heaviest first. a chain that is live across a
+// call, a division, or anything else that clobbers registers avoids those registers, which splits it away from
+// caller-saved registers around calls instead of spilling it there. the per-block allocator treats the result as hints
+// and falls back to its own choices (and spilling) when a hinted register is taken, so high-pressure regions still get
+// split at statement granularity. define BBAE_REGALLOC_LOCAL to allocate each block completely on its own instead.
+
+typedef struct _RegHintNode {
+    Value * value;
+    size_t block;
+    // live interval within the block. block arguments start at 0, statements are numbered from 1
+    uint64_t start;
+    uint64_t end;
+    uint64_t forbidden; // registers clobbered somewhere inside the live interval
+    int64_t precolor; // ABI register if this is a function argument, -1 otherwise
+    // chain bookkeeping. the fields below are only meaningful on the chain's root node
+    size_t parent;
+    uint64_t weight; // estimated number of edge moves saved by keeping the chain in one register
+    size_t * neighbors; // nodes that are live at the same time as some node in the chain
+    int64_t reg;
+} RegHintNode;
+
+typedef struct _RegHintOrder {
+    uint64_t weight;
+    size_t index;
+    size_t from;
+    size_t to;
+} RegHintOrder;
+
+static int _reg_hint_order_compare(const void * a, const void * b)
+{
+    const RegHintOrder * x = (const RegHintOrder *)a;
+    const RegHintOrder * y = (const RegHintOrder *)b;
+    if (x->weight != y->weight)
+        return x->weight < y->weight ? 1 : -1;
+    return x->index < y->index ? -1 : x->index > y->index;
+}
+
+static size_t _reg_hint_find(RegHintNode * nodes, size_t n)
+{
+    while (nodes[n].parent != n)
+    {
+        nodes[n].parent = nodes[nodes[n].parent].parent;
+        n = nodes[n].parent;
+    }
+    return n;
+}
+
+static void _reg_hint_add_node(RegHintNode ** nodes, Value * value, size_t block, uint64_t start)
+{
+    if (value->temp)
+        return;
+    RegHintNode node;
+    memset(&node, 0, sizeof(RegHintNode));
+    node.value = value;
+    node.block = block;
+    node.start = start;
+    node.end = start;
+    size_t use_count = array_len(value->edges_out, Statement *);
+    if (use_count > 0)
+        node.end = value->edges_out[use_count - 1]->num;
+    node.precolor = -1;
+    node.parent = array_len(*nodes, RegHintNode);
+    node.neighbors = (size_t *)zero_alloc(0);
+    node.reg = -1;
+    array_push(*nodes, RegHintNode, node);
+    value->temp = array_len(*nodes, RegHintNode);
+}
+
+// expects block weights to already be estimated
+static void regalloc_assign_hints(Function * func)
+{
+    size_t block_count = array_len(func->blocks, Block *);
+    
+    for (size_t b = 0; b < block_count; b++)
+    {
+        Block * block = func->blocks[b];
+        Value ** args = block == func->entry_block ? func->args : block->args;
+        for (size_t i = 0; i < array_len(args, Value *); i++)
+        {
+            args[i]->temp = 0;
+            args[i]->regalloc_hinted = 0;
+        }
+        for (size_t i = 0; i < array_len(block->statements, Statement *); i++)
+        {
+            Statement * statement = block->statements[i];
+            statement->num = i + 1;
+            if (statement->output)
+            {
+                statement->output->temp = 0;
+                statement->output->regalloc_hinted = 0;
+            }
+        }
+    }
+    
+    // nodes are arguments and everything passed to a block argument. a value's temp field is its node index plus one
+    RegHintNode * nodes = (RegHintNode *)zero_alloc(0);
+    abi_reset_state();
+    for (size_t i = 0; i < array_len(func->args, Value *); i++)
+    {
+        Value * value = func->args[i];
+        int64_t where = abi_get_next_arg_basic(type_is_float(value->type));
+        _reg_hint_add_node(&nodes, value, 0, 0);
+        nodes[value->temp - 1].precolor = where;
+    }
+    for (size_t b = 0; b < block_count; b++)
+    {
+        Block * block = func->blocks[b];
+        if (block == func->entry_block)
+            continue;
+        for (size_t i = 0; i < array_len(block->args, Value *); i++)
+            _reg_hint_add_node(&nodes, block->args[i], b, 0);
+    }
+    
+    RegHintOrder * copies = (RegHintOrder *)zero_alloc(0);
+    for (size_t b = 0; b < block_count; b++)
+    {
+        Block * block = func->blocks[b];
+        size_t statement_count = array_len(block->statements, Statement *);
+        if (statement_count == 0)
+            continue;
+        Statement * exit = block->statements[statement_count - 1];
+        for (size_t side = 0; side < 2; side++)
+        {
+            Operand * args = 0;
+            size_t count = 0;
+            const char * target_name = 0;
+            if (side == 0 && strcmp(exit->statement_name, "goto") == 0)
+            {
+                target_name = exit->args[0].text;
+                args = exit->args + 1;
+                count = array_len(exit->args, Operand) - 1;
+            }
+            else if (strcmp(exit->statement_name, "if") == 0)
+            {
+                size_t separator_pos = find_separator_index(exit->args);
+                assert(separator_pos);
+                if (side == 0)
+                {
+                    target_name = exit->args[1].text;
+                    args = exit->args + 2;
+                    count = separator_pos - 2;
+                }
+                else
+                {
+                    target_name = exit->args[separator_pos + 1].text;
+                    args = exit->args + separator_pos + 2;
+                    count = array_len(exit->args, Operand) - separator_pos - 2;
+                }
+            }
+            if (!target_name)
+                continue;
+            Block * target = find_block(func, target_name);
+            assert(array_len(target->args, Value *) == count);
+            for (size_t i = 0; i < count; i++)
+            {
+                Value * value = args[i].value;
+                if (!value || (value->variant != VALUE_SSA && value->variant != VALUE_ARG))
+                    continue;
+                // SSA values are block-local, so anything passed out of a block was defined in it
+                if (value->variant == VALUE_SSA)
+                    _reg_hint_add_node(&nodes, value, b, value->ssa->num);
+                
+                RegHintOrder copy;
+                copy.weight = block->weight ? block->weight : 1;
+                copy.index = array_len(copies, RegHintOrder);
+                copy.from = value->temp - 1;
+                copy.to = target->args[i]->temp - 1;
+                array_push(copies, RegHintOrder, copy);
+            }
+        }
+    }
+    size_t node_count = array_len(nodes, RegHintNode);
+    
+    // find what gets clobbered inside of each live interval, and which intervals overlap
+    size_t ** nodes_in_block = (size_t **)zero_alloc(sizeof(size_t *) * block_count);
+    for (size_t b = 0; b < block_count; b++)
+        nodes_in_block[b] = (size_t *)zero_alloc(0);
+    for (size_t n = 0; n < node_count; n++)
+    {
+        RegHintNode * node = &nodes[n];
+        Block * block = func->blocks[node->block];
+        for (uint64_t j = node->start + 1; j < node->end; j++)
+        {
+            Statement * statement = block->statements[j - 1];
+            if (!statement->output)
+                continue;
+            RegAllocRules rules = regalloc_rule_determiner(statement);
+            if (rules.is_special)
+                node->forbidden |= rules.clobbered_registers;
+        }
+        
+        uint8_t is_int = type_is_intreg(node->value->type);
+        for (size_t i = 0; i < array_len(nodes_in_block[node->block], size_t); i++)
+        {
+            size_t m = nodes_in_block[node->block][i];
+            RegHintNode * other = &nodes[m];
+            if (is_int == type_is_intreg(other->value->type) && node->start < other->end && other->start < node->end)
+            {
+                array_push(node->neighbors, size_t, m);
+                array_push(other->neighbors, size_t, n);
+            }
+        }
+        array_push(nodes_in_block[node->block], size_t, n);
+    }
+    
+    // coalesce along edges, heaviest first, without letting interfering values share a chain
+    qsort(copies, array_len(copies, RegHintOrder), sizeof(RegHintOrder), _reg_hint_order_compare);
+    for (size_t c = 0; c < array_len(copies, RegHintOrder); c++)
+    {
+        size_t a = _reg_hint_find(nodes, copies[c].from);
+        size_t b = _reg_hint_find(nodes, copies[c].to);
+        if (a == b)
+        {
+            nodes[a].weight += copies[c].weight;
+            continue;
+        }
+        uint8_t interferes = 0;
+        for (size_t i = 0; !interferes && i < array_len(nodes[a].neighbors, size_t); i++)
+            interferes = _reg_hint_find(nodes, nodes[a].neighbors[i]) == b;
+        if (interferes)
+            continue;
+        // a chain that can't use its precolor (e.g. an argument that lives across calls on only one path) would drag
+        // every other path out of the argument's register too
+        if ((nodes[a].precolor >= 0 && ((nodes[b].forbidden >> nodes[a].precolor) & 1)) ||
+            (nodes[b].precolor >= 0 && ((nodes[a].forbidden >> nodes[b].precolor) & 1)))
+            continue;
+        
+        nodes[a].parent = b;
+        nodes[b].weight += nodes[a].weight + copies[c].weight;
+        nodes[b].forbidden |= nodes[a].forbidden;
+        if (nodes[b].precolor < 0)
+            nodes[b].precolor = nodes[a].precolor;
+        for (size_t i = 0; i < array_len(nodes[a].neighbors, size_t); i++)
+            array_push(nodes[b].neighbors, size_t, nodes[a].neighbors[i]);
+    }
+    
+    // give registers to the heaviest chains first
+    RegHintOrder * chains = (RegHintOrder *)zero_alloc(0);
+    for (size_t n = 0; n < node_count; n++)
+    {
+        if (nodes[n].parent != n || nodes[n].weight == 0)
+            continue;
+        RegHintOrder chain;
+        memset(&chain, 0, sizeof(RegHintOrder));
+        chain.weight = nodes[n].weight;
+        chain.index = n;
+        array_push(chains, RegHintOrder, chain);
+    }
+    qsort(chains, array_len(chains, RegHintOrder), sizeof(RegHintOrder), _reg_hint_order_compare);
+    
+    // same reservations as in do_regalloc_block
+    uint64_t usable = 0;
+    for (size_t n = 0; n < BBAE_REGISTER_COUNT; n++)
+        usable |= (uint64_t)1 << n;
+    uint64_t usable_float = (usable << 16) & ~((uint64_t)1 << _ABI_XMM5);
+    usable &= ~(((uint64_t)1 << _ABI_RSP) | ((uint64_t)1 << _ABI_RBP) | ((uint64_t)1 << _ABI_R11));
+    uint64_t clobber_mask = abi_get_clobber_mask();
+    
+    for (size_t c = 0; c < array_len(chains, RegHintOrder); c++)
+    {
+        RegHintNode * root = &nodes[chains[c].index];
+        uint64_t mask = type_is_intreg(root->value->type) ? usable : usable_float;
+        mask &= ~root->forbidden;
+        for (size_t i = 0; i < array_len(root->neighbors, size_t); i++)
+        {
+            int64_t taken = nodes[_reg_hint_find(nodes, root->neighbors[i])].reg;
+            if (taken >= 0)
+                mask &= ~((uint64_t)1 << taken);
+        }
+        
+        // callee-saved registers cost a save and restore, so only use them when needed
+        if (root->precolor >= 0 && ((mask >> root->precolor) & 1))
+            root->reg = root->precolor;
+        else
+        {
+            uint64_t pick = (mask & clobber_mask) ? (mask & clobber_mask) : mask;
+            for (int64_t n = 0; n < 32 && root->reg < 0; n++)
+            {
+                if ((pick >> n) & 1)
+                    root->reg = n;
+            }
+        }
+    }
+    
+    for (size_t n = 0; n < node_count; n++)
+    {
+        int64_t reg = nodes[_reg_hint_find(nodes, n)].reg;
+        if (reg < 0)
+            continue;
+        nodes[n].value->regalloc_hinted = 1;
+        nodes[n].value->regalloc_hint = reg;
+    }
+    
+    // values that couldn't join the chain on the other side of an edge still prefer its register. they interfere with
+    // something in it, so this only pays off if that's dead by the time they're defined, e.g. when they get reloaded
+    for (size_t c = 0; c < array_len(copies, RegHintOrder); c++)
+    {
+        Value * from = nodes[copies[c].from].value;
+        Value * to = nodes[copies[c].to].value;
+        if (!from->regalloc_hinted && to->regalloc_hinted)
+        {
+            from->regalloc_hinted = 1;
+            from->regalloc_hint = to->regalloc_hint;
+        }
+        else if (from->regalloc_hinted && !to->regalloc_hinted)
+        {
+            to->regalloc_hinted = 1;
+            to->regalloc_hint = from->regalloc_hint;
+        }
+    }
+}
+#endif // BBAE_REGALLOC_LOCAL
+
 static void do_regalloc(Program * program)
 {
     _______asdf = program;
@@ -825,11 +1380,33 @@ static void do_regalloc(Program * program)
     {
         Function * func = program->functions[f];
         //puts("---!!!    regallocing another function");
+        func_estimate_block_weights(func);
+#ifndef BBAE_REGALLOC_LOCAL
+        regalloc_assign_hints(func);
+        // allocate predecessors before successors where possible, so block arguments can pick up the registers of
+        // what gets passed into them when they have no hint. unreachable blocks go last
+        Block ** order = func_reverse_postorder(func);
+        uint8_t * ordered = (uint8_t *)zero_alloc(array_len(func->blocks, Block *));
+        for (size_t b = 0; b < array_len(order, Block *); b++)
+            ordered[order[b]->temp] = 1;
         for (size_t b = 0; b < array_len(func->blocks, Block *); b++)
         {
-            Block * block = func->blocks[b];
+            if (!ordered[b])
+                array_push(order, Block *, func->blocks[b]);
+        }
+#else
+        Block ** order = func->blocks;
+#endif // BBAE_REGALLOC_LOCAL
+        for (size_t b = 0; b < array_len(order, Block *); b++)
+        {
+            Block * block = order[b];
             do_regalloc_block(func, block);
             // FIXME
+            for (size_t i = 0; i < array_len(block->args, Value *); i++)
+            {
+                assert(block->args[i]->regalloced);
+                func->written_registers[block->args[i]->regalloc] = 1;
+            }
             for (size_t i = 0; i < array_len(block->statements, Statement *); i++)
             {
                 Value * output = block->statements[i]->output;
@@ -847,22 +1424,24 @@ static ImmOpsAllowed imm_op_rule_determiner(Statement * statement)
 {
     ImmOpsAllowed ret;
     memset(&ret, 1, sizeof(ImmOpsAllowed));
-    if (strcmp(statement->statement_name, "add") == 0 ||
-        strcmp(statement->statement_name, "sub") == 0)
+    const IselPattern * pattern = isel_pattern_find(statement);
+    if (pattern)
+    {
+        ret.immediates_allowed[0] = !!(pattern->flags & ISEL_IMM_A);
+        ret.immediates_allowed[1] = !!(pattern->flags & ISEL_IMM_B);
+    }
+    else if (isel_fixed_pattern_find(statement->statement_name))
+    {
+        const IselFixedPattern * fixed = isel_fixed_pattern_find(statement->statement_name);
+        ret.immediates_allowed[0] = !!(fixed->flags & ISEL_IMM_A);
+        ret.immediates_allowed[1] = !!(fixed->flags & ISEL_IMM_B);
+    }
+    else if (str_begins_with(statement->statement_name, "cmp_") ||
+             str_begins_with(statement->statement_name, "icmp_"))
     {
         ret.immediates_allowed[0] = 0;
     }
-    else if (strcmp(statement->statement_name, "fadd") == 0 ||
-        strcmp(statement->statement_name, "mul") == 0 ||
-        strcmp(statement->statement_name, "imul") == 0 ||
-        strcmp(statement->statement_name, "div") == 0 ||
-        strcmp(statement->statement_name, "idiv") == 0 ||
-        strcmp(statement->statement_name, "rem") == 0 ||
-        strcmp(statement->statement_name, "irem") == 0 ||
-        strcmp(statement->statement_name, "fsub") == 0 ||
-        strcmp(statement->statement_name, "fmul") == 0 ||
-        strcmp(statement->statement_name, "fxor") == 0 ||
-        strcmp(statement->statement_name, "fdiv") == 0)
+    else if (str_begins_with(statement->statement_name, "fcmp_"))
     {
         ret.immediates_allowed[0] = 0;
         ret.immediates_allowed[1] = 0;
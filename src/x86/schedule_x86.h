@@ -0,0 +1,366 @@
+#ifndef BBAE_SCHEDULE
+#define BBAE_SCHEDULE
+
+// Pre-regalloc list scheduler. Reorders the statements within each block so that long-latency operations (division,
+// loads, multiplication, float math) get started as early as their operands allow, instead of right before their
+// results are needed.
+// - statements only move after everything they use
+// - loads don't move across stores that might write to what they read, and stores and other output-less statements
+//   stay in order
+// - nothing moves across calls, so that values don't need to be kept alive across them
+// - the terminator stays last, and so does the statement right before an `if`, which is usually the comparison it
+//   branches on; emission can only branch on the flags directly if nothing in between overwrites them
+// - while too many values are live, statements that don't add to the number of live values are preferred
+
+#include "isel_patterns_x86.h"
+#include "../compiler_common.h"
+#include "../bbae_analysis.h"
+
+// above this many live values of one register class, the scheduler tries not to make more of them live
+#define SCHEDULE_MAX_LIVE_INT 12
+#define SCHEDULE_MAX_LIVE_FLOAT 14
+
+// rough result latencies in cycles, for a generic modern x86-64 core
+static uint64_t schedule_latency(Statement * statement)
+{
+    const char * name = statement->statement_name;
+    if (strcmp(name, "load") == 0)
+        return 5;
+    if (isel_fixed_pattern_find(name))
+        return isel_fixed_pattern_find(name)->kind == ISEL_FIXED_DIV ? 26 : 3;
+    if (strcmp(name, "mul") == 0 || strcmp(name, "imul") == 0)
+        return 3;
+    if (strcmp(name, "fadd") == 0 || strcmp(name, "fsub") == 0 || strcmp(name, "fmul") == 0)
+        return 4;
+    if (strcmp(name, "fdiv") == 0)
+        return 14;
+    if (strcmp(name, "uint_to_float") == 0 || strcmp(name, "sint_to_float") == 0 ||
+        strcmp(name, "float_to_uint") == 0 || strcmp(name, "float_to_sint") == 0 ||
+        strcmp(name, "f32_to_f64") == 0 || strcmp(name, "f64_to_f32") == 0)
+        return 5;
+    if (strcmp(name, "bitcast") == 0)
+        return 2;
+    return 1;
+}
+
+typedef struct _SchedValue {
+    Value * value;
+    size_t uses_left; // uses by statements in the block that haven't been placed yet
+} SchedValue;
+
+typedef struct _SchedNode {
+    Statement * statement;
+    size_t * succs; // nodes that have to be placed after this one
+    size_t pred_count; // predecessors that haven't been placed yet
+    uint64_t height; // latency of the longest dependency chain starting at this node
+    uint64_t ready_cycle; // when the results of all its predecessors are available
+} SchedNode;
+
+static uint8_t _sched_tracks(Value * value)
+{
+    return value && (value->variant == VALUE_SSA || value->variant == VALUE_ARG);
+}
+static size_t _sched_class(Value * value)
+{
+    return type_is_float(value->type) ? 1 : 0;
+}
+static SchedValue * _sched_value(SchedValue ** values, Value * value)
+{
+    if (value->temp >= array_len(*values, SchedValue) || (*values)[value->temp].value != value)
+    {
+        SchedValue v;
+        memset(&v, 0, sizeof(SchedValue));
+        v.value = value;
+        value->temp = array_len(*values, SchedValue);
+        array_push(*values, SchedValue, v);
+    }
+    return &(*values)[value->temp];
+}
+
+// how placing the statement would change the number of live values of the given class
+static int64_t _sched_pressure_delta(SchedValue ** values, Statement * statement, size_t class_)
+{
+    int64_t delta = 0;
+    if (statement->output && array_len(statement->output->edges_out, Statement *) > 0 &&
+        _sched_class(statement->output) == class_)
+        delta += 1;
+    for (size_t n = 0; n < array_len(statement->args, Operand); n++)
+    {
+        Value * value = statement->args[n].value;
+        if (statement->args[n].variant != OP_KIND_VALUE || !_sched_tracks(value) || _sched_class(value) != class_)
+            continue;
+        // only count each operand value once
+        size_t uses_here = 0;
+        uint8_t seen = 0;
+        for (size_t m = 0; m < array_len(statement->args, Operand); m++)
+        {
+            if (statement->args[m].variant == OP_KIND_VALUE && statement->args[m].value == value)
+            {
+                seen |= m < n;
+                uses_here += 1;
+            }
+        }
+        if (!seen && _sched_value(values, value)->uses_left == uses_here)
+            delta -= 1;
+    }
+    return delta;
+}
+
+static void _sched_place(Statement *** out, SchedValue ** values, size_t * live, Statement * statement)
+{
+    array_push(*out, Statement *, statement);
+    for (size_t n = 0; n < array_len(statement->args, Operand); n++)
+    {
+        Value * value = statement->args[n].value;
+        if (statement->args[n].variant != OP_KIND_VALUE || !_sched_tracks(value))
+            continue;
+        SchedValue * v = _sched_value(values, value);
+        assert(v->uses_left > 0);
+        v->uses_left -= 1;
+        if (v->uses_left == 0)
+            live[_sched_class(value)] -= 1;
+    }
+    if (statement->output && _sched_value(values, statement->output)->uses_left > 0)
+        live[_sched_class(statement->output)] += 1;
+}
+
+// schedules a run of statements that contains no calls or terminators
+static void _schedule_region(Statement ** in, size_t count, Statement *** out, SchedValue ** values, size_t * live)
+{
+    if (count < 3)
+    {
+        for (size_t i = 0; i < count; i++)
+            _sched_place(out, values, live, in[i]);
+        return;
+    }
+    
+    SchedNode * nodes = (SchedNode *)zero_alloc(sizeof(SchedNode) * count);
+    for (size_t i = 0; i < count; i++)
+    {
+        nodes[i].statement = in[i];
+        nodes[i].succs = (size_t *)zero_alloc(0);
+        in[i]->temp = i;
+    }
+    
+    // build the dependency graph
+    ptrdiff_t last_ordered = -1; // most recent store or other output-less statement
+    size_t * loads = (size_t *)zero_alloc(0); // loads since then
+    ptrdiff_t last_barrier = -1; // most recent output-less statement other than a store
+    size_t * stores = (size_t *)zero_alloc(0); // stores since then
+    for (size_t i = 0; i < count; i++)
+    {
+        Statement * statement = in[i];
+        for (size_t n = 0; n < array_len(statement->args, Operand); n++)
+        {
+            Value * value = statement->args[n].value;
+            if (statement->args[n].variant != OP_KIND_VALUE || !value || value->variant != VALUE_SSA)
+                continue;
+            Statement * def = value->ssa;
+            if (def->temp < count && in[def->temp] == def)
+            {
+                array_push(nodes[def->temp].succs, size_t, i);
+                nodes[i].pred_count += 1;
+            }
+        }
+        
+        uint8_t is_load = strcmp(statement->statement_name, "load") == 0;
+        uint8_t is_store = strcmp(statement->statement_name, "store") == 0;
+        uint8_t is_ordered = !statement->output || statement_has_side_effects(statement);
+        if (is_load)
+        {
+            // loads only have to wait for stores that might write to what they read
+            MemLoc loc = memloc_of_statement(statement);
+            for (size_t s = 0; s < array_len(stores, size_t); s++)
+            {
+                if (memlocs_may_alias(memloc_of_statement(in[stores[s]]), loc))
+                {
+                    array_push(nodes[stores[s]].succs, size_t, i);
+                    nodes[i].pred_count += 1;
+                }
+            }
+            if (last_barrier >= 0)
+            {
+                array_push(nodes[last_barrier].succs, size_t, i);
+                nodes[i].pred_count += 1;
+            }
+            array_push(loads, size_t, i);
+        }
+        else if (is_ordered)
+        {
+            if (last_ordered >= 0)
+            {
+                array_push(nodes[last_ordered].succs, size_t, i);
+                nodes[i].pred_count += 1;
+            }
+            for (size_t l = 0; l < array_len(loads, size_t); l++)
+            {
+                array_push(nodes[loads[l]].succs, size_t, i);
+                nodes[i].pred_count += 1;
+            }
+            loads = (size_t *)zero_alloc(0);
+            last_ordered = i;
+            if (is_store)
+                array_push(stores, size_t, i);
+            else
+            {
+                stores = (size_t *)zero_alloc(0);
+                last_barrier = i;
+            }
+        }
+    }
+    
+    for (size_t i = count; i > 0; i--)
+    {
+        SchedNode * node = &nodes[i - 1];
+        uint64_t latency = schedule_latency(node->statement);
+        node->height = latency;
+        for (size_t s = 0; s < array_len(node->succs, size_t); s++)
+        {
+            uint64_t height = latency + nodes[node->succs[s]].height;
+            if (height > node->height)
+                node->height = height;
+        }
+    }
+    
+    uint8_t * placed = (uint8_t *)zero_alloc(count);
+    uint64_t cycle = 0;
+    for (size_t done = 0; done < count; done++)
+    {
+        uint8_t crowded[2] = {live[0] >= SCHEDULE_MAX_LIVE_INT, live[1] >= SCHEDULE_MAX_LIVE_FLOAT};
+        
+        // prefer: not adding to a crowded register class, then being ready this cycle, then the longest chain, then
+        // the original order
+        ptrdiff_t best = -1;
+        uint8_t best_relieves = 0;
+        for (size_t i = 0; i < count; i++)
+        {
+            if (placed[i] || nodes[i].pred_count > 0)
+                continue;
+            uint8_t relieves = !((crowded[0] && _sched_pressure_delta(values, nodes[i].statement, 0) > 0) ||
+                                 (crowded[1] && _sched_pressure_delta(values, nodes[i].statement, 1) > 0));
+            if (best < 0)
+            {
+                best = i;
+                best_relieves = relieves;
+                continue;
+            }
+            if (relieves != best_relieves)
+            {
+                if (relieves)
+                {
+                    best = i;
+                    best_relieves = relieves;
+                }
+                continue;
+            }
+            uint8_t ready = nodes[i].ready_cycle <= cycle;
+            uint8_t best_ready = nodes[best].ready_cycle <= cycle;
+            if (ready != best_ready)
+            {
+                if (ready)
+                    best = i;
+                continue;
+            }
+            if (!ready && nodes[i].ready_cycle != nodes[best].ready_cycle)
+            {
+                if (nodes[i].ready_cycle < nodes[best].ready_cycle)
+                    best = i;
+                continue;
+            }
+            if (nodes[i].height > nodes[best].height)
+                best = i;
+        }
+        assert(best >= 0);
+        
+        SchedNode * node = &nodes[best];
+        if (node->ready_cycle > cycle)
+            cycle = node->ready_cycle;
+        placed[best] = 1;
+        _sched_place(out, values, live, node->statement);
+        
+        uint64_t result_cycle = cycle + schedule_latency(node->statement);
+        for (size_t s = 0; s < array_len(node->succs, size_t); s++)
+        {
+            SchedNode * succ = &nodes[node->succs[s]];
+            succ->pred_count -= 1;
+            if (result_cycle > succ->ready_cycle)
+                succ->ready_cycle = result_cycle;
+        }
+        cycle += 1;
+    }
+}
+
+static void schedule_block(Function * func, Block * block, Liveness * liveness, size_t block_index)
+{
+    size_t count = array_len(block->statements, Statement *);
+    if (count < 4)
+        return;
+    
+    // values from outside the block's statements are live from the start, unless nothing ever really uses them
+    // (checked before anything else here reuses their temp fields)
+    Value ** args = block == func->entry_block ? func->args : block->args;
+    uint8_t * arg_live = (uint8_t *)zero_alloc(array_len(args, Value *) + 1);
+    for (size_t i = 0; i < array_len(args, Value *); i++)
+        arg_live[i] = liveness_value_is_live_in(liveness, block_index, args[i]);
+    
+    SchedValue * values = (SchedValue *)zero_alloc(0);
+    size_t live[2] = {0, 0};
+    for (size_t i = 0; i < count; i++)
+    {
+        Statement * statement = block->statements[i];
+        for (size_t n = 0; n < array_len(statement->args, Operand); n++)
+        {
+            Value * value = statement->args[n].value;
+            if (statement->args[n].variant == OP_KIND_VALUE && _sched_tracks(value))
+                _sched_value(&values, value)->uses_left += 1;
+        }
+    }
+    for (size_t i = 0; i < array_len(args, Value *); i++)
+    {
+        if (arg_live[i] && _sched_value(&values, args[i])->uses_left > 0)
+            live[_sched_class(args[i])] += 1;
+    }
+    
+    // the terminator stays last, and the statement before an `if` stays right before it
+    size_t fixed_tail = 1;
+    if (strcmp(block->statements[count - 1]->statement_name, "if") == 0)
+        fixed_tail = 2;
+    
+    Statement ** out = (Statement **)zero_alloc(0);
+    size_t region_start = 0;
+    for (size_t i = 0; i < count - fixed_tail; i++)
+    {
+        Statement * statement = block->statements[i];
+        if (strcmp(statement->statement_name, "call") == 0 || strcmp(statement->statement_name, "call_eval") == 0)
+        {
+            _schedule_region(block->statements + region_start, i - region_start, &out, &values, live);
+            _sched_place(&out, &values, live, statement);
+            region_start = i + 1;
+        }
+    }
+    _schedule_region(block->statements + region_start, count - fixed_tail - region_start, &out, &values, live);
+    for (size_t i = count - fixed_tail; i < count; i++)
+        _sched_place(&out, &values, live, block->statements[i]);
+    
+    assert(array_len(out, Statement *) == count);
+    block->statements = out;
+    
+    // uses have to be in statement order for register allocation
+    for (size_t i = 0; i < count; i++)
+        block->statements[i]->temp = i;
+    for (size_t i = 0; i < array_len(values, SchedValue); i++)
+        value_sort_edges_out(values[i].value);
+}
+
+static void do_scheduling(Program * program)
+{
+    for (size_t f = 0; f < array_len(program->functions, Function *); f++)
+    {
+        Function * func = program->functions[f];
+        Liveness liveness = func_analyze_liveness(func);
+        for (size_t b = 0; b < array_len(func->blocks, Block *); b++)
+            schedule_block(func, func->blocks[b], &liveness, b);
+    }
+}
+
+#endif // BBAE_SCHEDULE
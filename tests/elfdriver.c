@@ -0,0 +1,24 @@
+#include <stdint.h>
+#include <stdio.h>
+
+// Links against tests/elftest.o, which tests.c writes with do_elf_lowering.
+
+extern int64_t counter;
+int64_t elf_entry(int64_t n);
+double scale(double n);
+
+int64_t elf_callback(int64_t n)
+{
+    return n * 100;
+}
+
+int main(void)
+{
+    int64_t ret = elf_entry(3);
+    // counter is 3 after the first call to bump and 8 after the second
+    if (ret != 3 + 800 || counter != 8)
+        return printf("elf_entry: got %lld, counter %lld\n", (long long)ret, (long long)counter), 1;
+    if (scale(10.0) != 2.5)
+        return puts("scale: wrong result"), 1;
+    return 0;
+}
@@ -582,7 +582,7 @@ direct:
                 if (op_byte & 0x40) {
                     if (UNLIKELY((off += 1) > len))
                         return FD_ERR_PARTIAL;
-                    instr->disp = (int8_t) LOAD_LE_1(dispbase) << dispscale;
+                    instr->disp = (int8_t) LOAD_LE_1(dispbase) * (1 << dispscale);
                 } else if (op_byte & 0x80 || (op_byte < 0x40 && base == 5)) {
                     if (UNLIKELY((off += 4) > len))
                         return FD_ERR_PARTIAL;
@@ -287,7 +287,9 @@ enc_mr(uint8_t** restrict buf, uint64_t opc, uint64_t epfx, uint64_t op0,
                 mod = 0x80;
                 dispsz = 4;
             }
-        } else if (rm == 5) {
+        } else if (rm == 5 || (rm == 4 && base == 5)) {
+            // rbp/r13 as the base (including as the SIB base) needs an explicit zero disp8, since without one
+            // that encoding means there's no base register at all
             mod = 0x40;
             dispsz = 1;
         }
@@ -373,12 +375,8 @@ fe_enc64_impl(uint8_t** restrict buf, uint64_t opc, FeOp op0, FeOp op1,
     // Doesn't change between variants
     if ((opc & OPC_GPH_OP0) && op_reg_gpl(op0) && op0 >= FE_SP)
         epfx |= EPFX_REX;
-    else if (!(opc & OPC_GPH_OP0) && op_reg_gph(op0))
-        goto fail;
     if ((opc & OPC_GPH_OP1) && op_reg_gpl(op1) && op1 >= FE_SP)
         epfx |= EPFX_REX;
-    else if (!(opc & OPC_GPH_OP1) && op_reg_gph(op1))
-        goto fail;
 
 try_encode:
     {
@@ -391,6 +389,13 @@ try_encode:
         if (UNLIKELY(ei->zregidx && op_reg_idx(ops[ei->zregidx^3]) != ei->zregval))
             goto next;
 
+        // NOTE: EDITED: immediates from 0x204 to 0x207 look like AH/CH/DH/BH, so only reject high byte registers in
+        // operands that aren't the immediate (this used to be checked once, up front, for every operand)
+        if (!(opc & OPC_GPH_OP0) && op_reg_gph(op0) && !(ei->immctl && ei->immidx == 0))
+            goto fail;
+        if (!(opc & OPC_GPH_OP1) && op_reg_gph(op1) && !(ei->immctl && ei->immidx == 1))
+            goto fail;
+
         if (UNLIKELY(enc == ENC_S)) {
             if ((op_reg_idx(op0) << 3 & 0x20) != (opc & 0x20)) goto next;
             opc |= op_reg_idx(op0) << 3;